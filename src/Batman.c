@@ -29,6 +29,7 @@
 #include "Network.h"
 #include "Misc.h"
 #include "Time.h"
+#include "Pool.h"
 #include "Debug.h"
 
 #ifndef BATMAN_DEBUG
@@ -60,11 +61,36 @@ typedef struct {
 #define BATMAN_BIDIR_LINK_TIMEOUT BATMAN_WINDOW_SIZE / 2
 #define BATMAN_PURGE_TIMEOUT (10ul*BATMAN_WINDOW_SIZE*BATMAN_ORIGINATOR_INVERVAL)
 
+/* Host builds keep originators in a table indexed by address and sweep
+ * timed out entries from Batman_Update. Define BATMAN_LIST to get the
+ * linked list version the AVR uses.
+ */
+#if !defined(AVR) && !defined(BATMAN_LIST)
+#   define BATMAN_TABLE
+#endif
+
+#ifdef BATMAN_TABLE
+#   define BATMAN_MAX_ORIGINATORS   256
+#   define BATMAN_MAX_NEIGHBORS     32 /* must be a power of 2 */
+#   define BATMAN_PRUNE_INTERVAL    BATMAN_ORIGINATOR_INVERVAL
+#   define BATMAN_EMPTY_SLOT        NETWORK_BROADCAST_ADDRESS
+#else
+/* Pool capacity on AVR, slab size elsewhere */
+#   ifndef BATMAN_POOL_ORIGINATORS
+#       define BATMAN_POOL_ORIGINATORS  8
+#   endif
+#   ifndef BATMAN_POOL_NEIGHBORS
+#       define BATMAN_POOL_NEIGHBORS    16
+#   endif
+#endif
+
 
 
 struct _Batman_Originator;
 typedef struct _Batman_Neighbor {
+#ifndef BATMAN_TABLE
     struct _Batman_Neighbor* Next;
+#endif
     uint32_t LastValidTime;
     uint8_t LastTTL;
     uint8_t Address; // back-pointer to originator
@@ -72,12 +98,18 @@ typedef struct _Batman_Neighbor {
 } Batman_Neighbor;
 
 typedef struct _Batman_Originator {
+#ifdef BATMAN_TABLE
+    Batman_Neighbor Neighbors[BATMAN_MAX_NEIGHBORS]; // open addressed, keyed by address
+    uint8_t NeighborCount;
+    uint8_t InUse;
+#else
     struct _Batman_Originator* Next;
+    Batman_Neighbor* Neighbors;
+#endif
     uint8_t Address;
     uint32_t LastAwareTime;
     uint16_t BiDirLinkSequenceNumber;
     uint16_t CurrentSequenceNumber;
-    Batman_Neighbor* Neighbors;
 } Batman_Originator;
 
 typedef struct _Batman_Originator_List_Node {
@@ -88,16 +120,211 @@ typedef struct _Batman_Originator_List_Node {
 
 
 
+#ifdef BATMAN_TABLE
+static Batman_Originator s_Originators[BATMAN_MAX_ORIGINATORS];
+static uint32_t s_LastPruneTime NOINIT;
+#else
 static Batman_Originator* s_Originators NOINIT;
+POOL_DEFINE(s_OriginatorPool, sizeof(Batman_Originator), BATMAN_POOL_ORIGINATORS);
+POOL_DEFINE(s_NeighborPool, sizeof(Batman_Neighbor), BATMAN_POOL_NEIGHBORS);
+#endif
 static uint16_t s_SequenceNumber NOINIT;
 static uint32_t s_LastOgmBroadcastTime NOINIT;
 #ifdef BATMAN_DEBUG
 static uint8_t s_Dst NOINIT;
 #endif
 
+static
+uint8_t
+SelectNeighbor(Batman_Originator* o, uint32_t time) {
+    Batman_Neighbor* best = NULL;
+    uint8_t bestOgmsReceived = 0;
+#ifdef BATMAN_TABLE
+    for (uint8_t i = 0; i < BATMAN_MAX_NEIGHBORS; ++i) {
+        Batman_Neighbor* n = &o->Neighbors[i];
+        if (n->Address == BATMAN_EMPTY_SLOT) {
+            continue;
+        }
+#else
+    for (Batman_Neighbor* n = o->Neighbors; n; n = n->Next) {
+#endif
+        //DEBUG_P("Batman: Looking at neighbor %02x ... ", n->Address);
+        uint8_t ogmsReceived = __builtin_popcount(n->OgmsReceivedInWindow);
+        if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, n->LastValidTime) && ogmsReceived) {
+            //DEBUG_P("eligible\n");
+            if (!best || bestOgmsReceived < ogmsReceived) {
+                best = n;
+                bestOgmsReceived = ogmsReceived;
+            }
+        } else {
+            //DEBUG_P("obsolete\n");
+        }
+    }
+
+    return best ? best->Address : NETWORK_BROADCAST_ADDRESS;
+}
+
+#ifdef BATMAN_TABLE
+
+/* Best next hop per destination. Entries are recomputed when an OGM
+ * changes a neighbor's window and by the prune sweep, which keeps
+ * Route() down to a single load.
+ */
+static uint8_t s_NextHop[BATMAN_MAX_ORIGINATORS];
+
+static
+inline
+void
+UpdateNextHop(Batman_Originator* o, uint32_t time) {
+    s_NextHop[o->Address] = SelectNeighbor(o, time);
+}
+
+static
+void
+ClearOriginator(Batman_Originator* o) {
+    memset(o, 0, sizeof(*o));
+    for (uint8_t i = 0; i < BATMAN_MAX_NEIGHBORS; ++i) {
+        o->Neighbors[i].Address = BATMAN_EMPTY_SLOT;
+    }
+}
+
+void
+Batman_Init() {
+    for (uint16_t i = 0; i < BATMAN_MAX_ORIGINATORS; ++i) {
+        ClearOriginator(&s_Originators[i]);
+    }
+    memset(s_NextHop, NETWORK_BROADCAST_ADDRESS, sizeof(s_NextHop));
+    s_LastOgmBroadcastTime = Time_Now() - BATMAN_ORIGINATOR_INVERVAL;
+    s_LastPruneTime = Time_Now();
+    DEBUG_P("Batman: init\n");
+}
+
+void
+Batman_Uninit() {
+    DEBUG_P("Batman: uninit\n");
+    for (uint16_t i = 0; i < BATMAN_MAX_ORIGINATORS; ++i) {
+        s_Originators[i].InUse = 0;
+    }
+    memset(s_NextHop, NETWORK_BROADCAST_ADDRESS, sizeof(s_NextHop));
+}
+
+static
+Batman_Neighbor*
+FindNeighborSlot(Batman_Originator* owner, uint8_t id) {
+    uint8_t slot = id & (BATMAN_MAX_NEIGHBORS - 1);
+    for (uint8_t i = 0; i < BATMAN_MAX_NEIGHBORS; ++i) {
+        Batman_Neighbor* n = &owner->Neighbors[slot];
+        if (n->Address == id || n->Address == BATMAN_EMPTY_SLOT) {
+            return n;
+        }
+        slot = (slot + 1) & (BATMAN_MAX_NEIGHBORS - 1);
+    }
+    return NULL;
+}
+
+static
+void
+PruneTimedOutNeigbors(Batman_Originator* owner, uint32_t time) {
+    Batman_Neighbor live[BATMAN_MAX_NEIGHBORS];
+    uint8_t count = 0;
+
+    if (!owner->NeighborCount) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < BATMAN_MAX_NEIGHBORS; ++i) {
+        Batman_Neighbor* n = &owner->Neighbors[i];
+        if (n->Address == BATMAN_EMPTY_SLOT) {
+            continue;
+        }
+
+        if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, n->LastValidTime)) {
+            live[count++] = *n;
+        } else {
+            DEBUG_P("Batman: prune neighbor %#02x of originator %#02x\n", n->Address, owner->Address);
+        }
+        n->Address = BATMAN_EMPTY_SLOT;
+    }
+
+    // re-insert survivors so probe chains stay intact
+    owner->NeighborCount = count;
+    while (count) {
+        --count;
+        *FindNeighborSlot(owner, live[count].Address) = live[count];
+    }
+}
+
+static
+void
+PruneTimedOutOriginators(uint32_t time) {
+    for (uint16_t i = 0; i < BATMAN_MAX_ORIGINATORS; ++i) {
+        Batman_Originator* o = &s_Originators[i];
+        if (!o->InUse) {
+            continue;
+        }
+
+        if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, o->LastAwareTime)) {
+            PruneTimedOutNeigbors(o, time);
+            UpdateNextHop(o, time);
+        } else {
+            DEBUG_P("Batman: prune originator %#02x\n", o->Address);
+            o->InUse = 0;
+            s_NextHop[o->Address] = NETWORK_BROADCAST_ADDRESS;
+        }
+    }
+}
+
+static
+Batman_Originator*
+FindOriginator(uint8_t id, uint32_t time) {
+    Batman_Originator* o = &s_Originators[id];
+    // entries that timed out but haven't been swept yet are gone
+    if (o->InUse && IsInWindow32(time, BATMAN_PURGE_TIMEOUT, o->LastAwareTime)) {
+        return o;
+    }
+    return NULL;
+}
+
+static
+Batman_Originator*
+GetOrCreateOriginator(uint8_t id, uint32_t time) {
+    Batman_Originator* result = FindOriginator(id, time);
+    if (!result) {
+        DEBUG_P("Batman: create originator %#02x\n", id);
+        result = &s_Originators[id];
+        ClearOriginator(result);
+        result->Address = id;
+        result->InUse = 1;
+        s_NextHop[id] = NETWORK_BROADCAST_ADDRESS;
+    }
+    return result;
+}
+
+static
+Batman_Neighbor*
+GetOrCreateNeighbor(Batman_Originator* owner, uint8_t id, uint32_t time) {
+    Batman_Neighbor* result = FindNeighborSlot(owner, id);
+    if (result) {
+        if (result->Address == BATMAN_EMPTY_SLOT) {
+            DEBUG_P("Batman: create neighbor %#02x of originator %#02x\n", id, owner->Address);
+            memset(result, 0, sizeof(*result));
+            result->Address = id;
+            ++owner->NeighborCount;
+        } else if (!IsInWindow32(time, BATMAN_PURGE_TIMEOUT, result->LastValidTime)) {
+            memset(result, 0, sizeof(*result));
+            result->Address = id;
+        }
+    }
+    return result;
+}
+
+#else /* BATMAN_TABLE */
+
 void
 Batman_Init() {
     s_Originators = NULL;
+    POOL_INIT(s_OriginatorPool, "Batman originators", sizeof(Batman_Originator), BATMAN_POOL_ORIGINATORS);
+    POOL_INIT(s_NeighborPool, "Batman neighbors", sizeof(Batman_Neighbor), BATMAN_POOL_NEIGHBORS);
     s_LastOgmBroadcastTime = Time_Now() - BATMAN_ORIGINATOR_INVERVAL;
     DEBUG_P("Batman: init\n");
 }
@@ -108,9 +335,9 @@ FreeOriginator(Batman_Originator* o) {
     while (o->Neighbors) {
         Batman_Neighbor* n = o->Neighbors;
         o->Neighbors = o->Neighbors->Next;
-        free(n);
+        Pool_Free(&s_NeighborPool, n);
     }
-    free(o);
+    Pool_Free(&s_OriginatorPool, o);
 }
 
 static
@@ -125,7 +352,7 @@ PruneTimedOutNeigbors(Batman_Originator* owner, uint32_t time) {
             newHead = n;
         } else {
             DEBUG_P("Batman: prune neighbor %#02x of originator %#02x\n", n->Address, owner->Address);
-            free(n);
+            Pool_Free(&s_NeighborPool, n);
         }
     }
 
@@ -140,12 +367,35 @@ Batman_Uninit() {
         FreeOriginator(s_Originators);
         s_Originators = next;
     }
+    Pool_Uninit(&s_NeighborPool);
+    Pool_Uninit(&s_OriginatorPool);
+}
+
+static
+void
+PruneTimedOutOriginators(uint32_t time) {
+    Batman_Originator* newHead = NULL;
+    while (s_Originators) {
+        Batman_Originator* o = s_Originators;
+        s_Originators = s_Originators->Next;
+        if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, o->LastAwareTime)) {
+            PruneTimedOutNeigbors(o, time);
+            o->Next = newHead;
+            newHead = o;
+        } else {
+            DEBUG_P("Batman: prune originator %#02x\n", o->Address);
+            FreeOriginator(o);
+        }
+    }
+
+    s_Originators = newHead;
 }
 
 
 static
 Batman_Originator*
-FindOriginator(uint8_t id) {
+FindOriginator(uint8_t id, uint32_t time) {
+    (void)time;
     for (Batman_Originator* o = s_Originators; o; o = o->Next) {
         if (o->Address == id) {
             return o;
@@ -154,13 +404,39 @@ FindOriginator(uint8_t id) {
     return NULL;
 }
 
+/* Frees the originator heard from longest ago, but none heard from at
+ * time, which may be the sender of the OGM being processed.
+ */
+static
+void
+EvictStalestOriginator(uint32_t time) {
+    Batman_Originator** stalest = NULL;
+    for (Batman_Originator** link = &s_Originators; *link; link = &(*link)->Next) {
+        const uint32_t age = time - (*link)->LastAwareTime;
+        if (age && (!stalest || age > time - (*stalest)->LastAwareTime)) {
+            stalest = link;
+        }
+    }
+
+    if (stalest) {
+        Batman_Originator* o = *stalest;
+        DEBUG_P("Batman: evict originator %#02x\n", o->Address);
+        *stalest = o->Next;
+        FreeOriginator(o);
+    }
+}
+
 static
 Batman_Originator*
-GetOrCreateOriginator(uint8_t id) {
-    Batman_Originator* result = FindOriginator(id);
+GetOrCreateOriginator(uint8_t id, uint32_t time) {
+    Batman_Originator* result = FindOriginator(id, time);
     if (!result) {
         DEBUG_P("Batman: create originator %#02x\n", id);
-        result = (Batman_Originator*)malloc(sizeof(*result));
+        result = (Batman_Originator*)Pool_Alloc(&s_OriginatorPool);
+        if (!result) {
+            EvictStalestOriginator(time);
+            result = (Batman_Originator*)Pool_Alloc(&s_OriginatorPool);
+        }
         if (result) {
             memset(result, 0, sizeof(*result));
             result->Address = id;
@@ -192,11 +468,12 @@ FindNeighbor(Batman_Neighbor* head, uint8_t id) {
 
 static
 Batman_Neighbor*
-GetOrCreateNeighbor(Batman_Originator* owner, uint8_t id) {
+GetOrCreateNeighbor(Batman_Originator* owner, uint8_t id, uint32_t time) {
+    (void)time;
     Batman_Neighbor* result = FindNeighbor(owner->Neighbors, id);
     if (!result) {
         DEBUG_P("Batman: create neighbor %#02x of originator %#02x\n", id, owner->Address);
-        result = (Batman_Neighbor*)malloc(sizeof(*result));
+        result = (Batman_Neighbor*)Pool_Alloc(&s_NeighborPool);
         if (result) {
             memset(result, 0, sizeof(*result));
             result->Address = id;
@@ -207,6 +484,8 @@ GetOrCreateNeighbor(Batman_Originator* owner, uint8_t id) {
     return result;
 }
 
+#endif /* !BATMAN_TABLE */
+
 
 
 static
@@ -240,29 +519,25 @@ static
 uint8_t
 Route(uint8_t destination, uint32_t time) {
     //DEBUG_P("Batman: Route lookup for %02x\n", destination);
+#ifdef BATMAN_TABLE
+    uint8_t neighborId = s_NextHop[destination];
+    if (neighborId != NETWORK_BROADCAST_ADDRESS) {
+        // the cached hop may have timed out since the last sweep
+        Batman_Originator* o = FindOriginator(destination, time);
+        Batman_Neighbor* n = o ? FindNeighborSlot(o, neighborId) : NULL;
+        if (!n || n->Address != neighborId ||
+            !IsInWindow32(time, BATMAN_PURGE_TIMEOUT, n->LastValidTime)) {
+            neighborId = o ? SelectNeighbor(o, time) : NETWORK_BROADCAST_ADDRESS;
+            s_NextHop[destination] = neighborId;
+        }
+    }
+#else
     uint8_t neighborId = NETWORK_BROADCAST_ADDRESS; // broadcast
-    Batman_Originator* o = FindOriginator(destination);
+    Batman_Originator* o = FindOriginator(destination, time);
     if (o) {
-        Batman_Neighbor* best = NULL;
-        uint8_t bestOgmsReceived = 0;
-        for (Batman_Neighbor* n = o->Neighbors; n; n = n->Next) {
-            //DEBUG_P("Batman: Looking at neighbor %02x ... ", n->Address);
-            uint8_t ogmsReceived = __builtin_popcount(n->OgmsReceivedInWindow);
-            if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, n->LastValidTime) && ogmsReceived) {
-                //DEBUG_P("eligible\n");
-                if (!best || bestOgmsReceived < ogmsReceived) {
-                    best = n;
-                    bestOgmsReceived = ogmsReceived;
-                }
-            } else {
-                //DEBUG_P("obsolete\n");
-            }
-        }
-
-        if (best) {
-            neighborId = best->Address;
-        }
+        neighborId = SelectNeighbor(o, time);
     }
+#endif
 #ifdef BATMAN_DEBUG
     if (destination != s_Dst) {
         s_Dst = destination;
@@ -301,26 +576,6 @@ BroadcastOgm() {
     Network_Send(&packet);
 }
 
-static
-void
-PruneTimedOutOriginators(uint32_t time) {
-    Batman_Originator* newHead = NULL;
-    while (s_Originators) {
-        Batman_Originator* o = s_Originators;
-        s_Originators = s_Originators->Next;
-        if (IsInWindow32(time, BATMAN_PURGE_TIMEOUT, o->LastAwareTime)) {
-            PruneTimedOutNeigbors(o, time);
-            o->Next = newHead;
-            newHead = o;
-        } else {
-            DEBUG_P("Batman: prune originator %#02x\n", o->Address);
-            FreeOriginator(o);
-        }
-    }
-
-    s_Originators = newHead;
-}
-
 void
 Batman_Process(NetworkPacket* packet) {
     Batman_OGM_Payload* ogm = (Batman_OGM_Payload*)&packet->Payload;
@@ -329,7 +584,9 @@ Batman_Process(NetworkPacket* packet) {
     const uint8_t myId = Network_GetAddress();
     const uint32_t now = Time_Now();
 
+#ifndef BATMAN_TABLE
     PruneTimedOutOriginators(now);
+#endif
 
     if (ogm->Sender == myId) {
         return; // as per section 5.2. number 2
@@ -339,7 +596,7 @@ Batman_Process(NetworkPacket* packet) {
         return; // as per section 5.2. number 3
     }
 
-    Batman_Originator* sender = GetOrCreateOriginator(ogm->Sender);
+    Batman_Originator* sender = GetOrCreateOriginator(ogm->Sender, now);
     if (!sender) {
         return;
     }
@@ -357,7 +614,7 @@ Batman_Process(NetworkPacket* packet) {
         return; // as per section 5.2. number 4
     }
 
-    Batman_Originator* originator = GetOrCreateOriginator(ogm->Originator);
+    Batman_Originator* originator = GetOrCreateOriginator(ogm->Originator, now);
     if (!originator) {
         return;  // out of memory
     }
@@ -377,8 +634,11 @@ Batman_Process(NetworkPacket* packet) {
 
     if (receivedViaBiDirLink) {
         // Section 5.4. processing, neighbor ranking
-        neighbor = GetOrCreateNeighbor(originator, ogm->Sender);
+        neighbor = GetOrCreateNeighbor(originator, ogm->Sender, now);
         if (neighbor) {
+#ifdef BATMAN_TABLE
+            const uint16_t previousWindow = neighbor->OgmsReceivedInWindow;
+#endif
             neighbor->LastValidTime = now;
             //DEBUG_P("Batman: ori seq %u ogm %u, window %d\n", originator->CurrentSequenceNumber, ogm->SequenceNumber, BATMAN_WINDOW_SIZE);
             if (IsInWindow16(originator->CurrentSequenceNumber, BATMAN_WINDOW_SIZE, ogm->SequenceNumber)) {
@@ -406,6 +666,11 @@ Batman_Process(NetworkPacket* packet) {
             }
 
             //DEBUG_P("Batman: Ori %02x via nei %02x rank %u\n", ogm->Originator, ogm->Sender, neighbor->OgmsReceivedInWindow);
+#ifdef BATMAN_TABLE
+            if (previousWindow != neighbor->OgmsReceivedInWindow) {
+                UpdateNextHop(originator, now);
+            }
+#endif
         }
     }
 
@@ -429,7 +694,14 @@ void
 Batman_Update() {
     const uint32_t now = Time_Now();
 
+#ifdef BATMAN_TABLE
+    if (now - s_LastPruneTime >= BATMAN_PRUNE_INTERVAL) {
+        s_LastPruneTime = now;
+        PruneTimedOutOriginators(now);
+    }
+#else
     PruneTimedOutOriginators(now);
+#endif
 
     if (now - s_LastOgmBroadcastTime >= BATMAN_ORIGINATOR_INVERVAL) {
         s_LastOgmBroadcastTime = now;
@@ -0,0 +1,177 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "Pool.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef POOL_STATIC
+typedef struct _Pool_Slab {
+    struct _Pool_Slab* Next;
+} Pool_Slab;
+
+static Pool* s_Pools;
+
+static
+void
+Unlink(Pool* pool) {
+    for (Pool** link = &s_Pools; *link; link = &(*link)->Next) {
+        if (*link == pool) {
+            *link = pool->Next;
+            break;
+        }
+    }
+}
+#endif
+
+static
+void
+AddBlocks(Pool* pool, uint8_t* storage, uint16_t blocks) {
+    for (uint16_t i = 0; i < blocks; ++i) {
+        Pool_Block* block = (Pool_Block*)(storage + (size_t)i * pool->BlockSize);
+        block->Next = pool->Free;
+        pool->Free = block;
+    }
+    pool->Capacity += blocks;
+}
+
+#ifdef POOL_STATIC
+void
+Pool_Init(Pool* pool, void* storage, uint16_t blockSize, uint16_t blocks) {
+    memset(pool, 0, sizeof(*pool));
+    pool->BlockSize = POOL_BLOCK_SIZE(blockSize);
+    AddBlocks(pool, (uint8_t*)storage, blocks);
+}
+
+void
+Pool_Uninit(Pool* pool) {
+    pool->Free = NULL;
+    pool->Capacity = 0;
+    pool->Used = 0;
+}
+#else
+void
+Pool_Init(Pool* pool, const char* name, uint16_t blockSize, uint16_t slabBlocks) {
+    Pool_Uninit(pool); // slabs of an earlier init
+    memset(pool, 0, sizeof(*pool));
+    pool->Name = name;
+    pool->BlockSize = POOL_BLOCK_SIZE(blockSize);
+    pool->SlabBlocks = slabBlocks ? slabBlocks : 1;
+    pool->Next = s_Pools;
+    s_Pools = pool;
+}
+
+void
+Pool_Uninit(Pool* pool) {
+    while (pool->Slabs) {
+        Pool_Slab* slab = pool->Slabs;
+        pool->Slabs = slab->Next;
+        free(slab);
+    }
+
+    pool->Free = NULL;
+    pool->Capacity = 0;
+    pool->Used = 0;
+    Unlink(pool);
+}
+
+Pool*
+Pool_First() {
+    return s_Pools;
+}
+
+size_t
+Pool_Footprint(const Pool* pool) {
+    size_t slabs = pool->Capacity / pool->SlabBlocks;
+    return slabs * sizeof(Pool_Slab) + (size_t)pool->Capacity * pool->BlockSize;
+}
+#endif
+
+#ifndef POOL_STATIC
+static
+int8_t
+Grow(Pool* pool) {
+    if (pool->Capacity > UINT16_MAX - pool->SlabBlocks) {
+        return 0;
+    }
+
+    Pool_Slab* slab = (Pool_Slab*)malloc(sizeof(*slab) + (size_t)pool->SlabBlocks * pool->BlockSize);
+    if (!slab) {
+        return 0;
+    }
+
+    slab->Next = pool->Slabs;
+    pool->Slabs = slab;
+    AddBlocks(pool, (uint8_t*)(slab + 1), pool->SlabBlocks);
+    return 1;
+}
+#endif
+
+int8_t
+Pool_Reserve(Pool* pool, uint16_t blocks) {
+#ifndef POOL_STATIC
+    while (pool->Capacity - pool->Used < blocks) {
+        if (!Grow(pool)) {
+            return 0;
+        }
+    }
+    return 1;
+#else
+    return pool->Capacity - pool->Used >= blocks;
+#endif
+}
+
+void*
+Pool_Alloc(Pool* pool) {
+#ifndef POOL_STATIC
+    if (!pool->Free) {
+        Grow(pool);
+    }
+#endif
+
+    Pool_Block* block = pool->Free;
+    if (!block) {
+        if (pool->Failures != UINT16_MAX) {
+            ++pool->Failures;
+        }
+        return NULL;
+    }
+
+    pool->Free = block->Next;
+    if (++pool->Used > pool->HighWater) {
+        pool->HighWater = pool->Used;
+    }
+
+    return block;
+}
+
+void
+Pool_Free(Pool* pool, void* ptr) {
+    if (ptr) {
+        Pool_Block* block = (Pool_Block*)ptr;
+        block->Next = pool->Free;
+        pool->Free = block;
+        --pool->Used;
+    }
+}
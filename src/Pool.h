@@ -0,0 +1,105 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Misc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pool of fixed size blocks for the protocol modules.
+ *
+ * On AVR, or with POOL_STATIC defined, a pool is carved from static
+ * storage and never holds more than the number of blocks given at compile
+ * time. Elsewhere it grows by slabs of that many blocks which are released
+ * by Pool_Uninit.
+ *
+ * Use POOL_DEFINE and POOL_INIT rather than Pool_Init directly.
+ */
+
+#if defined(AVR) && !defined(POOL_STATIC)
+#   define POOL_STATIC
+#endif
+
+typedef struct _Pool_Block {
+    struct _Pool_Block* Next;
+} Pool_Block;
+
+typedef struct _Pool {
+    Pool_Block* Free;
+#ifndef POOL_STATIC
+    struct _Pool* Next;         /* list of all pools, see Pool_First */
+    const char* Name;
+    struct _Pool_Slab* Slabs;
+    uint16_t SlabBlocks;
+#endif
+    uint16_t BlockSize;
+    uint16_t Capacity;          /* blocks owned by the pool */
+    uint16_t Used;
+    uint16_t HighWater;         /* max of Used since init */
+    uint16_t Failures;          /* allocations that returned NULL */
+} Pool;
+
+#define POOL_BLOCK_SIZE(size) \
+    ((((size) < sizeof(Pool_Block) ? sizeof(Pool_Block) : (size)) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*))
+
+#ifdef POOL_STATIC
+#   define POOL_DEFINE(pool, size, blocks) \
+        static uint8_t JOIN(pool, _Storage)[POOL_BLOCK_SIZE(size) * (blocks)] NOINIT; \
+        static Pool pool NOINIT
+#   define POOL_INIT(pool, name, size, blocks) \
+        Pool_Init(&pool, JOIN(pool, _Storage), size, blocks)
+void Pool_Init(Pool* pool, void* storage, uint16_t blockSize, uint16_t blocks);
+#else
+#   define POOL_DEFINE(pool, size, blocks) \
+        static Pool pool
+#   define POOL_INIT(pool, name, size, blocks) \
+        Pool_Init(&pool, name, size, blocks)
+void Pool_Init(Pool* pool, const char* name, uint16_t blockSize, uint16_t slabBlocks);
+
+/* Returns the first of all initialized pools, continue with pool->Next */
+Pool* Pool_First();
+
+/* Returns the bytes of memory held by the pool */
+size_t Pool_Footprint(const Pool* pool);
+#endif
+
+void Pool_Uninit(Pool* pool);
+/* Makes sure the next blocks allocations succeed. Returns 0 if the pool
+ * can't hold that many more blocks.
+ */
+int8_t Pool_Reserve(Pool* pool, uint16_t blocks);
+void* Pool_Alloc(Pool* pool);
+void Pool_Free(Pool* pool, void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H */
@@ -0,0 +1,162 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "Reading.h"
+
+#include <string.h>
+
+
+uint8_t
+Reading_Encode(uint8_t* buffer, uint8_t size, const Reading* reading) {
+    const uint8_t bytes = READING_BINARY_SIZE + reading->NameLength;
+    if (bytes > size || reading->NameLength > READING_NAME_SIZE) {
+        return 0;
+    }
+
+    buffer[0] = READING_BINARY_MARKER;
+    buffer[1] = (uint8_t)reading->Temperature;
+    buffer[2] = (uint8_t)reading->Humidity;
+    buffer[3] = (uint8_t)reading->MilliVolts;
+    buffer[4] = (uint8_t)(reading->MilliVolts >> 8);
+    buffer[5] = (uint8_t)reading->RawHumidity;
+    buffer[6] = (uint8_t)(reading->RawHumidity >> 8);
+    buffer[7] = reading->Via;
+    buffer[8] = (uint8_t)reading->Interval;
+    buffer[9] = (uint8_t)(reading->Interval >> 8);
+    memcpy(buffer + READING_BINARY_SIZE, reading->Name, reading->NameLength);
+    return bytes;
+}
+
+static
+int8_t
+ParseBinary(const uint8_t* data, uint8_t size, Reading* reading) {
+    if (size < READING_BINARY_SIZE || size - READING_BINARY_SIZE > READING_NAME_SIZE) {
+        return -1;
+    }
+
+    reading->Temperature = (int8_t)data[1];
+    reading->Humidity = (int8_t)data[2];
+    reading->MilliVolts = (uint16_t)(data[3] | (data[4] << 8));
+    reading->RawHumidity = (uint16_t)(data[5] | (data[6] << 8));
+    reading->Via = data[7];
+    reading->Interval = (uint16_t)(data[8] | (data[9] << 8));
+    reading->Flags = READING_FLAG_INTERVAL;
+    reading->Name = (const char*)data + READING_BINARY_SIZE;
+    reading->NameLength = size - READING_BINARY_SIZE;
+    return 0;
+}
+
+/* Fields are scanned without branching on their content, errors are
+ * collected in ok and checked once at the end.
+ */
+static
+const uint8_t*
+ParseDecimal(const uint8_t* p, const uint8_t* end, int32_t min, int32_t max, int32_t* value, uint8_t* ok) {
+    const uint8_t negative = p < end && *p == '-';
+    p += negative;
+
+    const uint8_t* start = p;
+    uint32_t v = 0;
+    uint8_t digit;
+    while (p < end && (digit = (uint8_t)(*p - '0')) < 10 && p - start < 6) {
+        v = v * 10 + digit;
+        ++p;
+    }
+
+    const int32_t result = (int32_t)((v ^ -(uint32_t)negative) + negative);
+    *ok &= (p != start) & (result >= min) & (result <= max);
+    *value = result;
+    return p;
+}
+
+static
+inline
+uint8_t
+HexDigit(uint8_t c) {
+    const uint8_t decimal = (uint8_t)(c - '0');
+    const uint8_t letter = (uint8_t)((c | 0x20) - 'a');
+    return decimal < 10 ? decimal : (letter < 6 ? letter + 10 : 0xff);
+}
+
+static
+const uint8_t*
+Separator(const uint8_t* p, const uint8_t* end, uint8_t* ok) {
+    const uint8_t match = p < end && *p == ';';
+    *ok &= match;
+    return p + match;
+}
+
+static
+int8_t
+ParseText(const uint8_t* data, uint8_t size, Reading* reading) {
+    const uint8_t* end = data + size;
+    end -= end > data && !end[-1]; // tolerate a terminator
+
+    if (end - data < 2 || data[0] != 'W' || data[1] != 'B') {
+        return -1;
+    }
+
+    const uint8_t* p = data + 2;
+    const uint8_t* name = p;
+    p = (const uint8_t*)memchr(p, ';', (size_t)(end - p));
+    if (!p || p - name > READING_NAME_SIZE) {
+        return -1;
+    }
+    reading->Name = (const char*)name;
+    reading->NameLength = (uint8_t)(p - name);
+
+    uint8_t ok = 1;
+    int32_t values[4];
+    p = ParseDecimal(Separator(p, end, &ok), end, INT8_MIN, INT8_MAX, &values[0], &ok);
+    p = ParseDecimal(Separator(p, end, &ok), end, INT8_MIN, INT8_MAX, &values[1], &ok);
+    p = ParseDecimal(Separator(p, end, &ok), end, 0, UINT16_MAX, &values[2], &ok);
+    p = ParseDecimal(Separator(p, end, &ok), end, 0, UINT16_MAX, &values[3], &ok);
+    p = Separator(p, end, &ok);
+
+    const uint8_t high = p < end ? HexDigit(p[0]) : 0xff;
+    const uint8_t low = p + 1 < end ? HexDigit(p[1]) : 0xff;
+    const uint8_t two = low < 16;
+    ok &= (high < 16) & (p + 1 + two == end);
+
+    if (!ok) {
+        return -1;
+    }
+
+    reading->Temperature = (int8_t)values[0];
+    reading->Humidity = (int8_t)values[1];
+    reading->MilliVolts = (uint16_t)values[2];
+    reading->RawHumidity = (uint16_t)values[3];
+    reading->Via = two ? (uint8_t)((high << 4) | low) : high;
+    reading->Interval = 0;
+    reading->Flags = 0;
+    return 0;
+}
+
+int8_t
+Reading_Parse(const uint8_t* data, uint8_t size, Reading* reading) {
+    if (size && data[0] == READING_BINARY_MARKER) {
+        return ParseBinary(data, size, reading);
+    }
+
+    return ParseText(data, size, reading);
+}
@@ -0,0 +1,80 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef READING_H
+#define READING_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A weatherbug sensor reading as carried in a TCP payload.
+ *
+ * Text (legacy):  WB<name>;<temperature>;<humidity>;<mV>;<raw humidity>;<via, hex>
+ * Binary:         READING_BINARY_MARKER, temperature (1), humidity (1),
+ *                 mV (2), raw humidity (2), via (1), interval (2),
+ *                 name (rest, no terminator)
+ *
+ * Multi-byte values are little endian. The marker can't start a text
+ * record, so both forms can share a network. The interval is the sender's
+ * Time_GetInterval() when the reading was taken, only the binary form
+ * carries it. Its top bit is the sender's epoch, which flips on every
+ * power-on.
+ */
+#define READING_BINARY_MARKER   0xb2
+#define READING_BINARY_SIZE     10 /* without the name */
+#define READING_NAME_SIZE       32 /* longest name accepted */
+
+#define READING_FLAG_INTERVAL   0x01 /* Interval is valid */
+#define READING_INTERVAL_EPOCH  0x8000
+
+typedef struct {
+    const char* Name; // points into the parsed payload, not terminated
+    uint16_t MilliVolts;
+    uint16_t RawHumidity;
+    uint16_t Interval;
+    int8_t Temperature;
+    int8_t Humidity;
+    uint8_t Via;
+    uint8_t NameLength;
+    uint8_t Flags; // READING_FLAG_*
+} Reading;
+
+/* Writes the binary form to buffer. Returns the number of bytes written
+ * or 0 if buffer is too small.
+ */
+uint8_t Reading_Encode(uint8_t* buffer, uint8_t size, const Reading* reading);
+
+/* Parses either form. The name of reading references data.
+ * Returns 0 on success, -1 if data isn't a reading.
+ */
+int8_t Reading_Parse(const uint8_t* data, uint8_t size, Reading* reading);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* READING_H */
@@ -0,0 +1,56 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "ReadingWindow.h"
+
+#define COUNT_MASK  (READING_INTERVAL_EPOCH - 1)
+
+uint8_t
+ReadingWindow_Add(ReadingWindow* window, uint16_t interval) {
+    // distance within the 15 bit count, negative if interval is newer
+    int16_t age = (int16_t)(((window->Newest - interval) & COUNT_MASK) << 1) >> 1;
+
+    if (!window->Valid || ((window->Newest ^ interval) & READING_INTERVAL_EPOCH)) {
+        window->Seen = 0;
+        age = -1;
+    } else if (age >= READING_WINDOW_SIZE || age <= -READING_WINDOW_SIZE) {
+        // too far off to tell, the sender restarted within its epoch
+        window->Seen = 0;
+        age = -1;
+    }
+
+    if (age < 0) {
+        window->Seen = (window->Seen << -age) | 1;
+        window->Newest = interval;
+        window->Valid = 1;
+        return 0;
+    }
+
+    const uint64_t bit = UINT64_C(1) << age;
+    if (window->Seen & bit) {
+        return 1;
+    }
+
+    window->Seen |= bit;
+    return 0;
+}
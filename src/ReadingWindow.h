@@ -0,0 +1,58 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef READINGWINDOW_H
+#define READINGWINDOW_H
+
+#include <stdint.h>
+
+#include "Reading.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Intervals of the last readings of one sender, to drop readings TCP
+ * delivers again once either side has purged its state.
+ *
+ * The low 15 bits of an interval count up and wrap, the top bit is the
+ * sender's epoch (READING_INTERVAL_EPOCH). A new epoch means the sender
+ * lost power and restarted its count, so the window starts over.
+ * A zeroed window is empty.
+ */
+#define READING_WINDOW_SIZE 64
+
+typedef struct {
+    uint64_t Seen;      /* bit i is interval Newest - i */
+    uint16_t Newest;
+    uint8_t Valid;
+} ReadingWindow;
+
+/* Records interval. Returns 1 if it is in the window already, 0 if not. */
+uint8_t ReadingWindow_Add(ReadingWindow* window, uint16_t interval);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* READINGWINDOW_H */
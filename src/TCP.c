@@ -29,6 +29,7 @@
 #include "Misc.h"
 #include "Time.h"
 #include "TCP.h"
+#include "Pool.h"
 #include "Debug.h"
 
 
@@ -49,6 +50,16 @@
 
 #define TCP_PACKET_RECEIVED 0
 
+/* Delayed acks, see https://tools.ietf.org/html/rfc1122#page-96 */
+#ifndef TCP_ACK_DELAY
+#   define TCP_ACK_DELAY 8 /* [ms] max time an ack is held back */
+#endif
+#ifndef TCP_ACK_FRAMES
+#   define TCP_ACK_FRAMES 4 /* frames acked at once, 1 acks every frame */
+#endif
+#define TCP_ACK_DELAYED 1
+#define TCP_ACK_NOW     2
+
 // Mini TCP implementation based on https://tools.ietf.org/html/rfc793
 // tailored for short send/receive intervals
 
@@ -56,63 +67,138 @@
 #ifdef AVR
 #   include <util/crc16.h>
 #else
+/* CRC-8, polynomial 0x07, same as _crc8_ccitt_update in avr-libc */
+static const uint8_t s_Crc8Table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+    0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+    0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+    0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+    0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+    0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+    0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+    0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+    0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+    0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+    0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+};
+
 static
+inline
 uint8_t
-_crc8_ccitt_update (uint8_t inCrc, uint8_t inData) {
-    uint8_t   i;
-    uint8_t   data;
-
-    data = inCrc ^ inData;
-
-    for ( i = 0; i < 8; i++ ) {
-        if (( data & 0x80 ) != 0 ) {
-            data <<= 1;
-            data ^= 0x07;
-        } else {
-            data <<= 1;
-        }
-    }
-    return data;
+_crc8_ccitt_update(uint8_t inCrc, uint8_t inData) {
+    return s_Crc8Table[inCrc ^ inData];
 }
 #endif
 
 
 
+/* Retransmission timeout, see https://tools.ietf.org/html/rfc6298 */
+#define TCP_RTO_INITIAL 256
+#define TCP_RTO_MIN 32
+#define TCP_RTO_MAX 4096
+#define TCP_RTO_MAX_BACKOFF 7 /* doublings */
+#define TCP_RECV_WINDOW 8 /* bits in PeerData::ReceiveWindow, must divide 256 */
+#define TCP_SEND_WINDOW TCP_RECV_WINDOW /* the receiver drops anything further ahead */
+#define TCP_ACK_WINDOW (UINT8_C(1)<<7)
+
+/* Retransmit timing wheel, slot i holds deadlines in ticks i, i + SLOTS, ... */
+#ifndef TCP_WHEEL_SLOTS
+#   define TCP_WHEEL_SLOTS 32
+#endif
+#define TCP_WHEEL_TICK 8 /* [ms] */
+
 typedef struct _UnacknowledgedPacket {
-    struct _UnacknowledgedPacket* Next;
+    struct _UnacknowledgedPacket* Next;       // same wheel slot
+    struct _UnacknowledgedPacket** Previous;  // link pointing to this entry
+    struct _PeerData* Peer;
+    uint32_t Due;           // retransmit deadline
     uint32_t TimeSent;
     NetworkPacket Packet;
     uint8_t Count;
 } UnacknowledgedPacket;
 
 typedef struct _UndeliveredPacket {
-    struct _UndeliveredPacket* Next;
-    uint8_t SequenceNumber;
-    uint8_t Sender;
-    uint8_t Size;
+    uint8_t Size    : 5;
+    uint8_t Message : 1; // Data holds message records
     uint8_t Data[0];
 } UndeliveredPacket;
 
 typedef struct _PeerData {
     struct _PeerData* Next;
-    UnacknowledgedPacket* Unacknowledged;
-    UndeliveredPacket* Undelivered;
+    UnacknowledgedPacket* Unacknowledged[TCP_SEND_WINDOW]; // indexed by seq % TCP_SEND_WINDOW
+    UndeliveredPacket* Undelivered[TCP_RECV_WINDOW]; // indexed by seq % TCP_RECV_WINDOW
+    struct _PendingFrame* Pending; // messages waiting for the next update
+    struct _PartialMessage* Partial; // message being reassembled
+    uint8_t UnacknowledgedSequenceNumber; // oldest seq not acknowledged
     uint8_t SendSequenceNumber;
     uint8_t ReceivedSequenceNumber;
     uint8_t ReceiveWindow;
     uint8_t AckSequenceNumber;
     uint8_t Address;
     uint8_t Flags;
+    uint8_t AcksPending;    // frames received but not acked yet
+    uint16_t AckTime;       // low bits of Time_Now() when the first of those arrived
+    uint16_t Srtt;      // smoothed RTT << 3, 0 until the first sample
+    uint16_t RttVar;    // RTT variation << 2
+    uint16_t Rto;       // retransmission timeout [ms]
 } PeerData;
 
+/* Pool capacity on AVR, slab size elsewhere */
+#ifndef TCP_POOL_PEERS
+#   define TCP_POOL_PEERS           2
+#endif
+#ifndef TCP_POOL_UNACKNOWLEDGED
+#   define TCP_POOL_UNACKNOWLEDGED  4
+#endif
+#ifndef TCP_POOL_UNDELIVERED
+#   define TCP_POOL_UNDELIVERED     4
+#endif
+#ifndef TCP_POOL_PENDING
+#   define TCP_POOL_PENDING         1
+#endif
+#ifndef TCP_POOL_PARTIAL
+#   define TCP_POOL_PARTIAL         1
+#endif
+
+/* A message frame is a sequence of records, each a header byte followed
+ * by up to TCP_RECORD_LENGTH bytes of a message.
+ */
+#define TCP_RECORD_LENGTH   0x1f
+#define TCP_RECORD_FIRST    0x20 // first part of a message
+#define TCP_RECORD_LAST     0x40 // last part of a message
+
+typedef struct _PendingFrame {
+    uint8_t Size;
+    uint8_t Data[TCP_PAYLOAD_SIZE];
+} PendingFrame;
+
+typedef struct _PartialMessage {
+    uint8_t Size;
+    uint8_t Data[TCP_MESSAGE_SIZE];
+} PartialMessage;
+
+#define UNDELIVERED_PACKET_SIZE (sizeof(UndeliveredPacket) + TCP_PAYLOAD_SIZE)
+
 TCP_DataReceivedCallback s_DataReceivedCallback NOINIT;
 PeerData* s_Peers NOINIT;
+static TCP_Counters s_Counters NOINIT;
+static UnacknowledgedPacket* s_Wheel[TCP_WHEEL_SLOTS] NOINIT;
+static uint32_t s_WheelTime NOINIT; // start of the slot processed next
+static uint8_t s_AckingPeers NOINIT; // peers with acks pending
+static uint8_t s_PendingPeers NOINIT; // peers with a pending message frame
+POOL_DEFINE(s_PeerPool, sizeof(PeerData), TCP_POOL_PEERS);
+POOL_DEFINE(s_UnacknowledgedPool, sizeof(UnacknowledgedPacket), TCP_POOL_UNACKNOWLEDGED);
+static uint8_t s_ViaCrcDelta[8] NOINIT; // crc change for each bit flipped in Via
+POOL_DEFINE(s_UndeliveredPool, UNDELIVERED_PACKET_SIZE, TCP_POOL_UNDELIVERED);
+POOL_DEFINE(s_PendingPool, sizeof(PendingFrame), TCP_POOL_PENDING);
+POOL_DEFINE(s_PartialPool, sizeof(PartialMessage), TCP_POOL_PARTIAL);
 
 
-#define TCP_ACK_TIMEOUT 256
-#define TCP_RECV_WINDOW 8
-#define TCP_ACK_WINDOW (UINT8_C(1)<<7)
-
 typedef struct {
     uint8_t Seq;
     uint8_t Sender;
@@ -120,6 +206,8 @@ typedef struct {
     uint8_t Destination;
     uint8_t Ack     : 1;
     uint8_t Size    : 5;
+    uint8_t Sack    : 1; // Data[0] of an ack has the selective ack bitmap
+    uint8_t Message : 1; // Data holds message records
     uint8_t Crc;
     uint8_t Data[TCP_PAYLOAD_SIZE];
 } TCP_Payload;
@@ -151,6 +239,35 @@ IsChecksumValid(TCP_Payload* tcp) {
     return loaded == computed;
 }
 
+static
+void
+InitViaCrcDelta() {
+    // the crc is affine, flipping a bit of Via always flips the same crc bits
+    TCP_Payload tcp;
+    memset(&tcp, 0, sizeof(tcp));
+    StoreChecksum(&tcp);
+    const uint8_t zero = tcp.Crc;
+    for (uint8_t i = 0; i < sizeof(s_ViaCrcDelta); ++i) {
+        tcp.Via = UINT8_C(1) << i;
+        StoreChecksum(&tcp);
+        s_ViaCrcDelta[i] = tcp.Crc ^ zero;
+    }
+}
+
+/* Changes Via and patches the checksum without recomputing it */
+static
+void
+SetVia(TCP_Payload* tcp, uint8_t via) {
+    uint8_t crc = tcp->Crc;
+    for (uint8_t delta = tcp->Via ^ via, i = 0; delta; delta >>= 1, ++i) {
+        if (delta & 1) {
+            crc ^= s_ViaCrcDelta[i];
+        }
+    }
+    tcp->Via = via;
+    tcp->Crc = crc;
+}
+
 static
 PeerData*
 FindPeer(uint8_t id) {
@@ -168,10 +285,11 @@ GetOrCreatePeer(uint8_t address) {
     PeerData* result = FindPeer(address);
     if (!result) {
         DEBUG_P("TCP: create peer %#02x\n", address);
-        result = (PeerData*)malloc(sizeof(*result));
+        result = (PeerData*)Pool_Alloc(&s_PeerPool);
         if (result) {
             memset(result, 0, sizeof(*result));
             result->Address = address;
+            result->Rto = TCP_RTO_INITIAL;
             result->Next = s_Peers;
             s_Peers = result;
         } else {
@@ -181,23 +299,256 @@ GetOrCreatePeer(uint8_t address) {
     return result;
 }
 
+static
+void
+SampleRtt(PeerData* peer, uint32_t rtt) {
+    if (rtt > TCP_RTO_MAX) {
+        rtt = TCP_RTO_MAX;
+    }
+
+    if (peer->Srtt) {
+        int16_t delta = (int16_t)rtt - (int16_t)(peer->Srtt >> 3);
+        peer->Srtt += delta; // srtt += (rtt - srtt) / 8
+        if (delta < 0) {
+            delta = -delta;
+        }
+        peer->RttVar += delta - (peer->RttVar >> 2); // rttvar += (|rtt - srtt| - rttvar) / 4
+    } else {
+        peer->Srtt = (uint16_t)(rtt << 3);
+        peer->RttVar = (uint16_t)(rtt << 1); // rttvar = rtt / 2
+    }
+
+    uint16_t rto = (peer->Srtt >> 3) + peer->RttVar; // srtt + 4 * rttvar
+    if (rto < TCP_RTO_MIN) {
+        rto = TCP_RTO_MIN;
+    } else if (rto > TCP_RTO_MAX) {
+        rto = TCP_RTO_MAX;
+    }
+    peer->Rto = rto;
+    ++s_Counters.RttSamples;
+
+    DEBUG_P("TCP: rtt %u srtt %u rttvar %u rto %u for %02x\n", (unsigned)rtt, peer->Srtt >> 3, peer->RttVar >> 2, rto, peer->Address);
+}
+
+static
+uint32_t
+RetransmitTimeout(const PeerData* peer, uint8_t count) {
+    const uint32_t timeout = (uint32_t)peer->Rto << (count < TCP_RTO_MAX_BACKOFF ? count : TCP_RTO_MAX_BACKOFF);
+    return timeout < TCP_RTO_MAX ? timeout : TCP_RTO_MAX;
+}
+
+static
+void
+Schedule(UnacknowledgedPacket* uap, uint32_t due) {
+    uap->Due = due;
+    if ((int32_t)(due - s_WheelTime) < 0) {
+        due = s_WheelTime;
+    }
+    UnacknowledgedPacket** head = &s_Wheel[(due / TCP_WHEEL_TICK) % TCP_WHEEL_SLOTS];
+    uap->Next = *head;
+    if (uap->Next) {
+        uap->Next->Previous = &uap->Next;
+    }
+    uap->Previous = head;
+    *head = uap;
+}
+
+static
+void
+Unschedule(UnacknowledgedPacket* uap) {
+    *uap->Previous = uap->Next;
+    if (uap->Next) {
+        uap->Next->Previous = uap->Previous;
+    }
+}
+
+static
+void
+Acknowledge(PeerData* peer, uint8_t seq, UnacknowledgedPacket** sample) {
+    UnacknowledgedPacket** slot = &peer->Unacknowledged[seq % TCP_SEND_WINDOW];
+    UnacknowledgedPacket* uap = *slot;
+    if (uap) {
+        DEBUG_P("TCP: recv ack for seq %u sent to %02x\n", seq, peer->Address);
+        Unschedule(uap);
+        // Karn: only packets sent once give a valid sample
+        if (!uap->Count) {
+            if (*sample) {
+                Pool_Free(&s_UnacknowledgedPool, *sample);
+            }
+            *sample = uap;
+        } else {
+            Pool_Free(&s_UnacknowledgedPool, uap);
+        }
+        *slot = NULL;
+        ++s_Counters.Acknowledged;
+    }
+}
+
 static
 void
 Clear() {
     while (s_Peers) {
         PeerData* peer = s_Peers;
         s_Peers = s_Peers->Next;
-        while (peer->Unacknowledged) {
-            UnacknowledgedPacket* entry = peer->Unacknowledged;
-            peer->Unacknowledged = peer->Unacknowledged->Next;
-            free(entry);
+        for (uint8_t i = 0; i < TCP_SEND_WINDOW; ++i) {
+            if (peer->Unacknowledged[i]) {
+                Pool_Free(&s_UnacknowledgedPool, peer->Unacknowledged[i]);
+            }
+        }
+        for (uint8_t i = 0; i < TCP_RECV_WINDOW; ++i) {
+            if (peer->Undelivered[i]) {
+                Pool_Free(&s_UndeliveredPool, peer->Undelivered[i]);
+            }
+        }
+        if (peer->Pending) {
+            Pool_Free(&s_PendingPool, peer->Pending);
+        }
+        if (peer->Partial) {
+            Pool_Free(&s_PartialPool, peer->Partial);
+        }
+        Pool_Free(&s_PeerPool, peer);
+    }
+    memset(s_Wheel, 0, sizeof(s_Wheel));
+    s_AckingPeers = 0;
+    s_PendingPeers = 0;
+}
+
+static
+void
+SendAck(PeerData* peer) {
+    NetworkPacket packet;
+    packet.TTL = Network_GetTtl();
+    packet.Type = TCP_PACKET_TYPE;
+
+    TCP_Payload* tcp = (TCP_Payload*)packet.Payload;
+    memset(tcp, 0, sizeof(*tcp));
+    tcp->Seq = peer->AckSequenceNumber - 1;
+    tcp->Ack = 1;
+    tcp->Sack = 1;
+    tcp->Size = 1;
+    // packets received beyond the first hole, bit 0 is the hole itself
+    tcp->Data[0] = peer->ReceiveWindow >> (uint8_t)(peer->AckSequenceNumber - peer->ReceivedSequenceNumber);
+    tcp->Sender = Network_GetAddress();
+    tcp->Destination = peer->Address;
+    tcp->Via = Batman_Route(tcp->Destination);
+
+    DEBUG_P("TCP: send ack till %u to %02x via %02x (%u)\n", tcp->Seq, tcp->Destination, tcp->Via, peer->AcksPending);
+
+    StoreChecksum(tcp);
+    Network_Send(&packet);
+    peer->AcksPending = 0;
+    --s_AckingPeers;
+    ++s_Counters.Acks;
+}
+
+static
+int8_t
+Transmit(PeerData* peer, const uint8_t *ptr, uint8_t size, uint8_t message) {
+    if ((uint8_t)(peer->SendSequenceNumber - peer->UnacknowledgedSequenceNumber) >= TCP_SEND_WINDOW) {
+        DEBUG_P("TCP: send window full for %02x\n", peer->Address);
+        return 0;
+    }
+
+    UnacknowledgedPacket* uap = (UnacknowledgedPacket*)Pool_Alloc(&s_UnacknowledgedPool);
+    if (!uap) {
+        DEBUG_MALLOC_FAIL;
+        return 0;
+    }
+
+
+    uap->TimeSent = Time_Now();
+    uap->Count = 0;
+    uap->Peer = peer;
+    peer->Unacknowledged[peer->SendSequenceNumber % TCP_SEND_WINDOW] = uap;
+    Schedule(uap, uap->TimeSent + RetransmitTimeout(peer, 0));
+
+
+    NetworkPacket* packet = &uap->Packet;
+    packet->TTL = Network_GetTtl();
+    packet->Type = TCP_PACKET_TYPE;
+
+    TCP_Payload* tcp = (TCP_Payload*)packet->Payload;
+    tcp->Ack = 0;
+    tcp->Sack = 0;
+    tcp->Message = message;
+    tcp->Sender = Network_GetAddress();
+    tcp->Seq = peer->SendSequenceNumber++;
+    tcp->Size = size;
+    tcp->Destination = peer->Address;
+    tcp->Via = Batman_Route(tcp->Destination);
+
+    memcpy(tcp->Data, ptr, size);
+
+    StoreChecksum(tcp);
+    Network_Send(packet);
+    ++s_Counters.Sent;
+    DEBUG_P("TCP: seq %u send to %02x via %02x\n", tcp->Seq, tcp->Destination, tcp->Via);
+    return 1;
+}
+
+static
+int8_t
+FlushPending(PeerData* peer) {
+    if (peer->Pending) {
+        if (!Transmit(peer, peer->Pending->Data, peer->Pending->Size, 1)) {
+            return 0; // keep it for the next update
         }
-        while (peer->Undelivered) {
-            UndeliveredPacket* entry = peer->Undelivered;
-            peer->Undelivered = peer->Undelivered->Next;
-            free(entry);
+        Pool_Free(&s_PendingPool, peer->Pending);
+        peer->Pending = NULL;
+        --s_PendingPeers;
+    }
+    return 1;
+}
+
+static
+void
+ReceiveMessages(PeerData* peer, const uint8_t* data, uint8_t size) {
+    for (uint8_t i = 0; i < size; ) {
+        const uint8_t flags = data[i++];
+        const uint8_t length = flags & TCP_RECORD_LENGTH;
+        if (!length || length > size - i) {
+            DEBUG_P("TCP: bad message record from %02x\n", peer->Address);
+            return;
+        }
+        const uint8_t* chunk = data + i;
+        i += length;
+
+        if (flags & TCP_RECORD_FIRST) {
+            if (flags & TCP_RECORD_LAST) {
+                if (s_DataReceivedCallback) {
+                    s_DataReceivedCallback(peer->Address, chunk, length);
+                }
+                continue;
+            }
+            if (!peer->Partial) {
+                peer->Partial = (PartialMessage*)Pool_Alloc(&s_PartialPool);
+                if (!peer->Partial) {
+                    DEBUG_MALLOC_FAIL;
+                    continue;
+                }
+            }
+            peer->Partial->Size = 0;
+        } else if (!peer->Partial) {
+            continue; // start was lost or dropped
+        }
+
+        PartialMessage* message = peer->Partial;
+        if (length > TCP_MESSAGE_SIZE - message->Size) {
+            DEBUG_P("TCP: message from %02x too long\n", peer->Address);
+            Pool_Free(&s_PartialPool, message);
+            peer->Partial = NULL;
+            continue;
+        }
+        memcpy(message->Data + message->Size, chunk, length);
+        message->Size += length;
+
+        if (flags & TCP_RECORD_LAST) {
+            if (s_DataReceivedCallback) {
+                s_DataReceivedCallback(peer->Address, message->Data, message->Size);
+            }
+            Pool_Free(&s_PartialPool, message);
+            peer->Partial = NULL;
         }
-        free(peer);
     }
 }
 
@@ -205,38 +556,120 @@ void
 TCP_Init() {
     s_Peers = NULL;
     s_DataReceivedCallback = NULL;
+    memset(&s_Counters, 0, sizeof(s_Counters));
+    memset(s_Wheel, 0, sizeof(s_Wheel));
+    s_WheelTime = Time_Now() / TCP_WHEEL_TICK * TCP_WHEEL_TICK;
+    s_AckingPeers = 0;
+    s_PendingPeers = 0;
+    InitViaCrcDelta();
+    POOL_INIT(s_PeerPool, "TCP peers", sizeof(PeerData), TCP_POOL_PEERS);
+    POOL_INIT(s_UnacknowledgedPool, "TCP unacknowledged", sizeof(UnacknowledgedPacket), TCP_POOL_UNACKNOWLEDGED);
+    POOL_INIT(s_UndeliveredPool, "TCP undelivered", UNDELIVERED_PACKET_SIZE, TCP_POOL_UNDELIVERED);
+    POOL_INIT(s_PendingPool, "TCP pending", sizeof(PendingFrame), TCP_POOL_PENDING);
+    POOL_INIT(s_PartialPool, "TCP partial", sizeof(PartialMessage), TCP_POOL_PARTIAL);
     DEBUG_P("TCP: init\n");
 }
 
 void
 TCP_Uninit() {
     Clear();
+    Pool_Uninit(&s_PartialPool);
+    Pool_Uninit(&s_PendingPool);
+    Pool_Uninit(&s_UndeliveredPool);
+    Pool_Uninit(&s_UnacknowledgedPool);
+    Pool_Uninit(&s_PeerPool);
     DEBUG_P("TCP: uninit\n");
 }
 
 
+static
+void
+Retransmit(UnacknowledgedPacket* entry, uint32_t now) {
+    PeerData* peer = entry->Peer;
+    entry->TimeSent = now;
+    if (entry->Count != UINT8_MAX) {
+        ++entry->Count;
+    }
+    Schedule(entry, now + RetransmitTimeout(peer, entry->Count));
+    ++s_Counters.Retransmitted;
+    TCP_Payload* tcp = (TCP_Payload*)&entry->Packet.Payload;
+    SetVia(tcp, Batman_Route(tcp->Destination)); // routing info may have changed
+    Network_Send(&entry->Packet);
+    DEBUG_P("TCP: rt %u to %02x via %02x (%u)\n", tcp->Seq, tcp->Destination, tcp->Via, entry->Count);
+}
+
 void
 TCP_Update() {
+    const uint32_t now = Time_Now();
+
+    if (s_AckingPeers || s_PendingPeers) {
+        for (PeerData* peer = s_Peers; peer; peer = peer->Next) {
+            if (peer->AcksPending && !IsInWindow16((uint16_t)now, TCP_ACK_DELAY, peer->AckTime)) {
+                SendAck(peer);
+            }
+
+            FlushPending(peer);
+        }
+    }
+
+    // visit the slots up to now, each at most once
+    for (uint8_t i = 0; i < TCP_WHEEL_SLOTS && (int32_t)(now - s_WheelTime) >= 0; ++i) {
+        UnacknowledgedPacket* entry = s_Wheel[(s_WheelTime / TCP_WHEEL_TICK) % TCP_WHEEL_SLOTS];
+        while (entry) {
+            UnacknowledgedPacket* next = entry->Next;
+            if ((int32_t)(now - entry->Due) >= 0) {
+                Unschedule(entry);
+                Retransmit(entry, now);
+            }
+            entry = next;
+        }
+
+        if ((int32_t)(now - (s_WheelTime + TCP_WHEEL_TICK)) < 0) {
+            break; // slot isn't over yet
+        }
+        s_WheelTime += TCP_WHEEL_TICK;
+    }
 
-//    uint32_t now = s_TimeCallback();
-    uint32_t now = Time_Now();
-    for (PeerData* peer = s_Peers; peer; peer = peer->Next) {
-        UnacknowledgedPacket** previous = &peer->Unacknowledged;
-        for (UnacknowledgedPacket* entry = *previous; entry; previous = &entry->Next, entry = entry->Next) {
-            if (!IsInWindow32(now, TCP_ACK_TIMEOUT, entry->TimeSent)) {
-                entry->TimeSent = now;
-                ++entry->Count;
-                TCP_Payload* tcp = (TCP_Payload*)&entry->Packet.Payload;
-                uint8_t newVia = Batman_Route(tcp->Destination); // routing info may have changed
-                if (newVia != tcp->Via) {
-                    tcp->Via = newVia;
-                    StoreChecksum(tcp);
+    if ((int32_t)(now - s_WheelTime) >= TCP_WHEEL_SLOTS * TCP_WHEEL_TICK) {
+        // all slots visited, skip the rest of a long pause
+        s_WheelTime = now / TCP_WHEEL_TICK * TCP_WHEEL_TICK;
+    }
+}
+
+uint32_t
+TCP_MillisecondsTillNextUpdate() {
+    const uint32_t now = Time_Now();
+    uint32_t result = UINT32_MAX;
+
+    if (s_AckingPeers || s_PendingPeers) {
+        for (const PeerData* peer = s_Peers; peer; peer = peer->Next) {
+            if (peer->Pending && (uint8_t)(peer->SendSequenceNumber - peer->UnacknowledgedSequenceNumber) < TCP_SEND_WINDOW) {
+                return 0;
+            }
+            if (peer->AcksPending) {
+                const uint16_t age = (uint16_t)now - peer->AckTime;
+                const uint32_t left = age < TCP_ACK_DELAY ? TCP_ACK_DELAY - age : 0;
+                if (left < result) {
+                    result = left;
                 }
-                Network_Send(&entry->Packet);
-                DEBUG_P("TCP: rt %u to %02x via %02x (%u)\n", tcp->Seq, tcp->Destination, tcp->Via, entry->Count);
             }
         }
     }
+
+    for (uint8_t i = 0; i < TCP_WHEEL_SLOTS; ++i) {
+        const uint32_t start = s_WheelTime + i * TCP_WHEEL_TICK;
+        if ((int32_t)(start - now) > 0 && start - now >= result) {
+            break; // later slots can't be earlier
+        }
+        for (const UnacknowledgedPacket* entry = s_Wheel[(start / TCP_WHEEL_TICK) % TCP_WHEEL_SLOTS]; entry; entry = entry->Next) {
+            const uint32_t left = (int32_t)(entry->Due - now) > 0 ? entry->Due - now : 0;
+            if (left < result) {
+                result = left;
+            }
+        }
+    }
+
+    return result;
 }
 
 
@@ -272,25 +705,33 @@ TCP_Process(NetworkPacket* packet) {
         }
 
         if (tcp->Ack) {
-            UnacknowledgedPacket* newHead = NULL;
-            while (sender->Unacknowledged) {
-                UnacknowledgedPacket* uap = sender->Unacknowledged;
-                sender->Unacknowledged =  sender->Unacknowledged->Next;
-
-                TCP_Payload* unAckPayload = (TCP_Payload*)&uap->Packet.Payload;
-                if (IsInWindow8(tcp->Ack, TCP_ACK_WINDOW, unAckPayload->Seq)) {
-//                if (unAckPayload->Seq == tcp->Seq) {
-                    DEBUG_P("TCP: recv ack for seq %u sent to %02x\n", unAckPayload->Seq, tcp->Sender);
-                    free(uap);
-                } else {
-                    uap->Next = newHead;
-                    newHead = uap;
+            UnacknowledgedPacket* sample = NULL;
+
+            // cumulative part, everything up to and including tcp->Seq
+            uint8_t outstanding = sender->SendSequenceNumber - sender->UnacknowledgedSequenceNumber;
+            const uint8_t offset = tcp->Seq - sender->UnacknowledgedSequenceNumber;
+            if (offset < outstanding) {
+                for (uint8_t i = 0; i <= offset; ++i) {
+                    Acknowledge(sender, sender->UnacknowledgedSequenceNumber++, &sample);
                 }
+                outstanding -= offset + 1;
+            }
+
+            // selective part, bit i acknowledges tcp->Seq + 1 + i
+            if (tcp->Sack) {
+                for (uint8_t bits = tcp->Data[0], seq = tcp->Seq + 1; bits; bits >>= 1, ++seq) {
+                    if ((bits & 1) && (uint8_t)(seq - sender->UnacknowledgedSequenceNumber) < outstanding) {
+                        Acknowledge(sender, seq, &sample);
+                    }
+                }
+            }
+
+            if (sample) {
+                SampleRtt(sender, Time_Now() - sample->TimeSent);
+                Pool_Free(&s_UnacknowledgedPool, sample);
             }
-            sender->Unacknowledged = newHead;
         } else {
             int8_t ack = 0;
-//            int8_t deliver = 0;
             if (!(sender->Flags & _BV(TCP_PACKET_RECEIVED))) {
                 sender->Flags |= _BV(TCP_PACKET_RECEIVED);
                 sender->ReceivedSequenceNumber = tcp->Seq;
@@ -300,16 +741,19 @@ TCP_Process(NetworkPacket* packet) {
             }
 
             if (IsInWindow8(sender->ReceivedSequenceNumber + (TCP_RECV_WINDOW - 1), TCP_RECV_WINDOW, tcp->Seq)) {
-                ack = 1;
-                uint8_t index = sender->ReceivedSequenceNumber - tcp->Seq;
+                // out of order data is acked right away so the sender learns about the hole
+                ack = tcp->Seq == sender->AckSequenceNumber ? TCP_ACK_DELAYED : TCP_ACK_NOW;
+                uint8_t index = tcp->Seq - sender->ReceivedSequenceNumber;
                 DEBUG_P("TCP: recv window %u index %d from %02x\n", sender->ReceivedSequenceNumber, index, tcp->Sender);
                 uint8_t bit = UINT8_C(1) << index;
                 if (sender->ReceiveWindow & bit) {
                     // nothing to do, already seen
                     DEBUG_P("TCP: dup seq %u from %02x\n", tcp->Seq, tcp->Sender);
+                    ++s_Counters.Duplicates;
+                    ack = TCP_ACK_NOW;
                 } else {
                     DEBUG_P("TCP: queue %u bytes from %02x for delivery\n", tcp->Size, tcp->Sender);
-                    UndeliveredPacket* up = (UndeliveredPacket*)malloc(sizeof(*up) + tcp->Size);
+                    UndeliveredPacket* up = (UndeliveredPacket*)Pool_Alloc(&s_UndeliveredPool);
                     if (up) {
                         sender->ReceiveWindow |= bit;
 
@@ -319,13 +763,10 @@ TCP_Process(NetworkPacket* packet) {
                             ++sender->AckSequenceNumber;
                         }
 
-                        up->Sender = tcp->Sender;
                         up->Size = tcp->Size;
-                        up->SequenceNumber = tcp->Seq;
+                        up->Message = tcp->Message;
                         memcpy(up->Data, tcp->Data, up->Size);
-                        up->Next = sender->Undelivered;
-                        sender->Undelivered = up;
-//                        deliver = 1;
+                        sender->Undelivered[tcp->Seq % TCP_RECV_WINDOW] = up;
 
                     } else {
                         DEBUG_MALLOC_FAIL;
@@ -334,51 +775,38 @@ TCP_Process(NetworkPacket* packet) {
                 }
 
             } else if (IsInWindow8(sender->AckSequenceNumber, TCP_ACK_WINDOW, tcp->Seq)) {
-                ack = 1;
+                ack = TCP_ACK_NOW; // our ack got lost
+                ++s_Counters.Duplicates;
             } else {
                 DEBUG_P("TCP: oob packet %u seq %u for %02x\n", tcp->Seq, sender->ReceivedSequenceNumber, tcp->Sender);
             }
 
             if (ack) {
-                tcp->Seq = sender->AckSequenceNumber - 1;
-                tcp->Ack = 1;
-                tcp->Destination = tcp->Sender;
-                tcp->Sender = myid;
-                tcp->Via = Batman_Route(tcp->Destination);
-                packet->TTL = Network_GetTtl();
-
-                DEBUG_P("TCP: send ack till %u to %02x via %02x\n", tcp->Seq, tcp->Destination, tcp->Via);
-
-                StoreChecksum(tcp);
-                Network_Send(packet);
+                if (!sender->AcksPending) {
+                    sender->AckTime = (uint16_t)Time_Now();
+                    ++s_AckingPeers;
+                }
+                ++sender->AcksPending;
+                if (ack == TCP_ACK_NOW || sender->AcksPending >= TCP_ACK_FRAMES) {
+                    SendAck(sender);
+                }
             }
 
             while (sender->ReceiveWindow & 1) {
-                ASSERT_FILE(sender->Undelivered, return, "tcp");
-
-                UndeliveredPacket* oldest = NULL;
-                UndeliveredPacket* newHead = NULL;
-                while (sender->Undelivered) {
-                    UndeliveredPacket* up = sender->Undelivered;
-                    sender->Undelivered = sender->Undelivered->Next;
-                    if (up->SequenceNumber == sender->ReceivedSequenceNumber) {
-                        oldest = up;
-                    } else {
-                        up->Next = newHead;
-                        newHead = up->Next;
-                    }
-                }
-
-                sender->Undelivered = newHead;
+                UndeliveredPacket** slot = &sender->Undelivered[sender->ReceivedSequenceNumber % TCP_RECV_WINDOW];
+                UndeliveredPacket* oldest = *slot;
                 ASSERT_FILE(oldest, return, "tcp");
+                *slot = NULL;
 
-                if (s_DataReceivedCallback) {
-                    DEBUG_P("TCP: deliver packet %u from %02x\n", oldest->SequenceNumber, oldest->Sender);
-                    s_DataReceivedCallback(oldest->Sender, oldest->Data, oldest->Size);
+                DEBUG_P("TCP: deliver packet %u from %02x\n", sender->ReceivedSequenceNumber, sender->Address);
+                if (oldest->Message) {
+                    ReceiveMessages(sender, oldest->Data, oldest->Size);
+                } else if (s_DataReceivedCallback) {
+                    s_DataReceivedCallback(sender->Address, oldest->Data, oldest->Size);
                 }
+                ++s_Counters.Delivered;
 
-                DEBUG_P("TCP: purge packet %u from %02x\n", oldest->SequenceNumber, oldest->Sender);
-                free(oldest);
+                Pool_Free(&s_UndeliveredPool, oldest);
 
                 sender->ReceiveWindow >>= 1;
                 ++sender->ReceivedSequenceNumber;
@@ -392,11 +820,10 @@ TCP_Process(NetworkPacket* packet) {
             const uint8_t via = Batman_Route(tcp->Destination);
             if (via != tcp->Sender) { // don't send a packet back the way it just came
                 --packet->TTL;
-                tcp->Via = via;
+                SetVia(tcp, via);
 
                 DEBUG_P("TCP: fw from %02x via %02x to %02x ttl %u\n", tcp->Sender, tcp->Via, tcp->Destination, packet->TTL);
 
-                StoreChecksum(tcp);
                 Network_Send(packet);
             }
         }
@@ -405,54 +832,100 @@ TCP_Process(NetworkPacket* packet) {
     }
 }
 
-void
+int8_t
 TCP_Send(uint8_t destination, const uint8_t *ptr, uint8_t size) {
-    ASSERT_FILE(ptr, return, "tcp");
-    ASSERT_FILE(size, return, "tcp");
-    ASSERT_FILE(size <= TCP_PAYLOAD_SIZE, return, "tcp");
+    ASSERT_FILE(ptr, return 0, "tcp");
+    ASSERT_FILE(size, return 0, "tcp");
+    ASSERT_FILE(size <= TCP_PAYLOAD_SIZE, return 0, "tcp");
 
     const uint8_t myid = Network_GetAddress();
     if (myid == destination) {
         if (s_DataReceivedCallback) {
             s_DataReceivedCallback(myid, ptr, size);
         }
-    } else {
-        PeerData* peer = GetOrCreatePeer(destination);
-        if (!peer) {
-            return;
-        }
+        return 1;
+    }
 
-        UnacknowledgedPacket* uap = (UnacknowledgedPacket*)malloc(sizeof(*uap));
-        if (!uap) {
-            DEBUG_MALLOC_FAIL;
-            return;
-        }
+    PeerData* peer = GetOrCreatePeer(destination);
+    if (!peer) {
+        return 0;
+    }
+
+    if (!FlushPending(peer)) {
+        return 0; // don't overtake queued messages
+    }
+
+    return Transmit(peer, ptr, size, 0);
+}
+
+int8_t
+TCP_SendMessage(uint8_t destination, const uint8_t *ptr, uint8_t size) {
+    ASSERT_FILE(ptr, return 0, "tcp");
+    ASSERT_FILE(size, return 0, "tcp");
+    ASSERT_FILE(size <= TCP_MESSAGE_SIZE, return 0, "tcp");
 
+    const uint8_t myid = Network_GetAddress();
+    if (myid == destination) {
+        if (s_DataReceivedCallback) {
+            s_DataReceivedCallback(myid, ptr, size);
+        }
+        return 1;
+    }
 
-        uap->TimeSent = Time_Now();
-        uap->Count = 0;
-        uap->Next = peer->Unacknowledged;
-        peer->Unacknowledged = uap;
+    PeerData* peer = GetOrCreatePeer(destination);
+    if (!peer) {
+        return 0;
+    }
 
+    // worst case: the pending frame plus the message in fresh frames
+    const uint8_t frames = (peer->Pending ? 1 : 0) + (size + TCP_PAYLOAD_SIZE - 2) / (TCP_PAYLOAD_SIZE - 1);
+    if (TCP_SEND_WINDOW - (uint8_t)(peer->SendSequenceNumber - peer->UnacknowledgedSequenceNumber) < frames) {
+        DEBUG_P("TCP: no room for %u byte message to %02x\n", size, destination);
+        return 0;
+    }
 
-        NetworkPacket* packet = &uap->Packet;
-        packet->TTL = Network_GetTtl();
-        packet->Type = TCP_PACKET_TYPE;
+    // so the message is queued whole or not at all
+    if (!Pool_Reserve(&s_UnacknowledgedPool, frames) ||
+        !Pool_Reserve(&s_PendingPool, peer->Pending ? 0 : 1)) {
+        DEBUG_MALLOC_FAIL;
+        return 0;
+    }
 
-        TCP_Payload* tcp = (TCP_Payload*)packet->Payload;
-        tcp->Ack = 0;
-        tcp->Sender = myid;
-        tcp->Seq = peer->SendSequenceNumber++;
-        tcp->Size = size;
-        tcp->Destination = destination;
-        tcp->Via = Batman_Route(tcp->Destination);
+    uint8_t flags = TCP_RECORD_FIRST;
+    while (size) {
+        if (!peer->Pending) {
+            peer->Pending = (PendingFrame*)Pool_Alloc(&s_PendingPool);
+            if (!peer->Pending) {
+                DEBUG_MALLOC_FAIL;
+                return 0;
+            }
+            ++s_PendingPeers;
+            peer->Pending->Size = 0;
+        }
 
-        memcpy(tcp->Data, ptr, size);
+        PendingFrame* frame = peer->Pending;
+        const uint8_t space = frame->Size < TCP_PAYLOAD_SIZE - 1 ? TCP_PAYLOAD_SIZE - 1 - frame->Size : 0; // after the record header
+        // don't split a message that would fit a frame of its own
+        if (frame->Size && (space == 0 || ((flags & TCP_RECORD_FIRST) && size > space && size <= TCP_PAYLOAD_SIZE - 1))) {
+            if (!FlushPending(peer)) {
+                return 0;
+            }
+            continue;
+        }
 
-        StoreChecksum(tcp);
-        Network_Send(packet);
-        DEBUG_P("TCP: seq %u send to %02x via %02x\n", tcp->Seq, tcp->Destination, tcp->Via);
+        const uint8_t chunk = size < space ? size : space;
+        if (chunk == size) {
+            flags |= TCP_RECORD_LAST;
+        }
+        frame->Data[frame->Size++] = flags | chunk;
+        memcpy(frame->Data + frame->Size, ptr, chunk);
+        frame->Size += chunk;
+        ptr += chunk;
+        size -= chunk;
+        flags = 0;
     }
+
+    return 1;
 }
 
 void
@@ -466,6 +939,17 @@ TCP_SetDataReceivedCallback(TCP_DataReceivedCallback callback) {
     s_DataReceivedCallback = callback;
 }
 
+const TCP_Counters*
+TCP_GetCounters() {
+    return &s_Counters;
+}
+
+uint16_t
+TCP_GetRto(uint8_t address) {
+    const PeerData* peer = FindPeer(address);
+    return peer ? peer->Rto : 0;
+}
+
 void
 TCP_Decode(NetworkPacket* packet, uint8_t* sender, uint8_t* destination, uint8_t** ptr, uint8_t* bytes) {
     ASSERT_FILE(packet, return, "tcp");
@@ -36,16 +36,54 @@ extern "C" {
 #define TCP_PACKET_TYPE          0x02
 #define TCP_PAYLOAD_SIZE        (NETWORK_PACKET_PAYLOAD_SIZE-6)
 
+/* Largest message accepted by TCP_SendMessage and reassembled on receive.
+ * A message must fit the send window, i.e. at most 8 frames of
+ * TCP_PAYLOAD_SIZE-1 bytes.
+ */
+#ifndef TCP_MESSAGE_SIZE
+#   ifdef AVR
+#       define TCP_MESSAGE_SIZE     64
+#   else
+#       define TCP_MESSAGE_SIZE     128
+#   endif
+#endif
+
 typedef void (*TCP_DataReceivedCallback)(uint8_t sender, const uint8_t* payload, uint8_t size);
 
+typedef struct {
+    uint32_t Sent;          // first transmissions
+    uint32_t Retransmitted;
+    uint32_t Acknowledged;
+    uint32_t RttSamples;
+    uint32_t Delivered;     // frames delivered in order
+    uint32_t Duplicates;    // received again
+    uint32_t Acks;          // ack frames sent
+} TCP_Counters;
+
 void TCP_Init();
 void TCP_Uninit();
 void TCP_Update();
+/* Returns the time until TCP_Update has work to do, UINT32_MAX if none */
+uint32_t TCP_MillisecondsTillNextUpdate();
 void TCP_Process(NetworkPacket* packet);
-void TCP_Send(uint8_t destination, const uint8_t* ptr, uint8_t bytes);
+/* Sends bytes, up to TCP_PAYLOAD_SIZE, in a frame of their own. Returns 0
+ * if the send window is full or memory runs out, the frame is not sent
+ * then.
+ */
+int8_t TCP_Send(uint8_t destination, const uint8_t* ptr, uint8_t bytes);
+/* Queues a message of up to TCP_MESSAGE_SIZE bytes. Messages queued before
+ * the next TCP_Update are packed into as few frames as possible, longer
+ * ones are split. The receiver hands each message to its data received
+ * callback as a whole. Returns 0 if the send window or memory can't take
+ * the message, nothing of it is sent then.
+ */
+int8_t TCP_SendMessage(uint8_t destination, const uint8_t* ptr, uint8_t bytes);
 void TCP_Purge();
 void TCP_SetDataReceivedCallback(TCP_DataReceivedCallback callback);
 void TCP_Decode(NetworkPacket* packet, uint8_t* sender, uint8_t* destination, uint8_t** ptr, uint8_t* bytes);
+const TCP_Counters* TCP_GetCounters();
+/* Returns the current retransmission timeout for a peer, 0 if unknown */
+uint16_t TCP_GetRto(uint8_t address);
 
 #ifdef __cplusplus
 }
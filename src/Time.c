@@ -23,6 +23,7 @@
 
 #include "Time.h"
 #include "Misc.h"
+#include "Pool.h"
 #include "Debug.h"
 
 #include <stddef.h>
@@ -46,7 +47,21 @@
 
 #define NOT_SYNCED_MARKER 0xff
 
-#define SOURCE_CHAIN_LENGTH (NETWORK_PACKET_PAYLOAD_SIZE - 13)
+/* Pool capacity on AVR, slab size elsewhere */
+#ifndef TIME_POOL_PEERS
+#   define TIME_POOL_PEERS 4
+#endif
+
+/* Peers are chained off buckets keyed by address, a power of 2 up to 128 */
+#ifndef TIME_PEER_BUCKETS
+#   if AVR
+#       define TIME_PEER_BUCKETS 4
+#   else
+#       define TIME_PEER_BUCKETS 64
+#   endif
+#endif
+
+#define SOURCE_CHAIN_LENGTH (NETWORK_PACKET_PAYLOAD_SIZE - 14)
 
 typedef struct {
     uint32_t TimeToInterval;
@@ -55,6 +70,7 @@ typedef struct {
     uint8_t Sender;
     uint8_t Originator;
     uint8_t Stratum;
+    uint8_t Window; // in TIME_WINDOW_UNIT
     uint8_t Sources[SOURCE_CHAIN_LENGTH];
 } Time_Payload;
 
@@ -62,8 +78,30 @@ typedef struct {
 
 
 #define TIME_PURGE_TIMEOUT      (UINT32_C(3600)*UINT32_C(1000)) /* 60 minutes in ms */
+#define TIME_PRUNE_INTERVAL     (UINT32_C(60)*UINT32_C(1000)) /* 1 minute in ms */
 #define TIME_BROADCAST_INTERVAL (NETWORK_RXTX_DURATION/128)
 
+/* Frequency correction, a PI loop over successive syncs to the same peer.
+ * The phase step at each sync is the proportional part, s_Drift the
+ * integral. Drift is in 2^-TIME_DRIFT_SHIFT ms per ms.
+ */
+#define TIME_DRIFT_SHIFT        20
+#define TIME_DRIFT_MAX          INT32_C(32000)  /* ~3%, keeps ms * drift in 32 bits */
+#define TIME_DRIFT_GAIN_SHIFT   1               /* integral gain 1/2 */
+#define TIME_DRIFT_MAX_ERROR    (NETWORK_RXTX_DURATION/4) /* larger errors are resyncs */
+#define TIME_DRIFT_MIN_ELAPSED  (NETWORK_PERIOD/2)
+
+/* Listen window. The sync and send/receive phases (the window) come from
+ * the gateway and travel down the tree in the time payload. Each node
+ * appends a guard band sized from its own sync error and stratum.
+ */
+#define TIME_WINDOW_UNIT        (NETWORK_RXTX_DURATION/256) /* on-air resolution */
+#define TIME_WINDOW_DEFAULT     (UINT32_C(170)*TIME_WINDOW_UNIT) /* ~2/3 of the listen period */
+#define TIME_GUARD_MIN          (NETWORK_RXTX_DURATION/64)
+#define TIME_GUARD_MAX          (NETWORK_RXTX_DURATION/3)
+#define TIME_GUARD_PER_STRATUM  (NETWORK_RXTX_DURATION/128)
+#define TIME_SYNC_ERROR_UNKNOWN (TIME_GUARD_MAX/4)
+
 
 
 #define TIME_SYNC               0
@@ -89,6 +127,7 @@ typedef struct _Peer {
     struct _Peer* Next;
     uint8_t Address;
     uint8_t Stratum;
+    uint8_t Window;
     uint8_t PeerReplyCount;
     uint8_t PeerReplyIndex  : 2;
     //uint8_t PeerReplyCount  : 2;
@@ -103,7 +142,16 @@ static uint32_t s_Mono NOINIT;
 static uint32_t s_TimeToNextInterval NOINIT;
 static uint32_t s_LastBroadcastTime NOINIT;
 static uint32_t s_StartOfInterval NOINIT;
+static uint32_t s_LastPruneTime NOINIT;
 static uint16_t s_SequenceNumber NOINIT;
+static int32_t s_Drift NOINIT; // positive if the local clock is fast
+static int32_t s_DriftRemainder NOINIT;
+static uint32_t s_LastSyncTime NOINIT;
+static uint8_t s_LastSyncPeer NOINIT;
+static uint16_t s_Window NOINIT;
+static uint16_t s_SyncError NOINIT; // mean deviation of the phase error
+static uint16_t s_IntervalWindow NOINIT;
+static uint16_t s_IntervalDuration NOINIT;
 #ifdef TIME_DEBUG
 static uint32_t s_Counts[3] NOINIT;
 static uint32_t s_Errors NOINIT;
@@ -111,7 +159,8 @@ static uint32_t s_Errors NOINIT;
 static uint8_t s_Flags NOINIT;
 static uint8_t s_Stratum NOINIT;
 static uint8_t s_Sources[SOURCE_CHAIN_LENGTH] NOINIT; // to prevent circular time dependencies
-static Peer* s_Peers NOINIT;
+static Peer* s_Peers[TIME_PEER_BUCKETS] NOINIT;
+POOL_DEFINE(s_PeerPool, sizeof(Peer), TIME_POOL_PEERS);
 static Time_SyncWindowCallback s_Callback NOINIT;
 
 static
@@ -128,28 +177,67 @@ ClearSourceChain() {
     ClearSourceChainPtr(s_Sources);
 }
 
+static
+inline
+Peer**
+Bucket(uint8_t address) {
+    return &s_Peers[address & (TIME_PEER_BUCKETS - 1)];
+}
+
+static
+Peer*
+NextPeerFromBucket(uint8_t bucket) {
+    for (; bucket < TIME_PEER_BUCKETS; ++bucket) {
+        if (s_Peers[bucket]) {
+            return s_Peers[bucket];
+        }
+    }
+    return NULL;
+}
+
+static
+inline
+Peer*
+FirstPeer() {
+    return NextPeerFromBucket(0);
+}
+
+static
+inline
+Peer*
+NextPeer(const Peer* p) {
+    return p->Next ? p->Next : NextPeerFromBucket((p->Address & (TIME_PEER_BUCKETS - 1)) + 1);
+}
+
+static
+inline
+int8_t
+IsPeerAlive(const Peer* p) {
+    return IsInWindow32(s_Mono, TIME_PURGE_TIMEOUT, p->LastAwareTime);
+}
+
 static
 void
 PrunePeers() {
-    Peer* newHead = NULL;
-    while (s_Peers) {
-        Peer* p = s_Peers;
-        s_Peers = s_Peers->Next;
-        if (IsInWindow32(s_Mono, TIME_PURGE_TIMEOUT, p->LastAwareTime)) {
-            p->Next = newHead;
-            newHead = p;
-        } else {
-            DEBUG_P("Time: prune peer %02x\n", p->Address);
-            free(p);
+    for (uint8_t bucket = 0; bucket < TIME_PEER_BUCKETS; ++bucket) {
+        Peer** link = &s_Peers[bucket];
+        while (*link) {
+            Peer* p = *link;
+            if (IsPeerAlive(p)) {
+                link = &p->Next;
+            } else {
+                DEBUG_P("Time: prune peer %02x\n", p->Address);
+                *link = p->Next;
+                Pool_Free(&s_PeerPool, p);
+            }
         }
     }
-    s_Peers = newHead;
 }
 
 static
 Peer*
 FindPeer(uint8_t address) {
-    for (Peer* p = s_Peers; p; p = p->Next) {
+    for (Peer* p = *Bucket(address); p; p = p->Next) {
         if (p->Address == address) {
             return p;
         }
@@ -157,19 +245,36 @@ FindPeer(uint8_t address) {
     return NULL;
 }
 
+static
+void
+ResetPeer(Peer* p, uint8_t address) {
+    Peer* next = p->Next;
+    memset(p, 0, sizeof(*p));
+    p->Next = next;
+    p->Address = address;
+    p->LastSequenceNumber = s_SequenceNumber - 1;
+}
+
 static
 Peer*
 GetOrCreatePeer(uint8_t address) {
     Peer* p = FindPeer(address);
-    if (!p) {
-        p = malloc(sizeof(*p));
+    if (p) {
+        if (!IsPeerAlive(p)) { // timed out but not swept yet
+            ResetPeer(p, address);
+        }
+    } else {
+        p = (Peer*)Pool_Alloc(&s_PeerPool);
+        if (!p) {
+            PrunePeers();
+            p = (Peer*)Pool_Alloc(&s_PeerPool);
+        }
         if (p) {
             DEBUG_P("Time: create peer %02x\n", address);
-            memset(p, 0, sizeof(*p));
-            p->Address = address;
-            p->LastSequenceNumber = s_SequenceNumber - 1;
-            p->Next = s_Peers;
-            s_Peers = p;
+            Peer** bucket = Bucket(address);
+            p->Next = *bucket;
+            ResetPeer(p, address);
+            *bucket = p;
         }
     }
     return p;
@@ -180,11 +285,21 @@ Time_Init() {
     s_Mono = 0;
     s_TimeToNextInterval = 0;
     s_StartOfInterval = 0;
+    s_LastPruneTime = 0;
     s_Flags = _BV(TIME_SYNC) | _BV(TIME_BROADCAST) | _BV(TIME_AUTO_STRATUM);
-    s_Peers = NULL;
+    memset(s_Peers, 0, sizeof(s_Peers));
+    POOL_INIT(s_PeerPool, "Time peers", sizeof(Peer), TIME_POOL_PEERS);
     s_Stratum = NOT_SYNCED_MARKER;
     s_Callback = NULL;
     s_LastBroadcastTime = 0;
+    s_Drift = 0;
+    s_DriftRemainder = 0;
+    s_LastSyncTime = 0;
+    s_LastSyncPeer = NOT_SYNCED_MARKER;
+    s_Window = TIME_WINDOW_DEFAULT;
+    s_SyncError = TIME_SYNC_ERROR_UNKNOWN;
+    s_IntervalWindow = TIME_WINDOW_DEFAULT;
+    s_IntervalDuration = NETWORK_RXTX_DURATION;
     ClearSourceChain();
 #ifdef TIME_DEBUG
     s_Errors  = 0;
@@ -196,11 +311,14 @@ Time_Init() {
 void
 Time_Uninit() {
     DEBUG_P("Time: uninit\n");
-    while (s_Peers) {
-        Peer* p = s_Peers;
-        s_Peers = s_Peers->Next;
-        free(p);
+    for (uint8_t bucket = 0; bucket < TIME_PEER_BUCKETS; ++bucket) {
+        while (s_Peers[bucket]) {
+            Peer* p = s_Peers[bucket];
+            s_Peers[bucket] = p->Next;
+            Pool_Free(&s_PeerPool, p);
+        }
     }
+    Pool_Uninit(&s_PeerPool);
 }
 
 uint32_t
@@ -233,6 +351,7 @@ BroadcastMessage() {
     t->Originator = t->Sender;
     t->SequenceNumber = s_SequenceNumber;
     t->Stratum = s_Stratum;
+    t->Window = s_Window / TIME_WINDOW_UNIT;
     t->TimeToInterval = s_TimeToNextInterval;
     t->LocalTime = s_Mono;
     memcpy(t->Sources, s_Sources, sizeof(s_Sources));
@@ -252,11 +371,82 @@ TerminateInterval() {
     s_Flags &= ~(_BV(TIME_INTERVAL) | _BV(TIME_M1) | _BV(TIME_M2));
 }
 
+static
+uint16_t
+Guard() {
+    uint32_t guard = TIME_GUARD_MIN + UINT32_C(4) * s_SyncError;
+    if (s_Stratum != NOT_SYNCED_MARKER) {
+        guard += (uint32_t)s_Stratum * TIME_GUARD_PER_STRATUM;
+    }
+    return guard > TIME_GUARD_MAX ? TIME_GUARD_MAX : guard;
+}
+
+static
+void
+AdoptWindow(const Peer* peer) {
+    if (peer->Window) {
+        s_Window = (uint16_t)peer->Window * TIME_WINDOW_UNIT;
+    }
+}
+
+static
+uint16_t
+CorrectDrift(uint16_t millisecondsElapsed) {
+    s_DriftRemainder += (int32_t)millisecondsElapsed * s_Drift;
+    const int32_t correction = s_DriftRemainder / (INT32_C(1) << TIME_DRIFT_SHIFT);
+    s_DriftRemainder -= correction * (INT32_C(1) << TIME_DRIFT_SHIFT);
+
+    const int32_t corrected = (int32_t)millisecondsElapsed - correction;
+    if (corrected < 0) {
+        return 0;
+    }
+    return corrected > UINT16_MAX ? UINT16_MAX : (uint16_t)corrected;
+}
+
+static
+void
+EstimateDrift(uint8_t address, uint32_t predicted, uint32_t measured) {
+    const uint32_t elapsed = s_Mono - s_LastSyncTime;
+    if (address == s_LastSyncPeer && elapsed >= TIME_DRIFT_MIN_ELAPSED) {
+        // more time left than predicted means the local clock ran fast
+        int32_t error = (int32_t)(measured - predicted);
+        while (error > (int32_t)(NETWORK_PERIOD/2)) {
+            error -= NETWORK_PERIOD;
+        }
+        while (error < -(int32_t)(NETWORK_PERIOD/2)) {
+            error += NETWORK_PERIOD;
+        }
+
+        if (error >= -(int32_t)TIME_DRIFT_MAX_ERROR && error <= (int32_t)TIME_DRIFT_MAX_ERROR) {
+            const int32_t deviation = (error < 0 ? -error : error) - s_SyncError;
+            s_SyncError += deviation / 4;
+
+            int32_t drift = s_Drift + (int32_t)((((int64_t)error) << TIME_DRIFT_SHIFT) / (int64_t)elapsed / (1 << TIME_DRIFT_GAIN_SHIFT));
+            if (drift > TIME_DRIFT_MAX) {
+                drift = TIME_DRIFT_MAX;
+            } else if (drift < -TIME_DRIFT_MAX) {
+                drift = -TIME_DRIFT_MAX;
+            }
+            s_Drift = drift;
+            DEBUG_P("Time: error %" PRId32 " over %" PRIu32 ", drift %" PRId32 " ppm\n", error, elapsed, Time_GetDriftPpm());
+        } else {
+            s_SyncError = TIME_SYNC_ERROR_UNKNOWN;
+        }
+    }
+
+    s_LastSyncPeer = address;
+    s_LastSyncTime = s_Mono;
+}
+
 void
 Time_Update(uint16_t millisecondsElapsed) {
+    millisecondsElapsed = CorrectDrift(millisecondsElapsed);
     s_Mono += millisecondsElapsed;
 
-    PrunePeers();
+    if (!IsInWindow32(s_Mono, TIME_PRUNE_INTERVAL, s_LastPruneTime)) {
+        s_LastPruneTime = s_Mono;
+        PrunePeers();
+    }
 
     if (s_Flags & _BV(TIME_BROADCAST)) {
         if (s_Flags & _BV(TIME_SCAN)) {
@@ -265,11 +455,11 @@ Time_Update(uint16_t millisecondsElapsed) {
             }
         } else {
             if (s_Flags & _BV(TIME_INTERVAL)) {
-                const int8_t withinListenPeriod = IsInWindow32(s_Mono, NETWORK_RXTX_DURATION, s_StartOfInterval);
+                const int8_t withinListenPeriod = IsInWindow32(s_Mono, s_IntervalDuration, s_StartOfInterval);
                 if (withinListenPeriod) {
                     if (s_Stratum != NOT_SYNCED_MARKER) {
-                        const uint32_t m1Offset = NETWORK_RXTX_DURATION/3;
-                        const uint32_t m2Offset = (UINT32_C(2)*NETWORK_RXTX_DURATION)/3;
+                        const uint32_t m1Offset = s_IntervalWindow/2;
+                        const uint32_t m2Offset = s_IntervalWindow;
                         int8_t third = IsInWindow32(s_Mono, m1Offset, s_StartOfInterval);
                         int8_t twoThird = IsInWindow32(s_Mono, m2Offset, s_StartOfInterval);
 
@@ -311,6 +501,8 @@ Time_Update(uint16_t millisecondsElapsed) {
                     uint32_t delayed = millisecondsElapsed - s_TimeToNextInterval;
                     s_StartOfInterval = s_Mono - delayed;
                     s_TimeToNextInterval = NETWORK_PERIOD - delayed;
+                    s_IntervalWindow = s_Window;
+                    s_IntervalDuration = s_Window + Guard();
                     ++s_SequenceNumber;
                     DEBUG_P("Time: %" PRIu32 " start of int %u\n", s_Mono, s_SequenceNumber);
                     if (s_Callback) {
@@ -335,10 +527,11 @@ Time_NotifyStartListening(uint8_t scan) {
         DEBUG_P("Time: %" PRIu32 " listen\n", s_Mono);
     }
 
-    for (Peer* p = s_Peers; p; p = p->Next) {
+    for (Peer* p = FirstPeer(); p; p = NextPeer(p)) {
         p->RequestReceived = 0;
         p->PeerReplyIndex = 0;
         p->PeerReplyCount = 0;
+        p->PeerTwoWayDelaySum = 0;
         p->Stratum = NOT_SYNCED_MARKER;
         ClearSourceChainPtr(p->Sources);
     }
@@ -420,7 +613,7 @@ Time_NotifyStopListening() {
         Peer* best1 = NULL;
         Peer* best0 = NULL;
 
-        for (Peer* p = s_Peers; p; p = p->Next) {
+        for (Peer* p = FirstPeer(); p; p = NextPeer(p)) {
 #ifdef TIME_DEBUG
             DEBUG_P("Time: peer %02x, stratum %u, seq %u, rc %u, rr? %u, src: ", p->Address, p->Stratum, p->LastSequenceNumber, p->PeerReplyCount, p->RequestReceived);
             for (uint8_t i = 0; i < _countof(p->Sources); ++i) {
@@ -494,7 +687,10 @@ Time_NotifyStopListening() {
 
             const uint8_t lastIndex = best->PeerReplyIndex ? 0 : 1;
             uint32_t elapsed = (s_Mono - best->PeerReplyTimes[lastIndex]);
+            const uint32_t predicted = s_TimeToNextInterval;
             s_TimeToNextInterval = (best->PeerTimesToInterval[lastIndex] - elapsed - oneWayDelay) % (2*NETWORK_PERIOD);
+            EstimateDrift(best->Address, predicted, s_TimeToNextInterval);
+            AdoptWindow(best);
             DEBUG_P("Time: sync to %02x stratum %u -> %u\n", best->Address, best->Stratum, s_Stratum);
             DEBUG_P("Time: tti %" PRIu32 "\n", s_TimeToNextInterval);
 #ifdef TIME_DEBUG
@@ -510,7 +706,10 @@ Time_NotifyStopListening() {
             DEBUG_P("Time: one way delay %u\n", oneWayDelay);
 
             uint32_t elapsed = s_Mono - best->PeerReplyTimes[0];
+            const uint32_t predicted = s_TimeToNextInterval;
             s_TimeToNextInterval = (best->PeerTimesToInterval[0] - elapsed - oneWayDelay) % (2*NETWORK_PERIOD);
+            EstimateDrift(best->Address, predicted, s_TimeToNextInterval);
+            AdoptWindow(best);
             DEBUG_P("Time: sync to %02x stratum %u -> %u\n", best->Address, best->Stratum, s_Stratum);
             DEBUG_P("Time: tti %" PRIu32 "\n", s_TimeToNextInterval);
 #ifdef TIME_DEBUG
@@ -524,6 +723,9 @@ Time_NotifyStopListening() {
             DEBUG_P("Time: latch on to time of %02x stratum %u -> %u\n", best->Address, best->Stratum, s_Stratum);
             uint32_t elapsed = s_Mono - best->TimeOfRequest;
             s_TimeToNextInterval = (best->TimeToIntervalOfRequest - elapsed) % (2*NETWORK_PERIOD);
+            s_LastSyncPeer = NOT_SYNCED_MARKER; // too coarse to estimate drift from
+            s_SyncError = TIME_SYNC_ERROR_UNKNOWN;
+            AdoptWindow(best);
             DEBUG_P("Time: tti %" PRIu32 "\n", s_TimeToNextInterval);
 #ifdef TIME_DEBUG
             ++s_Counts[0];
@@ -579,6 +781,7 @@ Time_Process(NetworkPacket* packet) {
             if (!peer->RequestReceived) {
                 peer->RequestReceived = 1;
                 peer->Stratum = t->Stratum;
+                peer->Window = t->Window;
                 memcpy(peer->Sources, t->Sources, sizeof(peer->Sources));
             }
 
@@ -595,6 +798,7 @@ Time_Process(NetworkPacket* packet) {
 
         t->TimeToInterval = s_TimeToNextInterval;
         t->Stratum = s_Stratum;
+        t->Window = s_Window / TIME_WINDOW_UNIT;
         t->Sender = myId;
         memcpy(t->Sources, s_Sources, sizeof(t->Sources));
         Network_Send(packet);
@@ -629,6 +833,7 @@ Time_Process(NetworkPacket* packet) {
             //peer->PeerOneWayDelay[peer->PeerReplyIndex] = (s_Mono - t->LocalTime) / 2;
             peer->PeerTwoWayDelaySum += s_Mono - t->LocalTime;
             peer->Stratum = t->Stratum;
+            peer->Window = t->Window;
             memcpy(peer->Sources, t->Sources, sizeof(peer->Sources));
 
 
@@ -682,6 +887,36 @@ Time_SetSyncWindowCallback(Time_SyncWindowCallback callback) {
     s_Callback = callback;
 }
 
+int32_t
+Time_GetDriftPpm() {
+    return (int32_t)(((int64_t)s_Drift * 1000000) >> TIME_DRIFT_SHIFT);
+}
+
+void
+Time_SetWindow(uint32_t milliseconds) {
+    if (milliseconds < TIME_WINDOW_UNIT) {
+        milliseconds = TIME_WINDOW_UNIT;
+    } else if (milliseconds > UINT32_C(255) * TIME_WINDOW_UNIT) {
+        milliseconds = UINT32_C(255) * TIME_WINDOW_UNIT;
+    }
+    s_Window = (milliseconds / TIME_WINDOW_UNIT) * TIME_WINDOW_UNIT;
+}
+
+uint32_t
+Time_GetWindowDuration() {
+    return (uint32_t)s_Window + Guard();
+}
+
+uint16_t
+Time_GetInterval() {
+    return s_SequenceNumber;
+}
+
+void
+Time_ResetInterval() {
+    s_SequenceNumber = 0;
+}
+
 void
 Time_BroadcastTime() {
     BroadcastMessage();
@@ -57,6 +57,22 @@ void Time_NotifyStartListening(uint8_t scan);
 void Time_NotifyStopListening();
 void Time_SetStratum(int16_t stratum);
 void Time_BroadcastTime();
+/* Returns the estimated local clock drift, positive if it runs fast */
+int32_t Time_GetDriftPpm();
+/* Sets the sync and send/receive window advertised to the network, rounded
+ * to on-air resolution. Only meaningful on the time source.
+ */
+void Time_SetWindow(uint32_t milliseconds);
+/* Returns how long the radio needs to listen from the start of an interval */
+uint32_t Time_GetWindowDuration();
+/* Returns the sequence number of the current interval. It counts intervals
+ * of this node only and survives a watchdog or external reset.
+ */
+uint16_t Time_GetInterval();
+/* Restarts the interval count at 0. Call on a power-on or brown-out reset,
+ * the count is random then.
+ */
+void Time_ResetInterval();
 
 
 #ifdef __cplusplus
@@ -29,6 +29,7 @@
 #include "../../Network.h"
 #include "../../Time.h"
 #include "../../TCP.h"
+#include "../../Reading.h"
 #include "../DHT.h"
 
 //#define ACTIVE_SLEEP
@@ -551,6 +552,8 @@ static int8_t s_Temperature_Corr_Values[TMP_CORR_COUNT] EEMEM;
 static int8_t s_Temperature_Corr_Offsets[TMP_CORR_COUNT] EEMEM;
 static int8_t s_Battery_Corr_Values[BAT_CORR_COUNT] EEMEM;
 static int8_t s_Battery_Corr_Offsets[BAT_CORR_COUNT] EEMEM;
+static uint8_t s_EEP_IntervalEpoch EEMEM; // flips on every power-on
+static uint16_t s_IntervalEpoch NOINIT; // READING_INTERVAL_EPOCH or 0
 
 CORR_Instance(s_HumidityCorrections, s_Humidity_Corr_Values, s_Humidity_Corr_Offsets, HUM_CORR_COUNT);
 CORR_Instance(s_TemperatureCorrections, s_Temperature_Corr_Values, s_Temperature_Corr_Offsets, TMP_CORR_COUNT);
@@ -1041,6 +1044,7 @@ PrintHelp(FILE* stream) {
         "  !dhtt : <value> write DHT sensor type\n"
 
         "  ?mcsr : read MCUSR from boot\n"
+        "  ?mfre : read free RAM between heap and stack\n"
 
         "  ?name : read node name\n"
         "  !name : write node name (7 chars)\n"
@@ -1078,6 +1082,15 @@ PrintHelp(FILE* stream) {
 }
 
 
+static
+uint16_t
+FreeRam() {
+    extern char __heap_start;
+    extern char* __brkval;
+    char top;
+    return (uint16_t)(&top - (__brkval ? __brkval : &__heap_start));
+}
+
 static
 int8_t
 TryParseULong(char** str, unsigned long* value, int8_t base) {
@@ -1325,6 +1338,10 @@ ProcessCommand(FILE* stream, char* input, uint8_t len) {
             } break;
         } break;
     case 'M':
+        if (input[o+1] == 'F') {
+            fprintf_P(stream, PSTR("%u [bytes]\n"), FreeRam());
+            return 1;
+        }
         fprintf_P(stream, PSTR("%02x\n"), s_Mcusr);
         return 1;
     case 'N':
@@ -1696,7 +1713,7 @@ ProcessMode(void* ctx) {
                         FEAT_Acquire(_BV(FEAT_USART0) | _BV(FEAT_RF24));
                     }
 
-                    fprintf_P(s_FILE_USART0, PSTR("Resume command processing for %" PRIu32 " [ms]\n"), NETWORK_RXTX_DURATION);
+                    fprintf_P(s_FILE_USART0, PSTR("Resume command processing for %" PRIu32 " [ms]\n"), Time_GetWindowDuration());
                     WORK_RequestUpdate(ProcessMode, 0);
                 } else if (c->Run) {
                     WORK_RequestUpdate(ProcessMode, Step);
@@ -1768,12 +1785,32 @@ ProcessMode(void* ctx) {
                             fprintf_P(s_FILE_USART0, PSTR("Device reports %d °C, %d %%rH, %u mV\n"), temperature, humidity, mv);
                             // let TCP handle it from here
                             uint8_t via = Batman_Route(s_Network_TargetId);
-                            char buffer[TCP_PAYLOAD_SIZE];
-                            int8_t bytes = snprintf_P((char*)buffer, sizeof(buffer), PSTR("WB%s;%d;%d;%u;%u;%02x"), s_Name, temperature, humidity, mv, c->Humidity, via);
+#ifdef READING_BINARY
+                            Reading reading;
+                            reading.Name = s_Name;
+                            reading.NameLength = strlen(s_Name);
+                            reading.Temperature = temperature;
+                            reading.Humidity = humidity;
+                            reading.MilliVolts = mv;
+                            reading.RawHumidity = c->Humidity;
+                            reading.Via = via;
+                            reading.Interval = (Time_GetInterval() & ~READING_INTERVAL_EPOCH) | s_IntervalEpoch;
+                            reading.Flags = READING_FLAG_INTERVAL;
+                            uint8_t buffer[TCP_MESSAGE_SIZE];
+                            uint8_t bytes = Reading_Encode(buffer, sizeof(buffer), &reading);
+#else
+                            char buffer[TCP_MESSAGE_SIZE];
+                            int bytes = snprintf_P((char*)buffer, sizeof(buffer), PSTR("WB%s;%d;%d;%u;%u;%02x"), s_Name, temperature, humidity, mv, c->Humidity, via);
+                            if (bytes >= (int)sizeof(buffer)) {
+                                bytes = sizeof(buffer) - 1;
+                            }
                             DEBUG_P("%s\n", buffer);
-                            TCP_Send(s_Network_TargetId, (const uint8_t*)buffer, bytes);
+#endif
+                            if (bytes <= 0 || !TCP_SendMessage(s_Network_TargetId, (const uint8_t*)buffer, bytes)) {
+                                fprintf_P(s_FILE_USART0, PSTR("Reading not sent\n"));
+                            }
                         }
-                    } else if (!IsInWindow32(now, NETWORK_RXTX_DURATION, c->StartOfInterval)) {
+                    } else if (!IsInWindow32(now, Time_GetWindowDuration(), c->StartOfInterval)) {
                         DEBUG_P("Default: stop\n");
                         c->Run = 0;
                     }
@@ -1956,7 +1993,7 @@ SyncTime(void* ctx) {
                 } else {
                     USART0_SendString_P(PSTR("Scan successful\n"));
                     c->State = SYNC_TIME_STATE_SYNCED_DEACTIVATE_RF24;
-                    WORK_RequestUpdate(SyncTime, NETWORK_RXTX_DURATION);
+                    WORK_RequestUpdate(SyncTime, Time_GetWindowDuration());
                     Time_NotifyStartListening(0);
                 }
                 FEAT_Release(_BV(FEAT_USART0));
@@ -1967,7 +2004,7 @@ SyncTime(void* ctx) {
     case SYNC_TIME_STATE_SYNCED_ACTIVATE_RF24:
         DEBUG_P("SYNC_TIME_STATE_SYNCED_ACTIVATE_RF24\n");
         FEAT_Acquire(_BV(FEAT_RF24));
-        WORK_RequestUpdate(SyncTime, NETWORK_RXTX_DURATION);
+        WORK_RequestUpdate(SyncTime, Time_GetWindowDuration());
         c->State = SYNC_TIME_STATE_SYNCED_DEACTIVATE_RF24;
         Time_NotifyStartListening(0);
         break;
@@ -1982,7 +2019,7 @@ SyncTime(void* ctx) {
                 WORK_RequestUpdate(SyncTime, timeTillInterval);
                 FEAT_Release(_BV(FEAT_RF24));
             } else {
-                WORK_RequestUpdate(SyncTime, NETWORK_RXTX_DURATION);
+                WORK_RequestUpdate(SyncTime, Time_GetWindowDuration());
                 Time_NotifyStartListening(0);
             }
         } else {
@@ -2224,6 +2261,7 @@ main() {
         putc('\n', s_FILE_USART0);
         fprintf_P(s_FILE_USART0, PSTR("Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>"));
         putc('\n', s_FILE_USART0);
+        fprintf_P(s_FILE_USART0, PSTR("Free RAM %u [bytes]\n"), FreeRam());
         putc('\n', s_FILE_USART0);
     }
     {
@@ -2239,6 +2277,16 @@ main() {
             USART0_SendString_P(str);
         }
     }
+    {
+        // RAM is random after power loss, count intervals in a new epoch
+        uint8_t epoch = eeprom_read_byte(&s_EEP_IntervalEpoch);
+        if (s_Mcusr & (_BV(PORF) | _BV(BORF))) {
+            Time_ResetInterval();
+            epoch ^= 1;
+            eeprom_write_byte(&s_EEP_IntervalEpoch, epoch);
+        }
+        s_IntervalEpoch = (epoch & 1) ? READING_INTERVAL_EPOCH : 0;
+    }
 
     RF24_Init();
     RF24_SetMessageReceivedCallback(RF24_MessageReceivedHandler);
@@ -27,6 +27,9 @@ typedef struct _epoll_callback_data {
 }
 epoll_callback_data;
 
+/* Maximum number of worker threads of the epoll event loop */
+#define EPOLL_LOOP_MAX_WORKERS 16
+
 /* Creates the epoll event loop
  *
  * Return: The epoll file descriptor on success, else -1. Use errno for details.
@@ -34,9 +37,29 @@ epoll_callback_data;
  */
 extern int epoll_loop_create();
 
-/* Returns the epoll file descriptor. The value is -1 if no loop exists. */
+/* Creates the epoll event loop with the given number of worker threads
+ *
+ * Each worker has its own epoll instance. A file descriptor is served by
+ * the worker whose epoll instance it was added to. If the loop already
+ * exists only its reference count is incremented.
+ *
+ * Return: The epoll file descriptor of worker 0 on success, else -1. Use errno for details.
+ *
+ */
+extern int epoll_loop_create_workers(int workers);
+
+/* Returns the epoll file descriptor of worker 0. The value is -1 if no loop exists. */
 extern int epoll_loop_get_fd();
 
+/* Returns the epoll file descriptor of a worker. The value is -1 if no such worker exists. */
+extern int epoll_loop_get_worker_fd(int worker);
+
+/* Returns the number of worker threads */
+extern int epoll_loop_get_worker_count();
+
+/* Returns the index of the worker calling this function, -1 if not called from a worker */
+extern int epoll_loop_get_current_worker();
+
 /* Decrement the loop reference cout
  *
  * If the ref count drops to 0 the epoll instance and other resources related
@@ -23,7 +23,9 @@
 
 #include <linuxapi/linuxapi.h>
 
+#include <sys/eventfd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -33,38 +35,84 @@
 
 #define MinBufferSize  4
 
-
-static pthread_mutex_t s_Lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_t s_EPollThread;
+/* Workers never take s_Lock. Callbacks live in a table of pointers to
+ * immutable entries which writers replace atomically. The table itself
+ * is copied when it needs to grow. The table is shared by all workers,
+ * a handle is only ever registered with one of them.
+ *
+ * A worker's epoch is odd while it dispatches a batch of events.
+ * Writers on other threads wait for the batches in progress to finish
+ * before freeing what they replaced (RCU style). Writers on a worker
+ * must not wait for other workers, they queue the memory on s_Retired
+ * which is reclaimed by later writers.
+ *
+ * Outside of a batch workers only read s_CallbacksSize, never the table.
+ *
+ * Workers are stopped by signaling their stop eventfd, never cancelled,
+ * so they don't exit while a callback holds a lock.
+ */
+typedef struct _retired {
+    struct _retired* next;
+    unsigned epochs[EPOLL_LOOP_MAX_WORKERS];
+} retired;
+
+typedef struct _callback_entry {
+    retired r;
+    epoll_callback_data data;
+} callback_entry;
+
+typedef struct _callback_table {
+    retired r;
+    int size;
+    callback_entry* slots[1];
+} callback_table;
+
+typedef struct _worker {
+    pthread_t thread;
+    int fd;
+    int stopFd;
+    int index;
+    unsigned epoch;
+    volatile int running;
+    struct epoll_event* events;
+} worker;
+
+static pthread_mutex_t s_Lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP; /* serializes writers */
 static int s_RefCount;
-static int s_EPollFd = -1;
-static epoll_callback_data* s_Callbacks;
+static worker s_Workers[EPOLL_LOOP_MAX_WORKERS];
+static int s_WorkerCount;
+static callback_table* s_Callbacks;
 static int s_CallbacksSize;
-static volatile int s_Running = 0;
-static struct epoll_event* s_Events = NULL;
+static retired* s_Retired;
+static __thread int s_CurrentWorker = -1;
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
 
 static
 void*
 EPollThreadMain(void* arg) {
-    const int epollFd = s_EPollFd;
+    worker* w = (worker*)arg;
+    const int epollFd = w->fd;
     int count = 0, bufferSize = 0;
 
-    s_Running = 1;
+    s_CurrentWorker = w->index;
+    STORE(w->running, 1);
 
     for (;;) {
-        pthread_mutex_lock(&s_Lock);
-        if (!s_Events) {
-            bufferSize = s_CallbacksSize >= MinBufferSize ? s_CallbacksSize : MinBufferSize;
-            s_Events = (struct epoll_event*)malloc(bufferSize * sizeof(*s_Events));
-            if (!s_Events) goto Exit;
-        } else if (bufferSize < s_CallbacksSize) {
-            s_Events = (struct epoll_event*)realloc(s_Events, s_CallbacksSize * sizeof(*s_Events));
-            if (!s_Events) goto Exit;
-            bufferSize = s_CallbacksSize;
+        const int callbacksSize = LOAD(s_CallbacksSize);
+        if (!w->events) {
+            bufferSize = callbacksSize >= MinBufferSize ? callbacksSize : MinBufferSize;
+            w->events = (struct epoll_event*)malloc(bufferSize * sizeof(*w->events));
+            if (!w->events) goto Exit;
+        } else if (bufferSize < callbacksSize) {
+            struct epoll_event* events = (struct epoll_event*)realloc(w->events, callbacksSize * sizeof(*w->events));
+            if (!events) goto Exit;
+            w->events = events;
+            bufferSize = callbacksSize;
         }
-        pthread_mutex_unlock(&s_Lock);
 
-        count = epoll_wait(epollFd, s_Events, bufferSize, -1);
+        count = epoll_wait(epollFd, w->events, bufferSize, -1);
 
         if (count < 0) {
             switch (errno) {
@@ -77,57 +125,196 @@ EPollThreadMain(void* arg) {
                 goto Exit;
             }
         } else {
+            callback_table* table;
+            int stop = 0;
             int i;
 
-            pthread_mutex_lock(&s_Lock);
+            __atomic_add_fetch(&w->epoch, 1, __ATOMIC_SEQ_CST);
 
             for (i = 0; i < count; ++i) {
-                struct epoll_event* ev = &s_Events[i];
+                struct epoll_event* ev = &w->events[i];
+
+                if (ev->data.fd == w->stopFd) {
+                    stop = 1;
+                    continue;
+                }
 
-                if (ev->data.fd < s_CallbacksSize) {
-                    if (s_Callbacks[ev->data.fd].callback) {
-                        s_Callbacks[ev->data.fd].callback(s_Callbacks[ev->data.fd].ctx, ev);
+                /* reload, a callback may have replaced either */
+                table = LOAD(s_Callbacks);
+                if (table && ev->data.fd < table->size) {
+                    callback_entry* entry = LOAD(table->slots[ev->data.fd]);
+                    if (entry && entry->data.callback) {
+                        entry->data.callback(entry->data.ctx, ev);
                     }
                 }
             }
 
-            pthread_mutex_unlock(&s_Lock);
+            __atomic_add_fetch(&w->epoch, 1, __ATOMIC_SEQ_CST);
+
+            if (stop) goto Exit;
         }
     }
 
 Exit:
-    s_Running = 0;
+    STORE(w->running, 0);
 
     return NULL;
 }
 
+static
+void
+Snapshot(retired* r) {
+    int i;
+
+    for (i = 0; i < s_WorkerCount; ++i) {
+        r->epochs[i] = LOAD(s_Workers[i].epoch);
+    }
+}
+
+/* True once no worker can still hold a pointer loaded before r was retired */
+static
+int
+GracePeriodOver(const retired* r) {
+    int i;
+
+    for (i = 0; i < s_WorkerCount; ++i) {
+        const unsigned epoch = r->epochs[i];
+        if ((epoch & 1) &&
+            epoch == LOAD(s_Workers[i].epoch) &&
+            LOAD(s_Workers[i].running)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Call with s_Lock held */
+static
+void
+ReclaimRetired() {
+    retired** link = &s_Retired;
+
+    while (*link) {
+        retired* r = *link;
+        if (GracePeriodOver(r)) {
+            *link = r->next;
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+}
+
+static
+void
+FreeTable(callback_table* table) {
+    int i;
+
+    if (table) {
+        for (i = 0; i < table->size; ++i) {
+            free(table->slots[i]);
+        }
+        free(table);
+    }
+}
+
+static
+void
+StopWorkers() {
+    int i;
+
+    for (i = 0; i < s_WorkerCount; ++i) {
+        const uint64_t one = 1;
+        ssize_t w;
+
+        while ((w = write(s_Workers[i].stopFd, &one, sizeof(one))) == -1 && errno == EINTR);
+        pthread_join(s_Workers[i].thread, NULL);
+        STORE(s_Workers[i].running, 0);
+        safe_close_ref(&s_Workers[i].stopFd);
+        safe_close_ref(&s_Workers[i].fd);
+        free(s_Workers[i].events);
+        s_Workers[i].events = NULL;
+    }
+    s_WorkerCount = 0;
+
+    FreeTable(s_Callbacks);
+    s_Callbacks = NULL;
+    s_CallbacksSize = 0;
+
+    while (s_Retired) {
+        retired* r = s_Retired;
+        s_Retired = r->next;
+        free(r);
+    }
+}
+
 int
 epoll_loop_create() {
+    return epoll_loop_create_workers(1);
+}
+
+int
+epoll_loop_create_workers(int workers) {
     int error = 0;
+    int i;
+
+    if (workers < 1 || workers > EPOLL_LOOP_MAX_WORKERS) {
+        errno = EINVAL;
+        return -1;
+    }
 
     pthread_mutex_lock(&s_Lock);
 
     if (++s_RefCount == 1) {
-        s_EPollFd = -1;
         s_Callbacks = NULL;
         s_CallbacksSize = 0;
-        s_Events = NULL;
-        s_Running = 0;
+        s_Retired = NULL;
+        s_WorkerCount = 0;
+        memset(s_Workers, 0, sizeof(s_Workers));
+
+        for (i = 0; i < workers; ++i) {
+            worker* w = &s_Workers[i];
+            struct epoll_event ev;
+
+            w->index = i;
+            w->stopFd = -1;
+            if ((w->fd = epoll_create1(O_CLOEXEC)) < 0) {
+                goto Error;
+            }
 
-        if ((s_EPollFd = epoll_create1(O_CLOEXEC)) < 0) {
-            goto Error;
-        }
+            if ((w->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                safe_close_ref(&w->fd);
+                goto Error;
+            }
 
-        if ((error = pthread_create(&s_EPollThread, NULL, EPollThreadMain, NULL)) < 0) {
-            goto Error;
-        }
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = w->stopFd;
+            if (epoll_ctl(w->fd, EPOLL_CTL_ADD, w->stopFd, &ev) < 0) {
+                error = errno;
+                safe_close_ref(&w->stopFd);
+                safe_close_ref(&w->fd);
+                errno = error;
+                goto Error;
+            }
+
+            if ((error = pthread_create(&w->thread, NULL, EPollThreadMain, w)) != 0) {
+                safe_close_ref(&w->stopFd);
+                safe_close_ref(&w->fd);
+                errno = error;
+                goto Error;
+            }
+
+            ++s_WorkerCount;
 
-        while (!s_Running) {
-            pthread_yield();
+            while (!LOAD(w->running)) {
+                pthread_yield();
+            }
         }
     }
 
-    error = s_EPollFd;
+    error = s_Workers[0].fd;
 
 Exit:
     pthread_mutex_unlock(&s_Lock);
@@ -135,7 +322,8 @@ Exit:
 
 Error:
     error = errno;
-    safe_close_ref(&s_EPollFd);
+    StopWorkers();
+    --s_RefCount;
     errno = error;
     error = -1;
     goto Exit;
@@ -146,18 +334,9 @@ epoll_loop_destroy() {
     pthread_mutex_lock(&s_Lock);
 
     if (--s_RefCount == 0) {
-        const int epollFd = s_EPollFd;
-        struct epoll_event* events = s_Events;
-        epoll_callback_data* callbacks = s_Callbacks;
-        pthread_t thread = s_EPollThread;
-
+        /* callbacks may block on s_Lock, don't hold it while joining */
         pthread_mutex_unlock(&s_Lock);
-        pthread_cancel(thread);
-        pthread_join(thread, NULL);
-
-        safe_close(epollFd);
-        free(events);
-        free(callbacks);
+        StopWorkers();
     } else {
         pthread_mutex_unlock(&s_Lock);
     }
@@ -166,6 +345,10 @@ epoll_loop_destroy() {
 int
 epoll_loop_set_callback(int handle, epoll_callback_data callback) {
     int error = 0;
+    callback_table* table = NULL;
+    callback_table* retiredTable = NULL;
+    callback_entry* entry = NULL;
+    callback_entry* retiredEntry = NULL;
 
     if (handle < 0) {
         errno = EINVAL;
@@ -173,54 +356,113 @@ epoll_loop_set_callback(int handle, epoll_callback_data callback) {
         goto Out;
     }
 
+    if (callback.callback) {
+        entry = (callback_entry*)malloc(sizeof(*entry));
+        if (!entry) {
+            errno = ENOMEM;
+            error = -1;
+            goto Out;
+        }
+        entry->data = callback;
+    }
+
     pthread_mutex_lock(&s_Lock);
 
-    if (!s_Callbacks) {
+    ReclaimRetired();
+
+    table = s_Callbacks;
+    if (!table || handle >= table->size) {
         size_t bytes;
-        s_CallbacksSize = MinBufferSize;
+        int size;
+
+        if (table) {
+            size = (table->size * 17) / 10; /* x 1.68 */
+        } else {
+            size = MinBufferSize;
+        }
 
-        if (handle + 1 > s_CallbacksSize) {
-            s_CallbacksSize = handle + 1;
+        if (handle + 1 > size) {
+            size = handle + 1;
         }
 
-        bytes = sizeof(*s_Callbacks) * (size_t)s_CallbacksSize;
-        s_Callbacks = (epoll_callback_data*)malloc(bytes);
-        if (!s_Callbacks) {
+        bytes = sizeof(*table) + sizeof(table->slots[0]) * (size_t)(size - 1);
+        table = (callback_table*)malloc(bytes);
+        if (!table) {
+            free(entry);
             errno = ENOMEM;
             error = -1;
             goto Exit;
         }
-        memset(s_Callbacks, 0, bytes);
-    } else if (handle >= s_CallbacksSize) {
-        size_t bytes;
-        int previousSize;
+        memset(table, 0, bytes);
+        table->size = size;
 
-        previousSize = s_CallbacksSize;
-        s_CallbacksSize = (s_CallbacksSize * 17) / 10; /* x 1.68 */
-        if (handle + 1 > s_CallbacksSize) {
-            s_CallbacksSize = handle + 1;
+        if (s_Callbacks) {
+            memcpy(table->slots, s_Callbacks->slots, sizeof(table->slots[0]) * (size_t)s_Callbacks->size);
+            retiredTable = s_Callbacks;
         }
+    }
 
-        bytes = sizeof(*s_Callbacks) * (size_t)s_CallbacksSize;
-        s_Callbacks = (epoll_callback_data*)realloc(s_Callbacks, bytes);
-        if (!s_Callbacks) {
-            errno = ENOMEM;
-            error = -1;
-            goto Exit;
+    retiredEntry = table->slots[handle];
+    STORE(table->slots[handle], entry);
+    STORE(s_Callbacks, table);
+    STORE(s_CallbacksSize, table->size);
+
+    if (s_CurrentWorker >= 0) {
+        /* slots were moved to the new table */
+        if (retiredTable) {
+            Snapshot(&retiredTable->r);
+            retiredTable->r.next = s_Retired;
+            s_Retired = &retiredTable->r;
+        }
+
+        if (retiredEntry) {
+            Snapshot(&retiredEntry->r);
+            retiredEntry->r.next = s_Retired;
+            s_Retired = &retiredEntry->r;
         }
-        memset(s_Callbacks + previousSize, 0, sizeof(*s_Callbacks) * (size_t)(s_CallbacksSize - previousSize));
-    }
 
-    s_Callbacks[handle] = callback;
+        retiredTable = NULL;
+        retiredEntry = NULL;
+    }
 
 Exit:
     pthread_mutex_unlock(&s_Lock);
 
+    if (retiredEntry || retiredTable) {
+        retired r;
+        Snapshot(&r);
+        while (!GracePeriodOver(&r)) {
+            sched_yield();
+        }
+
+        free(retiredEntry);
+        free(retiredTable);
+    }
+
 Out:
     return error;
 }
 
 int
 epoll_loop_get_fd() {
-    return s_EPollFd;
+    return epoll_loop_get_worker_fd(0);
+}
+
+int
+epoll_loop_get_worker_fd(int worker) {
+    if (worker < 0 || worker >= s_WorkerCount) {
+        return -1;
+    }
+
+    return s_Workers[worker].fd;
+}
+
+int
+epoll_loop_get_worker_count() {
+    return s_WorkerCount;
+}
+
+int
+epoll_loop_get_current_worker() {
+    return s_CurrentWorker;
 }
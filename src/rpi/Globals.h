@@ -7,6 +7,27 @@
 #define RF24_NETWORK_APP_NAME "rf24-network"
 #define RF24_NETWORK_SOCKET_PATH "/tmp/" RF24_NETWORK_APP_NAME
 
+#define RF24_SIM_APP_NAME "rf24-sim"
+
+#define RF24_QUERY_APP_NAME "rf24-query"
+#define RF24_STORE_PATH "/var/lib/rf24"
+
+/* Frame the packet router sends to a client after a burst in which
+ * frames failed to transmit. The first byte reads as a network packet
+ * of type 3 which isn't used on air. Only clients that asked get these:
+ * a client asks by writing a frame that starts with the marker, which
+ * the router doesn't transmit.
+ *
+ * byte 0: marker
+ * byte 1: frames in burst (saturated at 255)
+ * byte 2: frames that never made it into the tx fifo (saturated at 255)
+ * byte 3: flags
+ */
+#define RF24_PACKET_ROUTER_STATUS_MARKER 0xff
+/* The tx fifo was flushed while it held frames, up to 3 more frames
+ * than byte 2 says are lost. */
+#define RF24_PACKET_ROUTER_STATUS_FIFO_LOST 0x01
+
 
 
 #endif /* GLOBALS_H */
@@ -39,6 +39,7 @@
 #include <vector>
 
 #include "../Globals.h"
+#include "rf24_ipc.h"
 
 #define APPNAME "rf24-cli"
 #define FAIL(...) fprintf(stderr, "ERROR: " __VA_ARGS__)
@@ -62,13 +63,28 @@ struct Command {
 
 static const Command Commands[] = {
     { "help", "Prints this help", NULL },
-    { "route", "<2 hex chars> gets the netork id of next hop in route", NULL },
+    { "route", "<2 hex chars> ... gets the network id of next hop in route", NULL },
+    { "table", "Prints the next hop for all network ids", NULL },
+    { "time", "Prints the network time", NULL },
     { "quit", "Exits the program", NULL },
     { NULL, NULL, NULL },
 };
 
 
+static const cmdlopt_arg s_Dummy_Arg[] = {
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+
+static const char* s_NetworkSocketPath = RF24_NETWORK_SOCKET_PATH;
+static
+int
+NetworkSocketPath_Parser(void*, char* arg) {
+    s_NetworkSocketPath = arg;
+    return 0;
+}
+
 static const cmdlopt_opt s_Options[] = {
+    { "network-socket-path", "Path to UNIX socket. Defaults to " RF24_NETWORK_SOCKET_PATH, 0, 0x100, s_Dummy_Arg, NetworkSocketPath_Parser },
     CMDLOPT_COMMON_OPTIONS,
     CMDLOPT_OPTION_TERMINATOR
 };
@@ -76,7 +92,7 @@ static const cmdlopt_opt s_Options[] = {
 const int QuitError = 1;
 static int s_Socket = -1;
 static char s_CommandsHelp[512];
-static std::vector<char> s_Buffer;
+static uint16_t s_NextRequestId;
 
 int
 main(int argc, char** argv) {
@@ -88,7 +104,7 @@ main(int argc, char** argv) {
     cmdlopt_set_help_header("Usage: " APPNAME " [cmd ...]");
     cmdlopt_set_help_footer(s_CommandsHelp);
     cmdlopt_set_app_name(APPNAME);
-    cmdlopt_set_app_version("1.0\nCopyright (c) 2016 Jean Gressmann <jean@0x42.de>");
+    cmdlopt_set_app_version("1.1\nCopyright (c) 2016 Jean Gressmann <jean@0x42.de>");
     cmdlopt_set_options(s_Options);
     int error = cmdlopt_parse_cmdl(argc, argv, NULL);
 
@@ -135,7 +151,7 @@ main(int argc, char** argv) {
 
     memset(&socketAddress, 0, sizeof(socketAddress));
     socketAddress.sun_family = AF_UNIX;
-    strncpy(socketAddress.sun_path, RF24_NETWORK_SOCKET_PATH, sizeof(socketAddress.sun_path));
+    strncpy(socketAddress.sun_path, s_NetworkSocketPath, sizeof(socketAddress.sun_path) - 1);
     if (connect(s_Socket, (sockaddr*)&socketAddress, sizeof(socketAddress)) < 0) {
         FAIL("Failed to connect to AF_UNIX socket %s\n", socketAddress.sun_path);
         error = errno;
@@ -225,70 +241,94 @@ Sanatize(char*& input) {
     return len;
 }
 
+// Sends a request and waits for its reply. Replies to other requests are skipped.
 static
 bool
-Write(const char* ptr, size_t bytes) {
-Start:
-    ssize_t w = write(s_Socket, ptr, bytes);
-    if (w == -1) {
-        switch (errno) {
-        case EINTR:
-            goto Start;
-        default:
+Request(uint8_t type, const uint8_t* payload, uint16_t length, IpcHeader& header, uint8_t* reply) {
+    const uint16_t id = ++s_NextRequestId;
+
+    if (IpcWriteFrame(s_Socket, type, id, payload, length) < 0) {
+        FAIL("Failed to send request: %s\n", strerror(errno));
+        safe_close_ref(&s_Socket);
+        return false;
+    }
+
+    do {
+        if (IpcReadFrame(s_Socket, header, reply) < 0) {
+            FAIL("Failed to read reply: %s\n", strerror(errno));
             safe_close_ref(&s_Socket);
             return false;
         }
+    } while (header.Id != id);
+
+    if (header.Type == RF24_IPC_ERROR) {
+        FAIL("Request failed with error %u\n", header.Length ? reply[0] : 0);
+        return false;
     }
 
     return true;
 }
 
 static
-bool
-Read() {
-    s_Buffer.resize(0);
-    char buffer[32];
-Start:
-    ssize_t r = read(s_Socket, buffer, sizeof(buffer));
-    if (r == -1) {
-        switch (errno) {
-        case EINTR:
-            goto Start;
-        case EAGAIN:
-            if (s_Buffer.empty()) {
-                usleep(1000);
-                goto Start;
-            }
-            break;
-        default:
-            safe_close_ref(&s_Socket);
-            return false;
+void
+ProcessRoute(char* input) {
+    uint8_t addresses[RF24_IPC_MAX_PAYLOAD];
+    uint16_t count = 0;
+
+    Sanatize(input);
+
+    for (char* token = strtok(input, " \t"); token; token = strtok(NULL, " \t")) {
+        char* end = NULL;
+        unsigned long address = strtoul(token, &end, 16);
+        if (!end || *end || address > 0xff) {
+            fprintf(stderr, "Invalid network id '%s'.\n", token);
+            return;
         }
-    } else {
-        if (r) {
-            s_Buffer.insert(s_Buffer.end(), buffer, buffer + r);
-            goto Start;
+
+        if (count == RF24_IPC_MAX_PAYLOAD) {
+            fprintf(stderr, "Too many network ids.\n");
+            return;
         }
+
+        addresses[count++] = (uint8_t)address;
     }
 
-    return true;
+    if (!count) {
+        fprintf(stderr, "Command requires at least one argument (the id to route to).\n");
+        return;
+    }
+
+    IpcHeader header;
+    uint8_t reply[RF24_IPC_MAX_PAYLOAD];
+    if (Request(RF24_IPC_ROUTE, addresses, count, header, reply)) {
+        for (uint16_t i = 0; i < count && i < header.Length; ++i) {
+            fprintf(stdout, "%02x\n", reply[i]);
+        }
+    }
 }
 
 static
 void
-ProcessRoute(char* input) {
-    const size_t len = Sanatize(input);
-
-    if (!len) {
-        fprintf(stderr, "Command requires one arguments (the id to route to).\n");
-        return;
+ProcessTable() {
+    IpcHeader header;
+    uint8_t reply[RF24_IPC_MAX_PAYLOAD];
+    if (Request(RF24_IPC_ROUTE, NULL, 0, header, reply)) {
+        for (uint16_t i = 0; i < header.Length; ++i) {
+            if (reply[i] != 0xff) {
+                fprintf(stdout, "%02x -> %02x\n", i, reply[i]);
+            }
+        }
     }
+}
 
-    if (Write(input, len)) {
-        if (Read()) {
-            s_Buffer.push_back(0);
-            fprintf(stdout, "%s\n", &s_Buffer[0]);
-        }
+static
+void
+ProcessTime() {
+    IpcHeader header;
+    uint8_t reply[RF24_IPC_MAX_PAYLOAD];
+    if (Request(RF24_IPC_TIME, NULL, 0, header, reply) && header.Length >= 4) {
+        uint32_t now = reply[0] | (reply[1] << 8) | (reply[2] << 16) | ((uint32_t)reply[3] << 24);
+        fprintf(stdout, "%u\n", now);
     }
 }
 
@@ -302,7 +342,11 @@ ProcessInput(char *input) {
     }
 
     if (strncmp(input, "route", 5) == 0) {
-        ProcessRoute(input + 6);
+        ProcessRoute(input + 5);
+    } else if (strcmp("table", input) == 0) {
+        ProcessTable();
+    } else if (strcmp("time", input) == 0) {
+        ProcessTime();
     } else if (strcmp("?", input) == 0 || strcmp("help", input) == 0) {
       fprintf(stdout, s_CommandsHelp);
     } else {
@@ -26,7 +26,9 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -38,6 +40,8 @@
 #include <stdint.h>
 
 #include <set>
+#include <map>
+#include <vector>
 #include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
@@ -51,9 +55,14 @@
 #include "../../Batman.h"
 #include "../../Time.h"
 #include "../../TCP.h"
+#include "../../Pool.h"
+#include "../../Reading.h"
+#include "../../ReadingWindow.h"
 
 #include "Globals.h"
 #include "rf24_common.h"
+#include "rf24_ipc.h"
+#include "rf24_output.h"
 
 #ifndef UINT64_C
 #   define UINT64_C(x) static_cast<uint64_t>(x)
@@ -75,9 +84,14 @@
 static void EPollPacketRouterHandler(void* ctx, epoll_event* ev);
 static void EPollTimerHandler(void *ctx, epoll_event *ev);
 
+static void EPollQueryHandler(void *ctx, epoll_event *ev);
+
 static void EPollAcceptHandler(void* ctx, epoll_event* ev);
 static void EPollConnectionDataHandler(void* ctx, epoll_event* ev);
 
+// Batman, TCP and time state is only ever touched by this worker.
+#define PROTOCOL_WORKER 0
+
 
 static sem_t s_Shutdown;
 
@@ -183,6 +197,13 @@ TimeTick_Parser(void*, char* arg) {
     return UnsignedParser(arg, s_Time_Tick_Millis);
 }
 
+static uint32_t s_Time_Window_Millis = 0;
+static
+int
+TimeWindow_Parser(void*, char* arg) {
+    return UnsignedParser(arg, s_Time_Window_Millis);
+}
+
 static bool s_Time_BroadcastOnTick = true;
 static
 int
@@ -206,6 +227,52 @@ NetworkTtl_Parser(void*, char* arg) {
     return UnsignedParser(arg, s_Network_Ttl);
 }
 
+static int s_Workers = 1;
+static
+int
+Workers_Parser(void*, char* arg) {
+    int error = UnsignedParser(arg, s_Workers);
+    if (!error) {
+        if (s_Workers < 1 || s_Workers > EPOLL_LOOP_MAX_WORKERS) {
+            ERROR("Number of workers must be in range [1-%d]\n", EPOLL_LOOP_MAX_WORKERS);
+            error = -1;
+        }
+    }
+
+    return error;
+}
+
+static unsigned s_ClientQueue = 64;
+static
+int
+ClientQueue_Parser(void*, char* arg) {
+    int error = UnsignedParser(arg, s_ClientQueue);
+    if (!error) {
+        if (s_ClientQueue < 2) {
+            ERROR("Client queue must hold at least 2 records\n");
+            error = -1;
+        }
+    }
+
+    return error;
+}
+
+static bool s_ClientOverflowDisconnect = false;
+static
+int
+ClientOverflow_Parser(void*, char* arg) {
+    if (strcasecmp(arg, "drop") == 0) {
+        s_ClientOverflowDisconnect = false;
+    } else if (strcasecmp(arg, "disconnect") == 0) {
+        s_ClientOverflowDisconnect = true;
+    } else {
+        ERROR("Invalid client overflow policy '%s'\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
 static const cmdlopt_opt s_Options[] = {
     { "bat-enable", "Enables Batman. Defaults to yes.", 'b', 0x103, s_Dummy_Arg, BatmanEnabled_Parser },
     { "net-id", "Id to use for Network. Defauls to 0xfe (254).", 'i', 0x100, s_Dummy_Arg, Id_Parser },
@@ -217,7 +284,11 @@ static const cmdlopt_opt s_Options[] = {
     { "time-stratum", "Stratum of time. Lower values mean better clock. Defaults to 0.", 0, 0x111, s_Dummy_Arg, TimeStratum_Parser },
     { "time-tick", "Interval between time ticks. Defaults to 1000 [ms].", 0, 0x112, s_Dummy_Arg, TimeTick_Parser },
     { "time-broadcast-on-tick", "Broadcast the time on tick. Defaults to true.", 0, 0x113, s_Dummy_Arg, TimeBroadcastOnTick_Parser },
+    { "time-window", "Sync and send/receive window advertised to the network. Nodes add their own guard band. Defaults to 2/3 of the listen period.", 0, 0x115, s_Dummy_Arg, TimeWindow_Parser },
     { "time-tti", "Print time-to-interval (tti) periodically.", 0, 0x114, s_Dummy_Arg, TimePrintTti_Parser },
+    { "client-queue", "Number of records queued for a slow TCP client. Defaults to 64.", 0, 0x401, s_Dummy_Arg, ClientQueue_Parser },
+    { "client-overflow", "What to do if a TCP client's queue is full, drop (oldest record) or disconnect. Defaults to drop.", 0, 0x402, s_Dummy_Arg, ClientOverflow_Parser },
+    { "workers", "Number of event loop threads. Protocol state stays on the first, clients are spread across the others. Defaults to 1.", 'w', 0x400, s_Dummy_Arg, Workers_Parser },
     CMDLOPT_COMMON_OPTIONS,
     CMDLOPT_OPTION_TERMINATOR
 };
@@ -226,11 +297,45 @@ static const cmdlopt_opt s_Options[] = {
 static int s_TimerFd = -1;
 static int s_PacketRouterSocketFD = -1;
 static uint64_t s_LastIterationsTimestamp;
+static uint64_t s_TimerDeadline = UINT64_MAX; // protocol worker only
 static uint64_t s_LastTimeBroadcastTimestamp;
 typedef std::set<int> HandleSet;
+// Guards the connection sets and the query queue. Client fds are only
+// closed with the lock held so the protocol worker never writes to a
+// recycled fd.
+static pthread_mutex_t s_ConnectionsLock = PTHREAD_MUTEX_INITIALIZER;
 static HandleSet s_TcpConnections;
 static HandleSet s_Connections;
 static int s_In_SendReceive_Window;
+static int s_NextClientWorker;
+
+// Client queries that need protocol state are forwarded to the protocol
+// worker when they arrive on another worker. Binary (rf24_ipc.h)
+// requests all take this path so replies keep request order.
+struct Query {
+    int Fd;
+    bool Binary; // false for the legacy ASCII protocol
+    uint8_t Type; // RF24_IPC_*
+    uint16_t Id;
+    uint16_t Length;
+    uint8_t Payload[RF24_IPC_MAX_PAYLOAD];
+};
+typedef std::vector<Query> QueryQueue;
+static QueryQueue s_Queries;
+static int s_QueryEventFd = -1;
+
+// State of a client speaking the binary protocol
+struct IpcClient {
+    std::vector<uint8_t> Input; // only touched by the client's worker
+    uint16_t SubscriptionId;
+};
+typedef std::map<int, IpcClient*> IpcClientMap;
+static IpcClientMap s_IpcClients; // guarded by s_ConnectionsLock
+
+// Records pending for TCP clients, see rf24_output.h
+typedef std::map<int, OutputQueue*> OutputQueueMap;
+static OutputQueueMap s_OutputQueues; // guarded by s_ConnectionsLock
+
 static
 void
 NetworkSendCallback(NetworkPacket* packet) {
@@ -238,17 +343,126 @@ NetworkSendCallback(NetworkPacket* packet) {
     write(s_PacketRouterSocketFD, packet, sizeof(*packet));
 }
 
+static
+OutputQueue*
+CreateOutputQueue() {
+    return OutputQueue_Create(s_ClientQueue);
+}
+
+static
+void
+DestroyOutputQueue(int fd) {
+    OutputQueueMap::iterator it = s_OutputQueues.find(fd);
+    if (it != s_OutputQueues.end()) {
+        if (it->second->Dropped) {
+            LOG("Dropped %u records for client %d\n", it->second->Dropped, fd);
+        }
+        OutputQueue_Destroy(it->second);
+        s_OutputQueues.erase(it);
+    }
+}
+
+// Call with s_ConnectionsLock held
+static
+void
+FlushOutputQueue(int fd, OutputQueue* queue) {
+    const int drained = OutputQueue_Flush(queue, fd);
+    if (drained < 0) {
+        shutdown(fd, SHUT_RDWR);
+    } else if (drained && queue->Release) {
+        DestroyOutputQueue(fd);
+    }
+}
+
+// Call with s_ConnectionsLock held
+static
+void
+SendToClient(int fd, const uint8_t* data, size_t size) {
+    OutputQueueMap::iterator it = s_OutputQueues.find(fd);
+    if (it == s_OutputQueues.end()) {
+        write(fd, data, size);
+        return;
+    }
+
+    OutputQueue* queue = it->second;
+    int sent = OutputQueue_Send(queue, fd, data, size);
+    if (!sent) {
+        if (s_ClientOverflowDisconnect) {
+            ERROR("Client %d can't keep up, disconnecting\n", fd);
+            s_TcpConnections.erase(fd);
+            DestroyOutputQueue(fd);
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+
+        OutputQueue_DropOldest(queue);
+        sent = OutputQueue_Send(queue, fd, data, size);
+    }
+
+    if (sent < 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+// Call with s_ConnectionsLock held
+static
+void
+SendIpcFrame(int fd, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length) {
+    uint8_t frame[RF24_IPC_MAX_FRAME];
+    const size_t bytes = IpcEncode(frame, type, id, payload, length);
+    SendToClient(fd, frame, bytes);
+}
+
+// Call with s_ConnectionsLock held
+static
+void
+SendIpcError(int fd, uint16_t id, uint8_t error, uint8_t type) {
+    uint8_t payload[2];
+    payload[0] = error;
+    payload[1] = type;
+    SendIpcFrame(fd, RF24_IPC_ERROR, id, payload, sizeof(payload));
+}
+
+static ReadingWindow s_ReadingWindows[256];
+static uint32_t s_DuplicateReadings;
+
 static
 void
 TcpDataReceived(uint8_t sender, const uint8_t* payload, uint8_t size) {
+    Reading reading;
+    if (Reading_Parse(payload, size, &reading) == 0 &&
+        (reading.Flags & READING_FLAG_INTERVAL) &&
+        ReadingWindow_Add(&s_ReadingWindows[sender], reading.Interval)) {
+        DEBUG("Drop duplicate reading of %02x for interval %u\n", sender, reading.Interval);
+        ++s_DuplicateReadings;
+        return;
+    }
+
+    uint8_t record[2 + 255];
+    record[0] = sender;
+    record[1] = size;
+    memcpy(record + 2, payload, size);
+
+    uint8_t data[1 + 255]; // binary DATA payload
+    data[0] = sender;
+    memcpy(data + 1, payload, size);
+
+    pthread_mutex_lock(&s_ConnectionsLock);
+
     HandleSet::const_iterator it = s_TcpConnections.begin();
     HandleSet::const_iterator end = s_TcpConnections.end();
 
-    for (; it != end; ++it) {
-        write(*it, &sender, 1);
-        write(*it, &size, 1);
-        write(*it, payload, size);
+    while (it != end) {
+        const int fd = *it++; // SendToClient may remove fd
+        IpcClientMap::const_iterator client = s_IpcClients.find(fd);
+        if (client == s_IpcClients.end()) {
+            SendToClient(fd, record, 2 + size);
+        } else {
+            SendIpcFrame(fd, RF24_IPC_DATA, client->second->SubscriptionId, data, 1 + size);
+        }
     }
+
+    pthread_mutex_unlock(&s_ConnectionsLock);
 }
 
 static
@@ -273,6 +487,26 @@ TimeSendReceiveCallback(int8_t what) {
     }
 }
 
+static
+void
+PrintPoolStats() {
+    for (const Pool* pool = Pool_First(); pool; pool = pool->Next) {
+        LOG("Pool %s: block %u bytes, %u blocks (%zu bytes), used %u, high water %u, failures %u\n",
+            pool->Name, pool->BlockSize, pool->Capacity, Pool_Footprint(pool),
+            pool->Used, pool->HighWater, pool->Failures);
+    }
+}
+
+static
+void
+PrintTcpStats() {
+    const TCP_Counters* counters = TCP_GetCounters();
+    LOG("TCP: sent %u, retransmitted %u, acknowledged %u, rtt samples %u, delivered %u, duplicates %u, acks %u\n",
+        counters->Sent, counters->Retransmitted, counters->Acknowledged,
+        counters->RttSamples, counters->Delivered, counters->Duplicates, counters->Acks);
+    LOG("Readings: duplicates dropped %u\n", s_DuplicateReadings);
+}
+
 static
 uint64_t GetTimestampInMillis() {
     uint64_t result = 0;
@@ -285,6 +519,38 @@ uint64_t GetTimestampInMillis() {
     return result;
 }
 
+// Brings protocol time up to date, returns the current timestamp
+static
+uint64_t
+AdvanceTime() {
+    const uint64_t now = GetTimestampInMillis();
+    const uint64_t millisElapsed = (now - s_LastIterationsTimestamp);
+    s_LastIterationsTimestamp = now;
+
+    if (s_Time_Enabled && millisElapsed) {
+        Time_Update(millisElapsed);
+    }
+
+    return now;
+}
+
+static
+void
+ArmTimer(uint32_t millis) {
+    itimerspec spec;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    uint64_t nanoSeconds = millis ? millis * UINT64_C(1000000) : 1;
+    spec.it_value.tv_sec = nanoSeconds / UINT64_C(1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(nanoSeconds - static_cast<uint64_t>(spec.it_value.tv_sec) * UINT64_C(1000000000));
+    if (timerfd_settime(s_TimerFd, 0, &spec, NULL) < 0) {
+        ERROR("Could not re-arm timer (%d, %s)\n", errno, strerror(errno));
+        Shutdown();
+    } else {
+        s_TimerDeadline = GetTimestampInMillis() + millis;
+    }
+}
+
 int
 main(int argc, char** argv) {
     int listenSocketFD = -1;
@@ -300,7 +566,7 @@ main(int argc, char** argv) {
     TCP_SetDataReceivedCallback(TcpDataReceived);
 
     cmdlopt_set_app_name(RF24_NETWORK_APP_NAME);
-    cmdlopt_set_app_version("1.3.1\nCopyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>");
+    cmdlopt_set_app_version("1.4.0\nCopyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>");
     cmdlopt_set_options(s_Options);
     int error = cmdlopt_parse_cmdl(argc, argv, NULL);
 
@@ -328,6 +594,9 @@ main(int argc, char** argv) {
     Network_SetAddress(s_Network_Address);
     Network_SetSendCallback(NetworkSendCallback);
     Time_SetStratum(s_Time_Stratum);
+    if (s_Time_Window_Millis) {
+        Time_SetWindow(s_Time_Window_Millis);
+    }
 
     if (!s_NetworkSocketPath || !*s_NetworkSocketPath) {
         fprintf(stderr, "Empty network UNIX socket path.\n");
@@ -384,6 +653,18 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
+    // ask for burst status frames
+    {
+        uint8_t request[sizeof(NetworkPacket)];
+        memset(request, 0, sizeof(request));
+        request[0] = RF24_PACKET_ROUTER_STATUS_MARKER;
+        if (write(s_PacketRouterSocketFD, request, sizeof(request)) != (ssize_t)sizeof(request)) {
+            ERROR("Failed to write to AF_UNIX socket %s\n", s_PacketRouterSocketPath);
+            error = errno;
+            goto Exit;
+        }
+    }
+
     s_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (s_TimerFd < 0) {
         ERROR("Failed to create timer\n");
@@ -391,7 +672,14 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
-    epollFD = epoll_loop_create();
+    s_QueryEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s_QueryEventFd < 0) {
+        ERROR("Failed to create eventfd\n");
+        error = errno;
+        goto Exit;
+    }
+
+    epollFD = epoll_loop_create_workers(s_Workers);
     if (epollFD == -1) {
         ERROR("Failed to create epoll instance\n");
         error = errno;
@@ -410,7 +698,7 @@ main(int argc, char** argv) {
 
     ev.data.fd = listenSocketFD;
     ev.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+    if (epoll_ctl(epoll_loop_get_worker_fd(s_Workers > 1 ? 1 : 0), EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
         ERROR("Failed to add socket file descriptor to epoll\n");
         error = errno;
         goto Exit;
@@ -424,6 +712,14 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
+    ev.data.fd = s_QueryEventFd;
+    ev.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+        ERROR("Failed to add eventfd to epoll\n");
+        error = errno;
+        goto Exit;
+    }
+
     error = sem_init(&s_Shutdown, 0, 0);
     if (error < 0) {
         ERROR("Failed to create sem\n");
@@ -448,7 +744,11 @@ main(int argc, char** argv) {
     ecd.callback = EPollTimerHandler;
     epoll_loop_set_callback(s_TimerFd, ecd);
 
+    ecd.callback = EPollQueryHandler;
+    epoll_loop_set_callback(s_QueryEventFd, ecd);
+
     s_LastIterationsTimestamp = GetTimestampInMillis();
+    s_TimerDeadline = s_LastIterationsTimestamp;
 
     itimerspec spec;
     spec.it_interval.tv_sec = 0;
@@ -470,6 +770,12 @@ Exit:
         safe_close_ref(&s_TimerFd);
     }
 
+    if (s_QueryEventFd >= 0) {
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(s_QueryEventFd, ecd);
+        safe_close_ref(&s_QueryEventFd);
+    }
+
     if (s_PacketRouterSocketFD >= 0) {
         memset(&ecd, 0, sizeof(ecd));
         epoll_loop_set_callback(s_PacketRouterSocketFD, ecd);
@@ -492,14 +798,23 @@ Exit:
     for (HandleSet::const_iterator it = s_Connections.begin(), end = s_Connections.end();
          it != end; ++it) {
         DEBUG("Shutdown client %d\n", *it);
+        DestroyOutputQueue(*it);
         shutdown(*it, SHUT_RDWR);
         safe_close(*it);
     }
 
+    for (IpcClientMap::const_iterator it = s_IpcClients.begin(), end = s_IpcClients.end();
+         it != end; ++it) {
+        delete it->second;
+    }
+
     if (semInitialzed) {
         sem_destroy(&s_Shutdown);
     }
 
+    PrintPoolStats();
+    PrintTcpStats();
+
     TCP_Uninit();
     Batman_Uninit();
     Time_Uninit();
@@ -537,7 +852,12 @@ EPollPacketRouterHandler(void *ctx, epoll_event *ev) {
                         break;
                     }
                 } else if (r == sizeof(packet)) {
-                    if (s_In_SendReceive_Window) {
+                    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&packet);
+                    if (bytes[0] == RF24_PACKET_ROUTER_STATUS_MARKER) {
+                        ERROR("Packet router failed to send %u of %u packets%s\n", bytes[2], bytes[1],
+                            (bytes[3] & RF24_PACKET_ROUTER_STATUS_FIFO_LOST) ? ", an unknown number more were lost" : "");
+                    } else if (s_In_SendReceive_Window) {
+                        AdvanceTime();
                         switch (packet.Type) {
                         case BATMAN_PACKET_TYPE:
                             if (s_Batman_Enabled) {
@@ -552,6 +872,11 @@ EPollPacketRouterHandler(void *ctx, epoll_event *ev) {
                         case TCP_PACKET_TYPE:
                             if (s_Tcp_Enabled) {
                                 TCP_Process(&packet);
+                                // a delayed ack may be due before the timer fires
+                                const uint32_t millis = TCP_MillisecondsTillNextUpdate();
+                                if (millis != UINT32_MAX && GetTimestampInMillis() + millis < s_TimerDeadline) {
+                                    ArmTimer(millis);
+                                }
                             }
                             break;
                         }
@@ -601,24 +926,19 @@ EPollTimerHandler(void *ctx, epoll_event *ev) {
             }
         }
 
-        const uint64_t now = GetTimestampInMillis();
-        const uint64_t millisElapsed = (now - s_LastIterationsTimestamp);
-        s_LastIterationsTimestamp = now;
+        const uint64_t now = AdvanceTime();
 
         bool arm = false;
 
         if (s_Time_Enabled) {
-            if (millisElapsed) {
-                Time_Update(millisElapsed);
-                if (s_Time_BroadcastOnTick) {
-                    const uint64_t millisElapsed = now - s_LastTimeBroadcastTimestamp;
-                    if (millisElapsed >= s_Time_Tick_Millis) {
-                        s_LastTimeBroadcastTimestamp = now;
-                        if (s_Time_PrintTti) {
-                            LOG("Tti: %u\n", Time_TimeToNextInterval());
-                        }
-                        Time_BroadcastTime();
+            if (s_Time_BroadcastOnTick) {
+                const uint64_t millisElapsed = now - s_LastTimeBroadcastTimestamp;
+                if (millisElapsed >= s_Time_Tick_Millis) {
+                    s_LastTimeBroadcastTimestamp = now;
+                    if (s_Time_PrintTti) {
+                        LOG("Tti: %u\n", Time_TimeToNextInterval());
                     }
+                    Time_BroadcastTime();
                 }
             }
 
@@ -636,25 +956,18 @@ EPollTimerHandler(void *ctx, epoll_event *ev) {
 
         if (s_Tcp_Enabled && s_In_SendReceive_Window) {
             TCP_Update();
-            if (millis > 8) {
-                millis = 8;
+            const uint32_t tcpMillis = TCP_MillisecondsTillNextUpdate();
+            if (millis > tcpMillis) {
+                millis = tcpMillis;
             }
 
             arm = true;
         }
 
         if (arm) {
-            // re-arm timer
-            itimerspec spec;
-            spec.it_interval.tv_sec = 0;
-            spec.it_interval.tv_nsec = 0;
-            uint64_t nanoSeconds = millis ? millis * UINT64_C(1000000) : 1;
-            spec.it_value.tv_sec = nanoSeconds / UINT64_C(1000000000);
-            spec.it_value.tv_nsec = static_cast<long>(nanoSeconds - static_cast<uint64_t>(spec.it_value.tv_sec) * UINT64_C(1000000000));
-            if (timerfd_settime(s_TimerFd, 0, &spec, NULL) < 0) {
-                ERROR("Could not re-arm timer (%d, %s)\n", errno, strerror(errno));
-                Shutdown();
-            }
+            ArmTimer(millis);
+        } else {
+            s_TimerDeadline = UINT64_MAX;
         }
     }
 }
@@ -677,17 +990,33 @@ EPollAcceptHandler(void *ctx, epoll_event *ev) {
         socklen_t length = sizeof(remote);
         int fd = accept4(ev->data.fd, (sockaddr*)&remote, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (fd >= 0) {
+            // keep clients off the protocol worker if there are others
+            const int workers = epoll_loop_get_worker_count();
+            int worker = PROTOCOL_WORKER;
+            if (workers > 1) {
+                worker = 1 + s_NextClientWorker++ % (workers - 1);
+            }
+
+            epoll_callback_data ecd;
+            memset(&ecd, 0, sizeof(ecd));
+            ecd.callback = EPollConnectionDataHandler;
+            epoll_loop_set_callback(fd, ecd);
+
+            pthread_mutex_lock(&s_ConnectionsLock);
+            s_Connections.insert(fd);
+            pthread_mutex_unlock(&s_ConnectionsLock);
+
             ev->data.fd = fd;
-            ev->events = EPOLLIN | EPOLLET;
-            if (epoll_ctl(epoll_loop_get_fd(), EPOLL_CTL_ADD, ev->data.fd, ev) == 0) {
-                epoll_callback_data ecd;
+            ev->events = EPOLLIN | EPOLLOUT | EPOLLET;
+            if (epoll_ctl(epoll_loop_get_worker_fd(worker), EPOLL_CTL_ADD, ev->data.fd, ev) == 0) {
+                DEBUG("Add client %d on worker %d\n", fd, worker);
+            } else {
                 memset(&ecd, 0, sizeof(ecd));
-                ecd.callback = EPollConnectionDataHandler;
                 epoll_loop_set_callback(fd, ecd);
-                s_Connections.insert(fd);
-                DEBUG("Add client %d\n", fd);
-            } else {
+                pthread_mutex_lock(&s_ConnectionsLock);
+                s_Connections.erase(fd);
                 safe_close(fd);
+                pthread_mutex_unlock(&s_ConnectionsLock);
             }
         }
     }
@@ -724,72 +1053,363 @@ GetAddress(char* input, uint8_t& address) {
 
 static
 void
-EPollConnectionDataHandler(void *ctx, epoll_event *ev) {
+RemoveConnection(int fd) {
+    pthread_mutex_lock(&s_ConnectionsLock);
+
+    s_TcpConnections.erase(fd);
+    s_Connections.erase(fd);
+    DestroyOutputQueue(fd);
+
+    IpcClientMap::iterator client = s_IpcClients.find(fd);
+    if (client != s_IpcClients.end()) {
+        delete client->second;
+        s_IpcClients.erase(client);
+    }
+
+    for (QueryQueue::iterator it = s_Queries.begin(); it != s_Queries.end(); ) {
+        if (it->Fd == fd) {
+            it = s_Queries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    safe_close(fd);
+
+    pthread_mutex_unlock(&s_ConnectionsLock);
+}
+
+static
+uint8_t
+RouteTo(uint8_t address) {
+    return s_Batman_Enabled ? Batman_Route(address) : address;
+}
+
+// Call on the protocol worker with s_ConnectionsLock held
+static
+void
+AnswerQuery(const Query& query) {
+    uint8_t reply[RF24_IPC_MAX_PAYLOAD];
+    uint16_t length = 0;
+
+    switch (query.Type) {
+    case RF24_IPC_HELLO:
+        if (query.Length && query.Payload[0] != RF24_IPC_VERSION) {
+            ERROR("Client %d speaks version %u, shutting down\n", query.Fd, query.Payload[0]);
+            SendIpcError(query.Fd, query.Id, RF24_IPC_E_PROTOCOL, query.Type);
+            shutdown(query.Fd, SHUT_RDWR);
+            return;
+        }
+
+        reply[0] = RF24_IPC_VERSION;
+        reply[1] = s_Network_Address;
+        reply[2] = (s_Batman_Enabled ? RF24_IPC_FEATURE_BATMAN : 0) |
+                   (s_Tcp_Enabled ? RF24_IPC_FEATURE_TCP : 0) |
+                   (s_Time_Enabled ? RF24_IPC_FEATURE_TIME : 0);
+        length = 3;
+        break;
+    case RF24_IPC_TIME: {
+            const uint32_t now = Time_Now();
+            if (!query.Binary) {
+                char buffer[32];
+                int chars = snprintf(buffer, sizeof(buffer), "%u", now);
+                SendToClient(query.Fd, reinterpret_cast<const uint8_t*>(buffer), chars);
+                return;
+            }
+
+            reply[0] = (uint8_t)now;
+            reply[1] = (uint8_t)(now >> 8);
+            reply[2] = (uint8_t)(now >> 16);
+            reply[3] = (uint8_t)(now >> 24);
+            length = 4;
+        } break;
+    case RF24_IPC_ROUTE:
+        if (query.Length) {
+            for (length = 0; length < query.Length; ++length) {
+                reply[length] = RouteTo(query.Payload[length]);
+            }
+        } else {
+            for (length = 0; length < 256; ++length) {
+                reply[length] = RouteTo((uint8_t)length);
+            }
+        }
+
+        if (!query.Binary) {
+            uint8_t hex[2];
+            hex[0] = "0123456789abcdef"[(reply[0] >> 4) & 15];
+            hex[1] = "0123456789abcdef"[reply[0] & 15];
+            SendToClient(query.Fd, hex, sizeof(hex));
+            return;
+        }
+        break;
+    case RF24_IPC_SUBSCRIBE:
+        if (!s_Tcp_Enabled) {
+            SendIpcError(query.Fd, query.Id, RF24_IPC_E_DISABLED, query.Type);
+            return;
+        }
+
+        s_IpcClients[query.Fd]->SubscriptionId = query.Id;
+        s_TcpConnections.insert(query.Fd);
+        break;
+    case RF24_IPC_UNSUBSCRIBE:
+        s_TcpConnections.erase(query.Fd);
+        break;
+    default:
+        SendIpcError(query.Fd, query.Id, RF24_IPC_E_UNKNOWN_TYPE, query.Type);
+        return;
+    }
+
+    SendIpcFrame(query.Fd, query.Type | RF24_IPC_REPLY, query.Id, reply, length);
+}
+
+static
+void
+PostQuery(int fd, bool binary, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length) {
+    Query query;
+    query.Fd = fd;
+    query.Binary = binary;
+    query.Type = type;
+    query.Id = id;
+    query.Length = length;
+    if (length) {
+        memcpy(query.Payload, payload, length);
+    }
+
+    pthread_mutex_lock(&s_ConnectionsLock);
+
+    if (epoll_loop_get_current_worker() == PROTOCOL_WORKER) {
+        AnswerQuery(query);
+    } else {
+        s_Queries.push_back(query);
+        if (s_Queries.size() == 1) {
+            const uint64_t one = 1;
+            write(s_QueryEventFd, &one, sizeof(one));
+        }
+    }
+
+    pthread_mutex_unlock(&s_ConnectionsLock);
+}
+
+static
+void
+EPollQueryHandler(void *ctx, epoll_event *ev) {
     assert(ev);
+
     if (ev->events & (EPOLLHUP | EPOLLERR)) {
         epoll_callback_data ecd;
         memset(&ecd, 0, sizeof(ecd));
         epoll_loop_set_callback(ev->data.fd, ecd);
-        s_TcpConnections.erase(ev->data.fd);
-        s_Connections.erase(ev->data.fd);
-        safe_close(ev->data.fd);
-        DEBUG("Remove client %d\n", ev->data.fd);
+        ERROR("Query eventfd lost!\n");
+        Shutdown();
+    } else if (ev->events & EPOLLIN) {
+        uint64_t c;
+        while (read(ev->data.fd, &c, sizeof(c)) > 0);
+
+        pthread_mutex_lock(&s_ConnectionsLock);
+
+        for (size_t i = 0; i < s_Queries.size(); ++i) {
+            AnswerQuery(s_Queries[i]);
+        }
+        s_Queries.clear();
+
+        pthread_mutex_unlock(&s_ConnectionsLock);
+    }
+}
+
+static
+IpcClient*
+AddIpcClient(int fd) {
+    IpcClient* client = NULL;
+
+    pthread_mutex_lock(&s_ConnectionsLock);
+
+    OutputQueue* queue = s_OutputQueues.count(fd) ? s_OutputQueues[fd] : CreateOutputQueue();
+    if (queue) {
+        client = new IpcClient();
+        client->SubscriptionId = 0;
+        s_OutputQueues[fd] = queue;
+        s_IpcClients[fd] = client;
     } else {
-        if (ev->events & EPOLLIN) {
-            char payload[3];
-            for (ssize_t r = 1; r; ) {
-                r = read(ev->data.fd, payload, sizeof(payload));
+        ERROR("Out of memory, can't add client %d\n", fd);
+        shutdown(fd, SHUT_RDWR);
+    }
 
-                if (r < 0) {
-                    switch (errno) {
-                    case EAGAIN:
-                    case EINTR:
-                    case EBADF:
-                        r = 0;
-                        break;
-                    default:
-                        r = 0;
-                        shutdown(ev->data.fd, SHUT_RDWR);
-                        break;
-                    }
-                } else {
-                    switch (payload[0]) {
-                    case 'T': {
-                            char buffer[32];
-                            int chars = snprintf(buffer, sizeof(buffer), "%u", Time_Now());
-                            write(ev->data.fd, buffer, chars);
-                        } break;
-                    case 'N': { // network id query
-                            if (r != 3) {
-                                shutdown(ev->data.fd, SHUT_RDWR);
-                            } else {
-                                uint8_t address = 0xff;
-                                if (r) {
-                                    if (!GetAddress(payload + 1, address)) {
-                                        address = 0xff;
-                                    }
-                                }
+    pthread_mutex_unlock(&s_ConnectionsLock);
 
-                                if (s_Batman_Enabled) {
-                                    address = Batman_Route(address);
-                                }
+    return client;
+}
+
+static
+void
+PostIpcFrame(void* ctx, const IpcHeader& header, const uint8_t* payload) {
+    PostQuery(*static_cast<int*>(ctx), true, header.Type, header.Id, payload, header.Length);
+}
 
-                                write(ev->data.fd, "0123456789abcdef" + ((address >> 4) & 15), 1);
-                                write(ev->data.fd, "0123456789abcdef" + (address & 15), 1);
+// Returns -1 if the client sent garbage and is being shut down
+static
+int
+ParseIpcFrames(int fd, IpcClient* client) {
+    // frames may span reads, keep partial ones for the next round
+    ssize_t consumed = IpcParseFrames(&client->Input[0], client->Input.size(), PostIpcFrame, &fd);
+    if (consumed < 0) {
+        ERROR("Invalid frame from client %d, shutting down\n", fd);
+        pthread_mutex_lock(&s_ConnectionsLock);
+        SendIpcError(fd, 0, RF24_IPC_E_PROTOCOL, 0);
+        pthread_mutex_unlock(&s_ConnectionsLock);
+        shutdown(fd, SHUT_RDWR);
+        client->Input.clear();
+        return -1;
+    }
+
+    client->Input.erase(client->Input.begin(), client->Input.begin() + consumed);
+
+    return 0;
+}
+
+static
+void
+ReadIpcFrames(int fd, IpcClient* client) {
+    uint8_t buffer[512];
+    for (;;) {
+        ssize_t r = read(fd, buffer, sizeof(buffer));
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            break;
+        }
+
+        if (r == 0) {
+            break;
+        }
+
+        // parse as we go, Input never holds more than a partial frame and a read
+        client->Input.insert(client->Input.end(), buffer, buffer + r);
+        if (ParseIpcFrames(fd, client) < 0) {
+            break;
+        }
+    }
+}
+
+static
+void
+ReadLegacyCommands(int fd) {
+    char payload[3];
+    for (ssize_t r = 1; r; ) {
+        r = read(fd, payload, sizeof(payload));
+
+        if (r < 0) {
+            switch (errno) {
+            case EAGAIN:
+            case EINTR:
+            case EBADF:
+                r = 0;
+                break;
+            default:
+                r = 0;
+                shutdown(fd, SHUT_RDWR);
+                break;
+            }
+        } else {
+            switch (payload[0]) {
+            case 'T':
+                PostQuery(fd, false, RF24_IPC_TIME, 0, NULL, 0);
+                break;
+            case 'N': { // network id query
+                    if (r != 3) {
+                        shutdown(fd, SHUT_RDWR);
+                    } else {
+                        uint8_t address = 0xff;
+                        if (r) {
+                            if (!GetAddress(payload + 1, address)) {
+                                address = 0xff;
                             }
-                        } break;
-                    case '+': // add TCP client
-                        if (s_Tcp_Enabled) {
-                            s_TcpConnections.insert(ev->data.fd);
                         }
-                        break;
-                    case '-': // remove TCP client
-                        if (s_Tcp_Enabled) {
-                            s_TcpConnections.erase(ev->data.fd);
+
+                        PostQuery(fd, false, RF24_IPC_ROUTE, 0, &address, 1);
+                    }
+                } break;
+            case '+': // add TCP client
+                if (s_Tcp_Enabled) {
+                    pthread_mutex_lock(&s_ConnectionsLock);
+                    OutputQueueMap::iterator it = s_OutputQueues.find(fd);
+                    if (it != s_OutputQueues.end()) {
+                        if (it->second->Release) { // still draining after '-'
+                            it->second->Release = false;
+                            s_TcpConnections.insert(fd);
                         }
-                        break;
+                    } else {
+                        OutputQueue* queue = CreateOutputQueue();
+                        if (queue) {
+                            s_OutputQueues[fd] = queue;
+                            s_TcpConnections.insert(fd);
+                        } else {
+                            ERROR("Out of memory, can't add TCP client %d\n", fd);
+                        }
+                    }
+                    pthread_mutex_unlock(&s_ConnectionsLock);
+                }
+                break;
+            case '-': // remove TCP client
+                if (s_Tcp_Enabled) {
+                    pthread_mutex_lock(&s_ConnectionsLock);
+                    s_TcpConnections.erase(fd);
+                    OutputQueueMap::iterator it = s_OutputQueues.find(fd);
+                    if (it != s_OutputQueues.end() && it->second->Offset) {
+                        // plain writes would land in the middle of the record
+                        it->second->Release = true;
+                    } else {
+                        DestroyOutputQueue(fd);
                     }
+                    pthread_mutex_unlock(&s_ConnectionsLock);
                 }
+                break;
+            }
+        }
+    }
+}
+
+static
+void
+EPollConnectionDataHandler(void *ctx, epoll_event *ev) {
+    assert(ev);
+    if (ev->events & (EPOLLHUP | EPOLLERR)) {
+        epoll_callback_data ecd;
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(ev->data.fd, ecd);
+        RemoveConnection(ev->data.fd);
+        DEBUG("Remove client %d\n", ev->data.fd);
+    } else {
+        if (ev->events & EPOLLOUT) {
+            pthread_mutex_lock(&s_ConnectionsLock);
+            OutputQueueMap::iterator it = s_OutputQueues.find(ev->data.fd);
+            if (it != s_OutputQueues.end()) {
+                FlushOutputQueue(ev->data.fd, it->second);
+            }
+            pthread_mutex_unlock(&s_ConnectionsLock);
+        }
+
+        if (ev->events & EPOLLIN) {
+            pthread_mutex_lock(&s_ConnectionsLock);
+            IpcClientMap::const_iterator it = s_IpcClients.find(ev->data.fd);
+            IpcClient* client = it == s_IpcClients.end() ? NULL : it->second;
+            pthread_mutex_unlock(&s_ConnectionsLock);
+
+            if (!client) {
+                uint8_t first;
+                if (recv(ev->data.fd, &first, 1, MSG_PEEK) == 1 && first == RF24_IPC_MAGIC) {
+                    client = AddIpcClient(ev->data.fd);
+                }
+            }
+
+            if (client) {
+                ReadIpcFrames(ev->data.fd, client);
+            } else {
+                ReadLegacyCommands(ev->data.fd);
             }
         }
     }
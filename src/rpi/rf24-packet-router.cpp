@@ -27,6 +27,8 @@
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -46,10 +48,13 @@
 #include <RF24/RF24.h>
 
 #include "Globals.h"
+#include "rf24_common.h"
 
 
 #define NUMBER_OF_READ_PIPES 6
 #define MAX_PAYLOAD_SIZE 32
+#define MAX_BATCH_FRAMES 16
+#define BURST_WRITE_ATTEMPTS 3 // per frame before it counts as failed
 
 #define STRINGIFY1(x) #x
 #define STRINGIFY(x) STRINGIFY1(x)
@@ -64,6 +69,7 @@
 
 
 static buffer* s_Connections;
+static buffer* s_StatusConnections; // clients that asked for burst status frames
 #define int_begin(buf) ((int*)buf->beg)
 #define int_end(buf) ((int*)buf->end)
 #define int_reserve(buf, count) buf_resize(buf, count*sizeof(int))
@@ -77,6 +83,12 @@ static void EPollConnectionDataHandler(void* ctx, epoll_event* ev);
 static void EPollTimerHandler(void *ctx, epoll_event *ev);
 static void EPollIrqPinHandler(void *ctx, epoll_event *ev);
 static void PollRadio();
+static void SetupFrameIov(iovec* iov, char (*frames)[MAX_PAYLOAD_SIZE], int count);
+static void TransmitFrames(int fd);
+static void BurstTransmitFrames(int fd);
+static void RemoveConnection(buffer* connections, int fd);
+
+static bool s_Transmitting;
 
 
 static sem_t s_Shutdown;
@@ -304,6 +316,14 @@ Irq_Parser(void*, char* arg) {
     return ByteParser(arg, s_IrqPin);
 }
 
+static bool s_Burst = false;
+static
+int
+Burst_Parser(void*, char* arg) {
+    s_Burst = BoolParser(arg);
+    return 0;
+}
+
 
 
 static const cmdlopt_opt s_Options[] = {
@@ -316,6 +336,7 @@ static const cmdlopt_opt s_Options[] = {
     { "rf24-power-level", "<value>", 'p', 0x106, s_Power_Level_Arg, Power_Level_Parser },
     { "rf24-crc-length", "<value>", 0, 0x107, s_Crc_Length_Arg, Crc_Length_Parser },
     { "rf24-irq", "RF24 radio interrupt pin. Defaults to 0 (not connected).", 'i', 0x108, s_Dummy_Arg, Irq_Parser },
+    { "rf24-burst", "Send queued frames back to back through the TX FIFO. Defaults to no.", 0, 0x109, s_Dummy_Arg, Burst_Parser },
     { "rf24-show", "Prints radio setup", 0, 0x110, NULL, Dump_Parser },
     { "sleep", "Microseconds to sleep between polls. Defauls to 10000.", 0, 0x111, s_Dummy_Arg, Sleep_Parser },
     { "socket-path", "Path to UNIX socket. Defaults to " RF24_PACKET_ROUTER_SOCKET_PATH, 's', 0x113, s_Dummy_Arg, SocketPath_Parser },
@@ -434,6 +455,12 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
+    s_StatusConnections = buf_alloc(64);
+    if (!s_StatusConnections) {
+        errno = ENOMEM;
+        goto Exit;
+    }
+
     mySocketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (mySocketFD == -1) {
         ERROR("Failed to create socket\n");
@@ -649,6 +676,10 @@ Exit:
         buf_free(s_Connections);
     }
 
+    if (s_StatusConnections) {
+        buf_free(s_StatusConnections);
+    }
+
     epoll_loop_destroy();
 
     if (semInitialzed) sem_destroy(&s_Shutdown);
@@ -714,51 +745,287 @@ EPollConnectionDataHandler(void *ctx, epoll_event *ev) {
 
         safe_close(ev->data.fd);
 
-        // remove fd from connection list
-        int* end = int_end(s_Connections);
-        int* it = std::find(int_begin(s_Connections), end, ev->data.fd);
-        if (it != end) {
-            --end;
-            *it = *end;
-            int_pop_back(s_Connections);
-        }
+        RemoveConnection(s_Connections, ev->data.fd);
+        RemoveConnection(s_StatusConnections, ev->data.fd);
     } else {
         if (ev->events & EPOLLIN) {
-            char payload[MAX_PAYLOAD_SIZE];
-            for (ssize_t r = 1; r; ) {
-                r = read(ev->data.fd, payload, s_PayloadSize);
+            if (s_Burst) {
+                BurstTransmitFrames(ev->data.fd);
+
+                // keep the tx fifo filled while other clients have frames queued
+                for (int* it = int_begin(s_Connections), * end = int_end(s_Connections);
+                    it != end; ++it) {
+                    if (*it != ev->data.fd) {
+                        BurstTransmitFrames(*it);
+                    }
+                }
+
+                if (s_Transmitting) {
+                    s_Transmitting = false;
+                    s_Radio.startListening();
+                }
+            } else {
+                TransmitFrames(ev->data.fd);
+            }
+        }
+    }
+}
+
+static
+void
+RemoveConnection(buffer* connections, int fd) {
+    int* end = int_end(connections);
+    int* it = std::find(int_begin(connections), end, fd);
+    if (it != end) {
+        --end;
+        *it = *end;
+        int_pop_back(connections);
+    }
+}
+
+// Subscribes fd to burst status frames for each status request among
+// the frames read and drops the requests. Returns the frames left.
+static
+int
+TakeStatusRequests(int fd, char (*frames)[MAX_PAYLOAD_SIZE], int count) {
+    int kept = 0;
+    for (int i = 0; i < count; ++i) {
+        if (static_cast<uint8_t>(frames[i][0]) != RF24_PACKET_ROUTER_STATUS_MARKER) {
+            if (kept != i) {
+                memcpy(frames[kept], frames[i], s_PayloadSize);
+            }
+            ++kept;
+        } else if (std::find(int_begin(s_StatusConnections), int_end(s_StatusConnections), fd) == int_end(s_StatusConnections)) {
+            if (!int_reserve(s_StatusConnections, 1)) {
+                ERROR("Out of memory!\n");
+            } else {
+                *int_end(s_StatusConnections) = fd;
+                s_StatusConnections->end += sizeof(fd);
+            }
+        }
+    }
+
+    return kept;
+}
+
+static
+int
+ReadFrames(int fd, iovec* iov) {
+    for (;;) {
+        ssize_t r = readv(fd, iov, MAX_BATCH_FRAMES);
+        if (r < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+            case EBADF:
+                return 0;
+            default:
+                shutdown(fd, SHUT_RDWR);
+                return 0;
+            }
+        }
+
+        if (r % s_PayloadSize) {
+            // all clients must write payload size chunks
+            ERROR("Read %d bytes which is not a multiple of %d, shutting down %d\n", (int)r, (int)s_PayloadSize, fd);
+            shutdown(fd, SHUT_RDWR);
+            return 0;
+        }
+
+        return r / s_PayloadSize;
+    }
+}
+
+// Returns true if the radio was set up again, which empties the tx fifo.
+static
+bool
+ResetRadioOnFailure() {
+    if (s_Radio.failureDetected) {
+        s_Radio.failureDetected = 0;
+        SetupRadio();
+        s_Radio.stopListening();
+        return true;
+    }
+
+    return false;
+}
+
+static
+void
+TransmitFrames(int fd) {
+    static char s_TxFrames[MAX_BATCH_FRAMES][MAX_PAYLOAD_SIZE];
+    iovec iov[MAX_BATCH_FRAMES];
+    SetupFrameIov(iov, s_TxFrames, MAX_BATCH_FRAMES);
+
+    for (int count; (count = ReadFrames(fd, iov)) > 0; ) {
+        count = TakeStatusRequests(fd, s_TxFrames, count);
+        if (!count) {
+            continue;
+        }
+
+        // send everything queued in one radio session
+//        DEBUG("Radio send %d frames\n", count);
+        s_Radio.stopListening();
+        for (int i = 0; i < count; ++i) {
+            if (!s_Radio.write(s_TxFrames[i], s_PayloadSize)) {
+                ERROR("Failed to send telegram\n");
+                ResetRadioOnFailure();
+            }
+        }
+        s_Radio.startListening();
+    }
+}
+
+static
+void
+ReportBurstStatus(int fd, unsigned frames, unsigned failed, bool fifoLost) {
+    if (std::find(int_begin(s_StatusConnections), int_end(s_StatusConnections), fd) == int_end(s_StatusConnections)) {
+        return;
+    }
+
+    char status[MAX_PAYLOAD_SIZE];
+    memset(status, 0, sizeof(status));
+    status[0] = RF24_PACKET_ROUTER_STATUS_MARKER;
+    status[1] = static_cast<char>(std::min(frames, 255u));
+    status[2] = static_cast<char>(std::min(failed, 255u));
+    status[3] = fifoLost ? RF24_PACKET_ROUTER_STATUS_FIFO_LOST : 0;
+
+    ssize_t w;
+    while ((w = write(fd, status, s_PayloadSize)) == -1 && errno == EINTR);
+}
+
+static
+void
+BurstTransmitFrames(int fd) {
+    static char s_TxFrames[MAX_BATCH_FRAMES][MAX_PAYLOAD_SIZE];
+    iovec iov[MAX_BATCH_FRAMES];
+    SetupFrameIov(iov, s_TxFrames, MAX_BATCH_FRAMES);
+    unsigned frames = 0, failed = 0, queued = 0;
+    bool fifoLost = false;
+
+    for (int count; (count = ReadFrames(fd, iov)) > 0; ) {
+        count = TakeStatusRequests(fd, s_TxFrames, count);
+        if (!count) {
+            continue;
+        }
+
+        if (!s_Transmitting) {
+            s_Transmitting = true;
+            s_Radio.stopListening();
+        }
+
+        frames += count;
+        for (int i = 0; i < count; ++i) {
+            // writeFast only fails before loading the frame, so try it again
+            bool loaded = false;
+            for (int attempt = 0; attempt < BURST_WRITE_ATTEMPTS && !loaded; ++attempt) {
+                loaded = s_Radio.writeFast(s_TxFrames[i], s_PayloadSize);
+                if (!loaded && ResetRadioOnFailure() && queued) {
+                    fifoLost = true;
+                }
+            }
+
+            if (loaded) {
+                ++queued;
+            } else {
+                ++failed;
+            }
+        }
+    }
+
+    if (queued && !s_Radio.txStandBy()) {
+        // the fifo was flushed, how many frames were still in it is unknown
+        fifoLost = true;
+        ResetRadioOnFailure();
+    }
+
+    if (failed || fifoLost) {
+        ERROR("Failed to send %u of %u telegrams for %d%s\n", failed, frames, fd, fifoLost ? ", tx fifo lost" : "");
+        ReportBurstStatus(fd, frames, failed, fifoLost);
+    }
+}
+
+static
+void
+SetupFrameIov(iovec* iov, char (*frames)[MAX_PAYLOAD_SIZE], int count) {
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = frames[i];
+        iov[i].iov_len = s_PayloadSize;
+    }
+}
+
+// How long to wait for a stalled client to take the rest of a frame
+#define FRAME_WRITE_TIMEOUT 1000 // ms
 
-                if (r < 0) {
+static
+int
+WaitWritable(int fd) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    int ready;
+    while ((ready = poll(&pfd, 1, FRAME_WRITE_TIMEOUT)) < 0 && errno == EINTR);
+    return ready == 1 && (pfd.revents & POLLOUT) ? 0 : -1;
+}
+
+static
+void
+WriteFrames(int fd, iovec* iov, int count) {
+    while (count) {
+        ssize_t w = writev(fd, iov, count);
+        if (w < 0) {
+            switch (errno) {
+            case EINTR:
+                continue; // re-try connection
+            default:
+                // ignore all other errors, will get HUP
+                // in case connection is gone
+                return;
+            }
+        }
+
+        // skip what was written
+        while (count && static_cast<size_t>(w) >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (w) {
+            // Partial frame, the remainder must go out or the
+            // client loses framing.
+            const char* ptr = static_cast<const char*>(iov->iov_base) + w;
+            size_t left = iov->iov_len - w;
+            while (left) {
+                w = write(fd, ptr, left);
+                if (w < 0) {
                     switch (errno) {
-                    case EAGAIN:
                     case EINTR:
-                    case EBADF:
-                        r = 0;
                         break;
-                    default:
-                        r = 0;
-                        shutdown(ev->data.fd, SHUT_RDWR);
-                        break;
-                    }
-                } else if (r == s_PayloadSize) {
-//                    static int s_Count;
-//                    DEBUG("Radio send %d\n", s_Count++);
-                    s_Radio.stopListening();
-                    if (!s_Radio.write(payload, s_PayloadSize)) {
-                        ERROR("Failed to send telegram\n");
-                        if (s_Radio.failureDetected) {
-                            s_Radio.failureDetected = 0;
-                            SetupRadio();
+                    case EAGAIN:
+                        if (WaitWritable(fd) < 0) {
+                            // framing is lost, have the client go away
+                            ERROR("Client %d stalled mid frame, disconnecting\n", fd);
+                            shutdown(fd, SHUT_RDWR);
+                            return;
                         }
+                        break;
+                    default:
+                        return;
                     }
-                    s_Radio.startListening();
                 } else {
-                    // all clients must write payload size chunks
-                    ERROR("Read %d instead of %d bytes, shutting down %d\n", (int)r, (int)s_PayloadSize, ev->data.fd);
-                    r = 0;
-                    shutdown(ev->data.fd, SHUT_RDWR);
+                    ptr += w;
+                    left -= w;
                 }
             }
+            ++iov;
+            --count;
+        } else if (count) {
+            // socket full, drop frames as the radio would
+            return;
         }
     }
 }
@@ -766,32 +1033,25 @@ EPollConnectionDataHandler(void *ctx, epoll_event *ev) {
 static
 void
 PollRadio() {
-    char buffer[MAX_PAYLOAD_SIZE];
+    static char s_RxFrames[MAX_BATCH_FRAMES][MAX_PAYLOAD_SIZE];
+    iovec iov[MAX_BATCH_FRAMES];
+
     while (s_Radio.available()) {
-//        DEBUG("Radio available\n");
-//        DEBUG("%u connections\n", (unsigned)(int_used(s_Connections)));
-        s_Radio.read(buffer, s_PayloadSize);
+        // drain the rx fifo, then fan out with one call per connection
+        int count = 0;
+        do {
+            s_Radio.read(s_RxFrames[count++], s_PayloadSize);
+        } while (count < MAX_BATCH_FRAMES && s_Radio.available());
+
+//        DEBUG("Radio read %d frames for %u connections\n", count, (unsigned)(int_used(s_Connections)));
         for (int* it = int_begin(s_Connections), * end = int_end(s_Connections);
             it != end; ++it) {
-            ssize_t w = write(*it, buffer, s_PayloadSize);
-            if (w < 0) {
-                switch (errno) {
-                case EINTR:
-                    --it; // re-try connection
-                    break;
-                default:
-                    // ignore all other errors, will get HUP
-                    // in case connection is gone
-                    break;
-                }
-            } else {
-//                DEBUG("Forward to %d\n", *it);
-            }
+            SetupFrameIov(iov, s_RxFrames, count);
+            WriteFrames(*it, iov, count);
         }
     }
 }
 
-
 static
 void
 EPollTimerHandler(void *ctx, epoll_event *ev) {
@@ -0,0 +1,344 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <toe/cmdlopt.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+#include "Globals.h"
+#include "rf24_store.h"
+
+
+#define ERROR(...) fprintf(stderr, "ERROR: " __VA_ARGS__)
+
+
+static const cmdlopt_arg s_Dummy_Arg[] = {
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+
+static const cmdlopt_arg s_Time_Arg[] = {
+    { "YYYY-MM-DD[ HH:MM[:SS]]", "local time", "2017-01-31 18:00" },
+    { "@<seconds>", "seconds since the epoch", "@1485882000" },
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+
+static
+int
+TimeParser(const char* arg, uint32_t& value) {
+    if (*arg == '@') {
+        char* end = NULL;
+        value = (uint32_t)strtoul(arg + 1, &end, 10);
+        if (end && end != arg + 1 && !*end) {
+            return 0;
+        }
+    } else {
+        static const char* const s_Formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+        for (size_t i = 0; i < sizeof(s_Formats)/sizeof(s_Formats[0]); ++i) {
+            struct tm brokenDown;
+            memset(&brokenDown, 0, sizeof(brokenDown));
+            const char* end = strptime(arg, s_Formats[i], &brokenDown);
+            if (end && !*end) {
+                brokenDown.tm_isdst = -1;
+                value = (uint32_t)mktime(&brokenDown);
+                return 0;
+            }
+        }
+    }
+
+    ERROR("Argument '%s' could not be converted to a time\n", arg);
+    return -1;
+}
+
+static const char* s_StorePath = RF24_STORE_PATH;
+static
+int
+StorePath_Parser(void*, char* arg) {
+    s_StorePath = arg;
+    return 0;
+}
+
+static const char* s_Sensor = NULL;
+static
+int
+Sensor_Parser(void*, char* arg) {
+    s_Sensor = arg;
+    return 0;
+}
+
+static uint32_t s_From = 0;
+static
+int
+From_Parser(void*, char* arg) {
+    return TimeParser(arg, s_From);
+}
+
+static uint32_t s_To = UINT32_MAX;
+static
+int
+To_Parser(void*, char* arg) {
+    return TimeParser(arg, s_To);
+}
+
+static bool s_Aggregate = false;
+static
+int
+Aggregate_Parser(void*, char*) {
+    s_Aggregate = true;
+    return 0;
+}
+
+static const cmdlopt_arg s_Rollup_Arg[] = {
+    { "hour", "hourly rows", NULL },
+    { "day", "daily rows", NULL },
+    { "month", "monthly rows", NULL },
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+
+static int s_Rollup = -1;
+static
+int
+Rollup_Parser(void*, char* arg) {
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        if (!strcmp(arg, Store_RollupLevelName(i))) {
+            s_Rollup = i;
+            return 0;
+        }
+    }
+
+    ERROR("Unknown rollup '%s'\n", arg);
+    return -1;
+}
+
+static const cmdlopt_opt s_Options[] = {
+    { "store", "Directory of the store. Defaults to " RF24_STORE_PATH, 0, 0x100, s_Dummy_Arg, StorePath_Parser },
+    { "sensor", "Name of the sensor to query. Defaults to all.", 's', 0x101, s_Dummy_Arg, Sensor_Parser },
+    { "from", "Start of the time range (inclusive). Defaults to the first reading.", 'f', 0x102, s_Time_Arg, From_Parser },
+    { "to", "End of the time range (exclusive). Defaults to the last reading.", 't', 0x103, s_Time_Arg, To_Parser },
+    { "aggregate", "Print count, min, mean and max per sensor instead of readings.", 'a', 0x104, NULL, Aggregate_Parser },
+    { "rollup", "Print rows of hourly, daily or monthly count, min, mean and max per sensor instead of readings.", 'r', 0x105, s_Rollup_Arg, Rollup_Parser },
+    CMDLOPT_COMMON_OPTIONS,
+    CMDLOPT_OPTION_TERMINATOR
+};
+
+
+static
+void
+FormatTime(char* buffer, size_t size, uint32_t seconds) {
+    time_t t = (time_t)seconds;
+    struct tm brokenDown;
+    localtime_r(&t, &brokenDown);
+    strftime(buffer, size, "%F %T", &brokenDown);
+}
+
+static
+void
+PrintReading(void* ctx, const StoreReading& reading) {
+    const StoreSeries* series = (const StoreSeries*)ctx;
+    char timestring[32];
+    FormatTime(timestring, sizeof(timestring), reading.Time);
+    fprintf(stdout, "%s WB%s;%d;%d;%u;%u;%02x\n",
+            timestring, series->Name, reading.Temperature, reading.Humidity,
+            reading.MilliVolts, reading.RawHumidity, reading.Via);
+}
+
+static
+void
+PrintAggregate(const StoreSeries& series, const StoreAggregate& aggregate) {
+    static const char* const s_Columns[STORE_STAT_COLUMNS] = { "temperature", "humidity", "mV" };
+
+    if (!aggregate.Count) {
+        fprintf(stdout, "%s: no readings\n", series.Name);
+        return;
+    }
+
+    char first[32], last[32];
+    FormatTime(first, sizeof(first), aggregate.FirstTime);
+    FormatTime(last, sizeof(last), aggregate.LastTime);
+    fprintf(stdout, "%s: %" PRIu32 " readings from %s to %s\n", series.Name, aggregate.Count, first, last);
+    for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+        fprintf(stdout, "  %-12s min %6" PRId32 " mean %8.1f max %6" PRId32 "\n",
+                s_Columns[i], aggregate.Min[i], (double)aggregate.Sum[i] / aggregate.Count, aggregate.Max[i]);
+    }
+    fprintf(stdout, "  blocks: %" PRIu32 " from index, %" PRIu32 " decoded\n", aggregate.BlocksSkipped, aggregate.BlocksDecoded);
+}
+
+struct RollupContext {
+    const char* Name;
+    // least squares fit of mean mV over time, in days relative to the first row
+    uint32_t Rows;
+    uint32_t Origin;
+    double SumX, SumY, SumXX, SumXY;
+};
+
+static
+void
+PrintRollupRow(void* ctx, const StoreRollupRow& row) {
+    RollupContext* rollup = (RollupContext*)ctx;
+    char start[32];
+    FormatTime(start, sizeof(start), row.Start);
+    fprintf(stdout, "%s %s %5" PRIu32, start, rollup->Name, row.Count);
+    for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+        fprintf(stdout, " %6" PRId32 " %8.1f %6" PRId32,
+                row.Min[i], (double)row.Sum[i] / row.Count, row.Max[i]);
+    }
+    fprintf(stdout, " %+5d\n", row.LastMilliVolts - row.FirstMilliVolts);
+
+    if (!rollup->Rows) {
+        rollup->Origin = row.Start;
+    }
+    const double x = (row.Start - rollup->Origin) / 86400.0;
+    const double y = (double)row.Sum[STORE_MILLIVOLTS] / row.Count;
+    rollup->SumX += x;
+    rollup->SumY += y;
+    rollup->SumXX += x * x;
+    rollup->SumXY += x * y;
+    ++rollup->Rows;
+}
+
+static
+void
+PrintRollup(const StoreSeries& series, const StoreRollup& rollup) {
+    RollupContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.Name = series.Name;
+    StoreRollup_Scan(rollup, s_From, s_To, PrintRollupRow, &ctx);
+
+    const double denominator = ctx.Rows * ctx.SumXX - ctx.SumX * ctx.SumX;
+    if (ctx.Rows > 1 && denominator > 0) {
+        fprintf(stdout, "%s: battery trend %+.2f mV/day over %" PRIu32 " rows\n",
+                series.Name, (ctx.Rows * ctx.SumXY - ctx.SumX * ctx.SumY) / denominator, ctx.Rows);
+    }
+}
+
+static
+int
+ListSeries(std::vector<std::string>& paths) {
+    DIR* dir = opendir(s_StorePath);
+    if (!dir) {
+        return -1;
+    }
+
+    const size_t extension = strlen(STORE_FILE_EXTENSION);
+    for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+        const size_t length = strlen(entry->d_name);
+        if (length > extension && !strcmp(entry->d_name + length - extension, STORE_FILE_EXTENSION)) {
+            paths.push_back(std::string(s_StorePath) + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(paths.begin(), paths.end());
+    return 0;
+}
+
+int
+main(int argc, char** argv) {
+    std::vector<std::string> paths;
+
+    cmdlopt_set_app_name(RF24_QUERY_APP_NAME);
+    cmdlopt_set_app_version("1.1.0\nCopyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>");
+    cmdlopt_set_options(s_Options);
+    int error = cmdlopt_parse_cmdl(argc, argv, NULL);
+
+    switch (error) {
+    case CMDLOPT_E_NONE:
+        break;
+    case CMDLOPT_E_HELP_REQUESTED:
+    case CMDLOPT_E_VERSION_REQUESTED:
+        error = 0;
+        goto Exit;
+    case CMDLOPT_E_UNKNOWN_OPTION:
+        cmdlopt_fprint_help(stderr);
+        goto Exit;
+    case CMDLOPT_E_ERRNO:
+        error = errno;
+        goto Exit;
+    case CMDLOPT_E_INVALID_PARAM:
+        fprintf(stderr, "Internal program error %d\n", error);
+        goto Exit;
+    default:
+        goto Exit;
+    }
+
+    if (s_Sensor) {
+        char path[256];
+        if (Store_SeriesPath(path, sizeof(path), s_StorePath, s_Sensor) < 0) {
+            ERROR("Store path too long\n");
+            error = -1;
+            goto Exit;
+        }
+        paths.push_back(path);
+    } else if (ListSeries(paths) < 0) {
+        ERROR("Failed to list store %s\n", s_StorePath);
+        error = errno;
+        goto Exit;
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        StoreSeries series;
+        if (StoreSeries_Open(series, paths[i].c_str(), NULL, false) < 0) {
+            ERROR("Failed to open %s: %s\n", paths[i].c_str(), strerror(errno));
+            error = errno;
+            continue;
+        }
+
+        if (s_Rollup >= 0) {
+            char path[256];
+            StoreRollup rollup;
+            if (Store_RollupPath(path, sizeof(path), s_StorePath, series.Name, (uint8_t)s_Rollup) < 0 ||
+                StoreRollup_Open(rollup, path, (uint8_t)s_Rollup, false) < 0) {
+                ERROR("Failed to open %s rollup of %s: %s\n", Store_RollupLevelName((uint8_t)s_Rollup), series.Name, strerror(errno));
+                error = errno;
+            } else {
+                PrintRollup(series, rollup);
+                StoreRollup_Close(rollup);
+            }
+        } else if (s_Aggregate) {
+            StoreAggregate aggregate;
+            StoreAggregate_Init(aggregate);
+            StoreSeries_Aggregate(series, s_From, s_To, aggregate);
+            PrintAggregate(series, aggregate);
+        } else {
+            StoreSeries_Scan(series, s_From, s_To, PrintReading, &series);
+        }
+
+        StoreSeries_Close(series);
+    }
+
+Exit:
+    if (error > 0) {
+        fprintf(stderr, "%s (%d)\n", strerror(error), error);
+    }
+    return error;
+}
@@ -0,0 +1,745 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Simulated radio medium
+ *
+ * Stands in for rf24-packet-router. Each simulated node gets its own UNIX
+ * socket which speaks the packet router protocol (payload size frames in
+ * both directions), so rf24-network and the other clients run unchanged.
+ *
+ * Node 0 listens on the socket path itself, node i on <path>.<i>. A frame
+ * written by a client of node i is put on air and delivered to the clients
+ * of every node linked to i, subject to loss and latency.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <toe/cmdlopt.h>
+#include <linuxapi/linuxapi.h>
+
+#include "Globals.h"
+
+
+#define MAX_PAYLOAD_SIZE 32
+#define MAX_BATCH_FRAMES 16
+#define NO_LINK 0xff
+
+#define STRINGIFY1(x) #x
+#define STRINGIFY(x) STRINGIFY1(x)
+#define ERROR(...) fprintf(stderr, "ERROR: " __VA_ARGS__)
+#define LOG(...) fprintf(stdout, __VA_ARGS__)
+
+#if 0
+#   define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#   define DEBUG(...)
+#endif
+
+#ifndef UINT64_C
+#   define UINT64_C(x) static_cast<uint64_t>(x)
+#endif
+
+
+struct Node {
+    std::string SocketPath;
+    std::vector<int> Clients;
+    int ListenFd;
+    uint64_t Sent;
+    uint64_t Received;
+    uint64_t Lost;
+};
+
+struct Frame {
+    size_t To;
+    char Data[MAX_PAYLOAD_SIZE];
+};
+
+typedef std::multimap<uint64_t, Frame> FrameQueue;
+
+static std::vector<Node> s_Nodes;
+static std::vector<uint8_t> s_Links; // loss percentage from * count + to, NO_LINK if out of range
+static FrameQueue s_InFlight;
+static int s_TimerFd = -1;
+static unsigned s_Seed;
+
+
+static void EPollAcceptHandler(void* ctx, epoll_event* ev);
+static void EPollConnectionDataHandler(void* ctx, epoll_event* ev);
+static void EPollTimerHandler(void *ctx, epoll_event *ev);
+
+
+static sem_t s_Shutdown;
+
+static
+void
+Shutdown() {
+    sem_post(&s_Shutdown);
+}
+
+static
+void
+SignalHandler(int) {
+    Shutdown();
+}
+
+
+template<typename T>
+static
+int
+UnsignedParser(const char* arg, T& value) {
+    char* end = NULL;
+    value = (T)strtoul(arg, &end, 10);
+    if (!end || end == arg) {
+        ERROR("Argument '%s' could not be converted to unsigned int\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const cmdlopt_arg s_Dummy_Arg[] = {
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+
+static unsigned s_NodeCount = 2;
+static
+int
+Nodes_Parser(void*, char* arg) {
+    int error = UnsignedParser(arg, s_NodeCount);
+    if (!error && (s_NodeCount < 1 || s_NodeCount > 1024)) {
+        ERROR("Invalid number of nodes %u\n", s_NodeCount);
+        error = -1;
+    }
+    return error;
+}
+
+static uint8_t s_Loss = 0;
+static
+int
+Loss_Parser(void*, char* arg) {
+    uint32_t loss;
+    int error = UnsignedParser(arg, loss);
+    if (!error) {
+        if (loss > 100) {
+            ERROR("Invalid loss %u%%\n", loss);
+            error = -1;
+        } else {
+            s_Loss = static_cast<uint8_t>(loss);
+        }
+    }
+    return error;
+}
+
+static uint32_t s_Latency = 1;
+static
+int
+Latency_Parser(void*, char* arg) {
+    return UnsignedParser(arg, s_Latency);
+}
+
+static uint32_t s_Jitter = 0;
+static
+int
+Jitter_Parser(void*, char* arg) {
+    return UnsignedParser(arg, s_Jitter);
+}
+
+static const cmdlopt_arg s_Topology_Arg[] = {
+    { "full", "every node hears every other node (default)", NULL },
+    { "chain", "node i hears nodes i-1 and i+1", NULL },
+    { "<file>", "one link per line: <node> <node> [loss %]", "0 1 10" },
+    CMDLOPT_ARGUMENT_TERMINATOR
+};
+static const char* s_Topology = "full";
+static
+int
+Topology_Parser(void*, char* arg) {
+    s_Topology = arg;
+    return 0;
+}
+
+static uint8_t s_PayloadSize = MAX_PAYLOAD_SIZE;
+static
+int
+Payload_Parser(void*, char* arg) {
+    int error = UnsignedParser(arg, s_PayloadSize);
+    if (!error) {
+        if (!s_PayloadSize || s_PayloadSize > MAX_PAYLOAD_SIZE) {
+            ERROR("Invalid payload size %d. Max payload is " STRINGIFY(MAX_PAYLOAD_SIZE) " bytes.\n", s_PayloadSize);
+            error = -1;
+        }
+    }
+    return error;
+}
+
+static
+int
+Seed_Parser(void*, char* arg) {
+    return UnsignedParser(arg, s_Seed);
+}
+
+static const char* s_SocketPath = RF24_PACKET_ROUTER_SOCKET_PATH;
+static
+int
+SocketPath_Parser(void*, char* arg) {
+    s_SocketPath = arg;
+    return 0;
+}
+
+static const cmdlopt_opt s_Options[] = {
+    { "nodes", "Number of simulated nodes. Defaults to 2.", 'n', 0x100, s_Dummy_Arg, Nodes_Parser },
+    { "loss", "Percentage of frames lost per link. Defaults to 0.", 'l', 0x101, s_Dummy_Arg, Loss_Parser },
+    { "latency", "Air time per frame. Defaults to 1 [ms].", 0, 0x102, s_Dummy_Arg, Latency_Parser },
+    { "jitter", "Random delay added to the latency. Defaults to 0 [ms].", 0, 0x103, s_Dummy_Arg, Jitter_Parser },
+    { "topology", "<value>", 't', 0x104, s_Topology_Arg, Topology_Parser },
+    { "payload-size", "Size of payload. Defaults to " STRINGIFY(MAX_PAYLOAD_SIZE) ".", 0, 0x105, s_Dummy_Arg, Payload_Parser },
+    { "seed", "Seed for loss and jitter. Defaults to the time of day.", 0, 0x106, s_Dummy_Arg, Seed_Parser },
+    { "socket-path", "Path to UNIX socket of node 0. Node i listens on <path>.<i>. Defaults to " RF24_PACKET_ROUTER_SOCKET_PATH, 's', 0x107, s_Dummy_Arg, SocketPath_Parser },
+    CMDLOPT_COMMON_OPTIONS,
+    CMDLOPT_OPTION_TERMINATOR
+};
+
+static
+uint64_t GetTimestampInMillis() {
+    uint64_t result = 0;
+    timespec ts;
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        result = ts.tv_sec * UINT64_C(1000);
+        result += ts.tv_nsec / 1000000;
+    }
+
+    return result;
+}
+
+static
+inline
+uint8_t&
+Link(size_t from, size_t to) {
+    return s_Links[from * s_Nodes.size() + to];
+}
+
+static
+void
+AddLink(size_t a, size_t b, uint8_t loss) {
+    Link(a, b) = loss;
+    Link(b, a) = loss;
+}
+
+static
+int
+SetupTopology() {
+    const size_t count = s_Nodes.size();
+    s_Links.assign(count * count, NO_LINK);
+
+    if (strcmp(s_Topology, "full") == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t j = i + 1; j < count; ++j) {
+                AddLink(i, j, s_Loss);
+            }
+        }
+    } else if (strcmp(s_Topology, "chain") == 0) {
+        for (size_t i = 1; i < count; ++i) {
+            AddLink(i - 1, i, s_Loss);
+        }
+    } else {
+        FILE* f = fopen(s_Topology, "r");
+        if (!f) {
+            ERROR("Failed to open topology file %s\n", s_Topology);
+            return errno;
+        }
+
+        char line[128];
+        for (int lineNumber = 1; fgets(line, sizeof(line), f); ++lineNumber) {
+            unsigned a, b, loss = s_Loss;
+            char* comment = strchr(line, '#');
+            if (comment) {
+                *comment = 0;
+            }
+
+            int fields = sscanf(line, "%u %u %u", &a, &b, &loss);
+            if (fields <= 0) {
+                continue;
+            }
+
+            if (fields < 2 || a >= count || b >= count || a == b || loss > 100) {
+                ERROR("%s(%d): invalid link\n", s_Topology, lineNumber);
+                fclose(f);
+                return -1;
+            }
+
+            AddLink(a, b, static_cast<uint8_t>(loss));
+        }
+
+        fclose(f);
+    }
+
+    return 0;
+}
+
+static
+void
+ArmTimer() {
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!s_InFlight.empty()) {
+        // absolute, clock is CLOCK_MONOTONIC
+        const uint64_t deadline = s_InFlight.begin()->first;
+        spec.it_value.tv_sec = deadline / UINT64_C(1000);
+        spec.it_value.tv_nsec = static_cast<long>((deadline % UINT64_C(1000)) * UINT64_C(1000000));
+        if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+
+    if (timerfd_settime(s_TimerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        ERROR("Could not arm timer (%d, %s)\n", errno, strerror(errno));
+        Shutdown();
+    }
+}
+
+static
+void
+Deliver(size_t to, const char* data) {
+    Node& node = s_Nodes[to];
+    ++node.Received;
+
+    for (size_t i = 0; i < node.Clients.size(); ++i) {
+        ssize_t w;
+        while ((w = write(node.Clients[i], data, s_PayloadSize)) == -1 && errno == EINTR);
+        // ignore all other errors, will get HUP
+        // in case connection is gone
+    }
+}
+
+static
+void
+Transmit(size_t from, const char* data) {
+    const size_t count = s_Nodes.size();
+    const uint64_t now = GetTimestampInMillis();
+    const bool wasEmpty = s_InFlight.empty();
+    const uint64_t earliest = wasEmpty ? 0 : s_InFlight.begin()->first;
+
+    ++s_Nodes[from].Sent;
+
+    for (size_t to = 0; to < count; ++to) {
+        const uint8_t loss = Link(from, to);
+        if (loss == NO_LINK) {
+            continue;
+        }
+
+        if (loss && static_cast<uint8_t>(rand_r(&s_Seed) % 100) < loss) {
+            ++s_Nodes[to].Lost;
+            continue;
+        }
+
+        uint64_t delay = s_Latency;
+        if (s_Jitter) {
+            delay += rand_r(&s_Seed) % (s_Jitter + 1);
+        }
+
+        if (delay) {
+            Frame frame;
+            frame.To = to;
+            memcpy(frame.Data, data, s_PayloadSize);
+            s_InFlight.insert(FrameQueue::value_type(now + delay, frame));
+        } else {
+            Deliver(to, data);
+        }
+    }
+
+    if (!s_InFlight.empty() &&
+        (wasEmpty || s_InFlight.begin()->first < earliest)) {
+        ArmTimer();
+    }
+}
+
+static
+void
+PrintStatistics() {
+    uint64_t sent = 0, received = 0, lost = 0;
+    LOG("%6s %12s %12s %12s %8s\n", "node", "sent", "received", "lost", "clients");
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        const Node& node = s_Nodes[i];
+        LOG("%6u %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %8u\n", (unsigned)i, node.Sent, node.Received, node.Lost, (unsigned)node.Clients.size());
+        sent += node.Sent;
+        received += node.Received;
+        lost += node.Lost;
+    }
+    LOG("%6s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", "total", sent, received, lost);
+}
+
+int
+main(int argc, char** argv) {
+    int epollFD = -1;
+    epoll_callback_data ecd;
+    epoll_event ev;
+    bool semInitialzed = false;
+
+    s_Seed = static_cast<unsigned>(time(NULL));
+
+    cmdlopt_set_app_name(RF24_SIM_APP_NAME);
+    cmdlopt_set_app_version("1.0.0\nCopyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>");
+    cmdlopt_set_options(s_Options);
+    int error = cmdlopt_parse_cmdl(argc, argv, NULL);
+
+    switch (error) {
+    case CMDLOPT_E_NONE:
+        break;
+    case CMDLOPT_E_HELP_REQUESTED:
+    case CMDLOPT_E_VERSION_REQUESTED:
+        error = 0;
+        goto Exit;
+    case CMDLOPT_E_UNKNOWN_OPTION:
+        cmdlopt_fprint_help(stderr);
+        goto Exit;
+    case CMDLOPT_E_ERRNO:
+        error = errno;
+        goto Exit;
+    case CMDLOPT_E_INVALID_PARAM:
+        fprintf(stderr, "Internal program error %d\n", error);
+        goto Exit;
+    default:
+        goto Exit;
+    }
+
+    if (!s_SocketPath || !*s_SocketPath) {
+        fprintf(stderr, "Empty UNIX socket path.\n");
+        error = -1;
+        goto Exit;
+    }
+
+    s_Nodes.resize(s_NodeCount);
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        Node& node = s_Nodes[i];
+        node.ListenFd = -1;
+        node.Sent = 0;
+        node.Received = 0;
+        node.Lost = 0;
+        node.SocketPath = s_SocketPath;
+        if (i) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), ".%u", (unsigned)i);
+            node.SocketPath += suffix;
+        }
+    }
+
+    error = SetupTopology();
+    if (error) {
+        goto Exit;
+    }
+
+    epollFD = epoll_loop_create();
+    if (epollFD == -1) {
+        ERROR("Failed to create epoll instance\n");
+        error = errno;
+        goto Exit;
+    }
+
+    s_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s_TimerFd < 0) {
+        ERROR("Failed to create timer\n");
+        error = errno;
+        goto Exit;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s_TimerFd;
+    ev.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+        ERROR("Failed to add timer to epoll\n");
+        error = errno;
+        goto Exit;
+    }
+
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        Node& node = s_Nodes[i];
+        sockaddr_un sa;
+
+        node.ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (node.ListenFd == -1) {
+            ERROR("Failed to create socket\n");
+            error = errno;
+            goto Exit;
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, node.SocketPath.c_str(), sizeof(sa.sun_path) - 1);
+        unlink(node.SocketPath.c_str()); // in case it exists
+        if (bind(node.ListenFd, (sockaddr*)&sa, sizeof(sa)) < 0) {
+            ERROR("Failed to bind AF_UNIX socket %s\n", node.SocketPath.c_str());
+            error = errno;
+            goto Exit;
+        }
+
+        if (listen(node.ListenFd, 4) < 0) {
+            ERROR("Failed to listen on AF_UNIX socket %s\n", node.SocketPath.c_str());
+            error = errno;
+            goto Exit;
+        }
+
+        ev.data.fd = node.ListenFd;
+        ev.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+            ERROR("Failed to add socket file descriptor to epoll\n");
+            error = errno;
+            goto Exit;
+        }
+    }
+
+    LOG("Simulating %u nodes, topology %s, loss %u%%, latency %u+%u [ms]\n", (unsigned)s_Nodes.size(), s_Topology, s_Loss, s_Latency, s_Jitter);
+    LOG("Listening for connections on %s[.1-%u]\n", s_SocketPath, (unsigned)s_Nodes.size() - 1);
+
+    error = sem_init(&s_Shutdown, 0, 0);
+    if (error < 0) {
+        ERROR("Failed to create sem\n");
+        error = errno;
+        goto Exit;
+    }
+    semInitialzed = true;
+
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&ecd, 0, sizeof(ecd));
+    ecd.callback = EPollTimerHandler;
+    epoll_loop_set_callback(s_TimerFd, ecd);
+
+    ecd.callback = EPollAcceptHandler;
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        ecd.ctx = reinterpret_cast<void*>(i);
+        epoll_loop_set_callback(s_Nodes[i].ListenFd, ecd);
+    }
+
+    while (sem_wait(&s_Shutdown) == -1  && errno == EINTR);
+
+Exit:
+    if (s_TimerFd >= 0) {
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(s_TimerFd, ecd);
+        safe_close_ref(&s_TimerFd);
+    }
+
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        Node& node = s_Nodes[i];
+        if (node.ListenFd >= 0) {
+            memset(&ecd, 0, sizeof(ecd));
+            epoll_loop_set_callback(node.ListenFd, ecd);
+            safe_close(node.ListenFd);
+            unlink(node.SocketPath.c_str());
+        }
+    }
+
+    if (epollFD >= 0) {
+        epoll_loop_destroy();
+    }
+
+    if (!error && !s_Nodes.empty()) {
+        PrintStatistics();
+    }
+
+    // close all connections
+    for (size_t i = 0; i < s_Nodes.size(); ++i) {
+        Node& node = s_Nodes[i];
+        for (size_t j = 0; j < node.Clients.size(); ++j) {
+            safe_close(node.Clients[j]);
+        }
+    }
+
+    if (semInitialzed) sem_destroy(&s_Shutdown);
+
+    if (error > 0) {
+        fprintf(stderr, "%s (%d)\n", strerror(error), error);
+    }
+    return error;
+}
+
+static
+void
+EPollAcceptHandler(void *ctx, epoll_event *ev) {
+    assert(ev);
+
+    if (ev->events & (EPOLLHUP | EPOLLERR)) {
+        epoll_callback_data ecd;
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(ev->data.fd, ecd);
+
+        ERROR("Socket closed!\n");
+        Shutdown();
+    } else if (ev->events & EPOLLIN) {
+        const size_t index = reinterpret_cast<size_t>(ctx);
+        for (;;) {
+            sockaddr_un remote;
+            socklen_t length = sizeof(remote);
+            int fd = accept4(ev->data.fd, (sockaddr*)&remote, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                break;
+            }
+
+            epoll_event cev;
+            memset(&cev, 0, sizeof(cev));
+            cev.data.fd = fd;
+            cev.events = EPOLLIN | EPOLLET;
+            if (epoll_ctl(epoll_loop_get_fd(), EPOLL_CTL_ADD, fd, &cev) == 0) {
+                s_Nodes[index].Clients.push_back(fd);
+
+                epoll_callback_data ecd;
+                memset(&ecd, 0, sizeof(ecd));
+                ecd.ctx = ctx;
+                ecd.callback = EPollConnectionDataHandler;
+                epoll_loop_set_callback(fd, ecd);
+                DEBUG("Node %u: add client %d\n", (unsigned)index, fd);
+            } else {
+                safe_close(fd);
+            }
+        }
+    }
+}
+
+static
+void
+EPollConnectionDataHandler(void *ctx, epoll_event *ev) {
+    assert(ev);
+    const size_t index = reinterpret_cast<size_t>(ctx);
+    Node& node = s_Nodes[index];
+
+    if (ev->events & (EPOLLHUP | EPOLLERR)) {
+        epoll_callback_data ecd;
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(ev->data.fd, ecd);
+
+        safe_close(ev->data.fd);
+
+        std::vector<int>::iterator it = std::find(node.Clients.begin(), node.Clients.end(), ev->data.fd);
+        if (it != node.Clients.end()) {
+            node.Clients.erase(it);
+        }
+        DEBUG("Node %u: remove client %d\n", (unsigned)index, ev->data.fd);
+    } else if (ev->events & EPOLLIN) {
+        char frames[MAX_BATCH_FRAMES][MAX_PAYLOAD_SIZE];
+        iovec iov[MAX_BATCH_FRAMES];
+        for (int i = 0; i < MAX_BATCH_FRAMES; ++i) {
+            iov[i].iov_base = frames[i];
+            iov[i].iov_len = s_PayloadSize;
+        }
+
+        for (ssize_t r = 1; r; ) {
+            r = readv(ev->data.fd, iov, MAX_BATCH_FRAMES);
+
+            if (r < 0) {
+                switch (errno) {
+                case EINTR:
+                    r = 1;
+                    break;
+                case EAGAIN:
+                case EBADF:
+                    r = 0;
+                    break;
+                default:
+                    r = 0;
+                    shutdown(ev->data.fd, SHUT_RDWR);
+                    break;
+                }
+            } else if (r % s_PayloadSize) {
+                // all clients must write payload size chunks
+                ERROR("Read %d bytes which is not a multiple of %d, shutting down %d\n", (int)r, (int)s_PayloadSize, ev->data.fd);
+                r = 0;
+                shutdown(ev->data.fd, SHUT_RDWR);
+            } else {
+                for (ssize_t i = 0; i < r / s_PayloadSize; ++i) {
+                    // status requests are for the packet router, not the air
+                    if (static_cast<uint8_t>(frames[i][0]) != RF24_PACKET_ROUTER_STATUS_MARKER) {
+                        Transmit(index, frames[i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static
+void
+EPollTimerHandler(void *ctx, epoll_event *ev) {
+    assert(ev);
+
+    if (ev->events & (EPOLLHUP | EPOLLERR)) {
+        epoll_callback_data ecd;
+        memset(&ecd, 0, sizeof(ecd));
+        epoll_loop_set_callback(ev->data.fd, ecd);
+        ERROR("Timer lost!\n");
+        Shutdown();
+    } else if (ev->events & EPOLLIN) {
+        while (true) {
+            uint64_t c;
+            ssize_t r = read(ev->data.fd, &c, sizeof(c));
+            if (r < 0) {
+                switch (errno) {
+                case EAGAIN:
+                case EINTR:
+                    r = 0;
+                    break;
+                default:
+                    ERROR("Could not read from timer fd (%d, %s)\n", errno, strerror(errno));
+                    Shutdown();
+                    return;
+                }
+            }
+
+            if (r == 0) {
+                break;
+            }
+        }
+
+        const uint64_t now = GetTimestampInMillis();
+        while (!s_InFlight.empty() && s_InFlight.begin()->first <= now) {
+            FrameQueue::iterator it = s_InFlight.begin();
+            Deliver(it->second.To, it->second.Data);
+            s_InFlight.erase(it);
+        }
+
+        ArmTimer();
+    }
+}
@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
@@ -38,11 +39,15 @@
 #include <toe/cmdlopt.h>
 #include <toe/buffer.h>
 #include <linuxapi/linuxapi.h>
+#include <string>
+#include <map>
 
 
-#include "../../TCP.h"
-
 #include "Globals.h"
+#include "rf24_ipc.h"
+#include "rf24_store.h"
+#include "rf24_wal.h"
+#include "../../Reading.h"
 
 
 #define APPNAME "rf24-tcp"
@@ -57,6 +62,20 @@
 #   define DEBUG(...)
 #endif
 
+template<typename T>
+static
+int
+UnsignedParser(const char* arg, T& value) {
+    char* end = NULL;
+    value = (T)strtoul(arg, &end, 10);
+    if (!end || end == arg) {
+        ERROR("Argument '%s' could not be converted to unsigned int\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
 static const cmdlopt_arg s_Dummy_Arg[] = {
     CMDLOPT_ARGUMENT_TERMINATOR
 };
@@ -69,9 +88,47 @@ NetworkSocketPath_Parser(void*, char* arg) {
     return 0;
 }
 
+static const char* s_StorePath = NULL;
+static
+int
+StorePath_Parser(void*, char* arg) {
+    s_StorePath = arg;
+    return 0;
+}
+
+static const char* s_WalPath = NULL;
+static
+int
+WalPath_Parser(void*, char* arg) {
+    s_WalPath = arg;
+    return 0;
+}
+
+static uint32_t s_SyncInterval = 1000;
+static
+int
+SyncInterval_Parser(void*, char* arg) {
+    return UnsignedParser(arg, s_SyncInterval);
+}
+
+static uint32_t s_SyncRecords = 16;
+static
+int
+SyncRecords_Parser(void*, char* arg) {
+    int error = UnsignedParser(arg, s_SyncRecords);
+    if (!error && !s_SyncRecords) {
+        ERROR("Sync record count must be at least 1\n");
+        error = -1;
+    }
+    return error;
+}
 
 static const cmdlopt_opt s_Options[] = {
     { "network-socket-path", "Path to UNIX socket. Defaults to " RF24_NETWORK_SOCKET_PATH, 0, 0x100, s_Dummy_Arg, NetworkSocketPath_Parser },
+    { "store", "Directory to store readings in, see " RF24_QUERY_APP_NAME ". Defaults to none.", 0, 0x101, s_Dummy_Arg, StorePath_Parser },
+    { "wal", "Write ahead log. Readings are logged and synced to this file before they are printed or stored, and replayed on start. Defaults to none.", 0, 0x102, s_Dummy_Arg, WalPath_Parser },
+    { "sync-interval", "Max. time in milliseconds a reading waits for the write ahead log to be synced. Defaults to 1000.", 0, 0x103, s_Dummy_Arg, SyncInterval_Parser },
+    { "sync-records", "Max. number of readings that wait for the write ahead log to be synced. Defaults to 16.", 0, 0x104, s_Dummy_Arg, SyncRecords_Parser },
     CMDLOPT_COMMON_OPTIONS,
     CMDLOPT_OPTION_TERMINATOR
 };
@@ -89,14 +146,226 @@ PrintTime(FILE* f) {
     strftime(timestring, sizeof(timestring) - 1, "%F %T", &brokenDown);
     fprintf(f, "%s", timestring);
 }
+struct SensorStore {
+    StoreSeries Series;
+    StoreRollup Rollups[STORE_ROLLUP_LEVELS];
+};
+
+typedef std::map<std::string, SensorStore> StoreMap;
+static StoreMap s_Stores;
+
+static
+void
+CloseSensorStore(SensorStore& store) {
+    StoreSeries_Close(store.Series);
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        StoreRollup_Close(store.Rollups[i]);
+    }
+}
+
+static
+void
+AddToRollups(void* ctx, const StoreReading& reading) {
+    SensorStore* store = (SensorStore*)ctx;
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        StoreRollup_Add(store->Rollups[i], reading);
+    }
+}
+
+static
+int
+OpenSensorStore(SensorStore& store, const char* name) {
+    char path[256];
+    bool backfill = false;
+    int error = 0;
+
+    memset(&store, 0, sizeof(store));
+    store.Series.Fd = -1;
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        store.Rollups[i].Fd = -1;
+    }
+
+    if (Store_SeriesPath(path, sizeof(path), s_StorePath, name) < 0 ||
+        StoreSeries_Open(store.Series, path, name, true) < 0) {
+        goto Error;
+    }
+
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        if (Store_RollupPath(path, sizeof(path), s_StorePath, name, i) < 0 ||
+            StoreRollup_Open(store.Rollups[i], path, i, true) < 0) {
+            goto Error;
+        }
+        backfill = backfill || !store.Rollups[i].Rows;
+    }
+
+    // rebuild rollups that are missing, e.g. for stores of earlier versions
+    if (backfill) {
+        for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+            if (store.Rollups[i].Rows) {
+                StoreRollup_Close(store.Rollups[i]);
+                if (Store_RollupPath(path, sizeof(path), s_StorePath, name, i) < 0 ||
+                    unlink(path) < 0 ||
+                    StoreRollup_Open(store.Rollups[i], path, i, true) < 0) {
+                    goto Error;
+                }
+            }
+        }
+        StoreSeries_Scan(store.Series, 0, UINT32_MAX, AddToRollups, &store);
+    }
+
+    return 0;
+
+Error:
+    error = errno;
+    CloseSensorStore(store);
+    errno = error;
+    return -1;
+}
+
+static
+void
+StoreRecord(uint8_t sender, uint32_t time, const Reading& reading, bool replay) {
+    const std::string name(reading.Name, reading.NameLength);
+
+    StoreMap::iterator it = s_Stores.find(name);
+    if (it == s_Stores.end()) {
+        SensorStore store;
+        if (OpenSensorStore(store, name.c_str()) < 0) {
+            ERROR("Failed to open store for %s: %s\n", name.c_str(), strerror(errno));
+            return;
+        }
+        it = s_Stores.insert(std::make_pair(name, store)).first;
+    }
+
+    SensorStore& store = it->second;
+    StoreReading r;
+    r.Time = time;
+    r.Temperature = reading.Temperature;
+    r.Humidity = reading.Humidity;
+    r.MilliVolts = reading.MilliVolts;
+    r.RawHumidity = reading.RawHumidity;
+    r.Sender = sender;
+    r.Via = reading.Via;
+
+    // a replayed reading may have made it to the series or any of the
+    // rollups before, each is synced on its own
+    if ((!replay || time > StoreSeries_LastTime(store.Series)) &&
+        StoreSeries_Append(store.Series, r) < 0) {
+        ERROR("Failed to store reading of %s: %s\n", name.c_str(), strerror(errno));
+        return;
+    }
+
+    for (uint8_t i = 0; i < STORE_ROLLUP_LEVELS; ++i) {
+        if (!replay || time > StoreRollup_LastTime(store.Rollups[i])) {
+            StoreRollup_Add(store.Rollups[i], r);
+        }
+    }
+}
+
+static
+void
+Emit(uint32_t time, const uint8_t* data, uint16_t size, bool replay) {
+    if (!size) {
+        return;
+    }
+
+    const uint8_t sender = data[0];
+    DEBUG("Packet from %02x, size %u\n", sender, size - 1);
+    Reading reading;
+    if (Reading_Parse(data + 1, (uint8_t)(size - 1), &reading) == 0) {
+        // binary readings are logged in text form, too
+        fprintf(stdout, "WB%.*s;%d;%d;%u;%u;%02x\n",
+                reading.NameLength, reading.Name, reading.Temperature, reading.Humidity,
+                reading.MilliVolts, reading.RawHumidity, reading.Via);
+        if (s_StorePath) {
+            StoreRecord(sender, time, reading, replay);
+        }
+    } else {
+        fprintf(stdout, "%.*s\n", (int)(size - 1), (const char*)data + 1);
+    }
+}
+
+static Wal s_Wal;
+static uint64_t s_SyncDeadline;
+static bool s_Replaying;
+static volatile sig_atomic_t s_Stop;
+
+static
+void
+SignalHandler(int) {
+    s_Stop = 1;
+}
+
+static
+uint64_t GetTimestampInMillis() {
+    uint64_t result = 0;
+    timespec ts;
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        result = ts.tv_sec * UINT64_C(1000);
+        result += ts.tv_nsec / 1000000;
+    }
+
+    return result;
+}
+
+static
+void
+EmitRecord(void*, const WalRecord& record) {
+    Emit(record.Time, record.Payload, record.Length, s_Replaying);
+}
+
+/* Makes everything emitted so far durable, then empties the log. stdout
+ * is synced only if it is a regular file. If it is a pipe, the log lets go
+ * of readings once they are written to it, so without a store they are
+ * durable only up to the pipe.
+ */
+static
+void
+Checkpoint() {
+    bool ok = fflush(stdout) == 0;
+
+    struct stat st;
+    if (ok && fstat(fileno(stdout), &st) == 0 && S_ISREG(st.st_mode)) {
+        ok = fdatasync(fileno(stdout)) == 0;
+    }
+
+    for (StoreMap::iterator it = s_Stores.begin(); ok && it != s_Stores.end(); ++it) {
+        ok = StoreSeries_Sync(it->second.Series) == 0;
+        for (uint8_t i = 0; ok && i < STORE_ROLLUP_LEVELS; ++i) {
+            ok = StoreRollup_Sync(it->second.Rollups[i]) == 0;
+        }
+    }
+
+    if (!ok || Wal_Reset(s_Wal) < 0) {
+        ERROR("Failed to checkpoint write ahead log: %s\n", strerror(errno));
+    }
+}
+
+static
+void
+Commit() {
+    if (Wal_Commit(s_Wal) < 0) {
+        ERROR("Failed to sync write ahead log: %s\n", strerror(errno));
+        s_SyncDeadline = GetTimestampInMillis() + s_SyncInterval; // retry
+        return;
+    }
+
+    fflush(stdout);
+    if (s_Wal.Size >= WAL_CHECKPOINT_SIZE) {
+        Checkpoint();
+    }
+}
 
 int
 main(int argc, char** argv) {
     int socketFd = -1;
     sockaddr_un sa;
+    const uint8_t version = RF24_IPC_VERSION;
+
+    s_Wal.Fd = -1;
 
     cmdlopt_set_app_name(APPNAME);
-    cmdlopt_set_app_version("1.1.0\nCopyright (c) 2016 Jean Gressmann <jean@0x42.de>");
+    cmdlopt_set_app_version("1.5.0\nCopyright (c) 2016 Jean Gressmann <jean@0x42.de>");
     cmdlopt_set_options(s_Options);
     int error = cmdlopt_parse_cmdl(argc, argv, NULL);
 
@@ -126,6 +395,18 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
+    if (s_WalPath) {
+        // re-emit what didn't make it downstream before the last shutdown
+        s_Replaying = true;
+        if (Wal_Open(s_Wal, s_WalPath, EmitRecord, NULL) < 0) {
+            ERROR("Failed to open write ahead log %s\n", s_WalPath);
+            error = errno;
+            goto Exit;
+        }
+        s_Replaying = false;
+        Checkpoint();
+    }
+
     memset(&sa, 0, sizeof(sa));
 
 
@@ -144,65 +425,91 @@ main(int argc, char** argv) {
         goto Exit;
     }
 
-    error = write(socketFd, "+", 1);
-    if (error != 1) {
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN); // for the stupid socket
+
+    if (IpcWriteFrame(socketFd, RF24_IPC_HELLO, 1, &version, 1) < 0 ||
+        IpcWriteFrame(socketFd, RF24_IPC_SUBSCRIBE, 2, NULL, 0) < 0) {
         ERROR("Failed to register as TCP listener\n");
         error = errno;
         goto Exit;
     }
 
-    error = 0;
-    signal(SIGPIPE, SIG_IGN); // for the stupid socket
+    IpcHeader header;
+    uint8_t payload[RF24_IPC_MAX_PAYLOAD + 1];
+    while (!s_Stop) {
+        int timeout = -1;
+        if (s_Wal.Pending) {
+            const uint64_t now = GetTimestampInMillis();
+            timeout = s_SyncDeadline > now ? (int)(s_SyncDeadline - now) : 0;
+        }
+
+        pollfd pfd;
+        pfd.fd = socketFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        const int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            goto Exit;
+        }
+
+        if (!ready) {
+            Commit();
+            continue;
+        }
 
-    ssize_t ro;
-    uint8_t header[2];
-    char tcpPayload[TCP_PAYLOAD_SIZE+1];
-    ro = 0;
-    while (1) {
-        ssize_t r = read(socketFd, header + ro, sizeof(header) - ro);
-        if (r == -1) {
-            switch (r) {
-            case EINTR:
-                break;
-            default:
-                goto Exit;
+        if (IpcReadFrame(socketFd, header, payload) < 0) {
+            if (errno != ECONNRESET) { // connection closed
+                error = errno;
             }
-        } if (r == 0) { // connection closed
             goto Exit;
-        } else {
-            ro += r;
-            if (ro == sizeof(header)){
-                ro = 0;
-                uint8_t sender = header[0];
-                (void)sender;
-                uint8_t size = header[1];
-                DEBUG("Packet from %02x, size %u\n", sender, size);
-                while (1) {
-                    r = read(socketFd, tcpPayload + ro, size - ro);
-                    if (r == -1) {
-                        switch (r) {
-                        case EINTR:
-                            break;
-                        default:
-                            goto Exit;
-                        }
-                    } if (r == 0) {  // connection closed
-                        goto Exit;
-                    } else {
-                        ro += r;
-                        if (ro == size) {
-                            ro = 0;
-                            tcpPayload[size] = 0;
-                            fprintf(stdout, "%s\n", tcpPayload);
-                            break;
-                        }
-                    }
+        }
+
+        switch (header.Type) {
+        case RF24_IPC_HELLO | RF24_IPC_REPLY:
+            DEBUG("Connected to network id %02x\n", header.Length > 1 ? payload[1] : 0xff);
+            break;
+        case RF24_IPC_SUBSCRIBE | RF24_IPC_REPLY:
+            DEBUG("Registered as TCP listener\n");
+            break;
+        case RF24_IPC_ERROR:
+            ERROR("Request %u failed with error %u\n", header.Id, header.Length ? payload[0] : 0);
+            error = -1;
+            goto Exit;
+        case RF24_IPC_DATA:
+            if (s_WalPath) {
+                if (!s_Wal.Pending) {
+                    s_SyncDeadline = GetTimestampInMillis() + s_SyncInterval;
+                }
+                if (Wal_Append(s_Wal, (uint32_t)time(NULL), payload, header.Length) < 0) {
+                    ERROR("Failed to log reading: %s\n", strerror(errno));
+                    Emit((uint32_t)time(NULL), payload, header.Length, false);
+                } else if (s_Wal.Pending >= s_SyncRecords) {
+                    Commit();
                 }
+            } else {
+                Emit((uint32_t)time(NULL), payload, header.Length, false);
             }
+            break;
         }
     }
 
 Exit:
+    if (s_Wal.Fd >= 0) {
+        Commit();
+        Checkpoint();
+        Wal_Close(s_Wal);
+    }
+
+    for (StoreMap::iterator it = s_Stores.begin(); it != s_Stores.end(); ++it) {
+        CloseSensorStore(it->second);
+    }
+
     if (socketFd >= 0) {
         safe_close(socketFd);
     }
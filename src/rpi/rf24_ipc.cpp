@@ -0,0 +1,178 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "rf24_ipc.h"
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+
+size_t
+IpcEncode(uint8_t* frame, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length) {
+    frame[0] = RF24_IPC_MAGIC;
+    frame[1] = RF24_IPC_VERSION;
+    frame[2] = type;
+    frame[3] = 0;
+    frame[4] = (uint8_t)id;
+    frame[5] = (uint8_t)(id >> 8);
+    frame[6] = (uint8_t)length;
+    frame[7] = (uint8_t)(length >> 8);
+    if (length) {
+        memcpy(frame + RF24_IPC_HEADER_SIZE, payload, length);
+    }
+
+    return RF24_IPC_HEADER_SIZE + length;
+}
+
+int
+IpcDecodeHeader(const uint8_t* data, IpcHeader& header) {
+    if (data[0] != RF24_IPC_MAGIC || data[1] != RF24_IPC_VERSION) {
+        return -1;
+    }
+
+    header.Type = data[2];
+    header.Id = (uint16_t)(data[4] | (data[5] << 8));
+    header.Length = (uint16_t)(data[6] | (data[7] << 8));
+
+    if (header.Length > RF24_IPC_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t
+IpcParseFrames(const uint8_t* data, size_t size, IpcFrameCallback callback, void* ctx) {
+    size_t offset = 0;
+    while (size - offset >= RF24_IPC_HEADER_SIZE) {
+        IpcHeader header;
+        if (IpcDecodeHeader(data + offset, header) < 0) {
+            return -1;
+        }
+
+        if (size - offset < static_cast<size_t>(RF24_IPC_HEADER_SIZE + header.Length)) {
+            break;
+        }
+
+        callback(ctx, header, data + offset + RF24_IPC_HEADER_SIZE);
+        offset += RF24_IPC_HEADER_SIZE + header.Length;
+    }
+
+    return static_cast<ssize_t>(offset);
+}
+
+static
+int
+WaitFor(int fd, short events) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+int
+ReadExactly(int fd, uint8_t* ptr, size_t bytes) {
+    while (bytes) {
+        ssize_t r = read(fd, ptr, bytes);
+        if (r < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                if (WaitFor(fd, POLLIN) < 0) {
+                    return -1;
+                }
+                continue;
+            default:
+                return -1;
+            }
+        }
+
+        if (r == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        ptr += r;
+        bytes -= (size_t)r;
+    }
+
+    return 0;
+}
+
+int
+IpcWriteFrame(int fd, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length) {
+    uint8_t frame[RF24_IPC_MAX_FRAME];
+    if (length > RF24_IPC_MAX_PAYLOAD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint8_t* ptr = frame;
+    size_t bytes = IpcEncode(frame, type, id, payload, length);
+    while (bytes) {
+        ssize_t w = write(fd, ptr, bytes);
+        if (w < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                if (WaitFor(fd, POLLOUT) < 0) {
+                    return -1;
+                }
+                continue;
+            default:
+                return -1;
+            }
+        }
+
+        ptr += w;
+        bytes -= (size_t)w;
+    }
+
+    return 0;
+}
+
+int
+IpcReadFrame(int fd, IpcHeader& header, uint8_t* payload) {
+    uint8_t buffer[RF24_IPC_HEADER_SIZE];
+    if (ReadExactly(fd, buffer, sizeof(buffer)) < 0) {
+        return -1;
+    }
+
+    if (IpcDecodeHeader(buffer, header) < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return ReadExactly(fd, payload, header.Length);
+}
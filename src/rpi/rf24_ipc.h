@@ -0,0 +1,115 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RF24_IPC_H
+#define RF24_IPC_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary protocol spoken on the rf24-network UNIX socket.
+ *
+ * Every message is a frame of an 8 byte header followed by Length bytes
+ * of payload. Multi-byte values are little endian.
+ *
+ *   0 Magic (RF24_IPC_MAGIC)
+ *   1 Version (RF24_IPC_VERSION)
+ *   2 Type
+ *   3 Reserved, 0
+ *   4 Id (2 bytes), chosen by the client, echoed in replies
+ *   6 Length (2 bytes), at most RF24_IPC_MAX_PAYLOAD
+ *
+ * Clients may pipeline requests. Replies come in request order and
+ * carry the request type or'ed with RF24_IPC_REPLY, or RF24_IPC_ERROR.
+ *
+ * HELLO        version (0-1) -> version (1), network id (1), features (1, RF24_IPC_FEATURE_*)
+ * TIME         -> time (4)
+ * ROUTE        addresses (0-256, none means all 256) -> next hops, one per address
+ * SUBSCRIBE    -> empty; then DATA frames carrying the subscribe id:
+ *                 sender (1), TCP payload
+ * UNSUBSCRIBE  -> empty
+ * ERROR        error (1, RF24_IPC_E_*), type of the failed request (1)
+ *
+ * A connection whose first byte isn't RF24_IPC_MAGIC speaks the legacy
+ * ASCII protocol (T, Nxx, +, -).
+ */
+
+#define RF24_IPC_MAGIC          0xf2
+#define RF24_IPC_VERSION        1
+#define RF24_IPC_HEADER_SIZE    8
+#define RF24_IPC_MAX_PAYLOAD    256
+#define RF24_IPC_MAX_FRAME      (RF24_IPC_HEADER_SIZE + RF24_IPC_MAX_PAYLOAD)
+
+#define RF24_IPC_HELLO          0x01
+#define RF24_IPC_TIME           0x02
+#define RF24_IPC_ROUTE          0x03
+#define RF24_IPC_SUBSCRIBE      0x04
+#define RF24_IPC_UNSUBSCRIBE    0x05
+#define RF24_IPC_DATA           0x06
+#define RF24_IPC_ERROR          0x7f
+#define RF24_IPC_REPLY          0x80
+
+#define RF24_IPC_E_UNKNOWN_TYPE 1
+#define RF24_IPC_E_PROTOCOL     2 /* malformed header or version, the connection is closed */
+#define RF24_IPC_E_DISABLED     3
+
+#define RF24_IPC_FEATURE_BATMAN 0x01
+#define RF24_IPC_FEATURE_TCP    0x02
+#define RF24_IPC_FEATURE_TIME   0x04
+
+struct IpcHeader {
+    uint8_t Type;
+    uint16_t Id;
+    uint16_t Length;
+};
+
+/* Writes header and payload to frame which must hold
+ * RF24_IPC_HEADER_SIZE + length bytes. Returns the frame size.
+ */
+size_t IpcEncode(uint8_t* frame, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length);
+
+/* Decodes the RF24_IPC_HEADER_SIZE bytes at data.
+ * Returns 0 on success, -1 if magic, version or length are invalid.
+ */
+int IpcDecodeHeader(const uint8_t* data, IpcHeader& header);
+
+typedef void (*IpcFrameCallback)(void* ctx, const IpcHeader& header, const uint8_t* payload);
+
+/* Calls callback for every complete frame in the size bytes at data.
+ * Frames may span reads, the caller keeps the bytes not consumed and
+ * passes them again with the next read. Returns the bytes consumed or
+ * -1 on an invalid header.
+ */
+ssize_t IpcParseFrames(const uint8_t* data, size_t size, IpcFrameCallback callback, void* ctx);
+
+/* Writes a complete frame, blocking until done. Returns 0 or -1 (errno). */
+int IpcWriteFrame(int fd, uint8_t type, uint16_t id, const uint8_t* payload, uint16_t length);
+
+/* Reads a complete frame, payload must hold RF24_IPC_MAX_PAYLOAD bytes.
+ * Blocks until done. Returns 0 or -1 (errno, ECONNRESET on EOF, EPROTO on
+ * an invalid header).
+ */
+int IpcReadFrame(int fd, IpcHeader& header, uint8_t* payload);
+
+#endif // RF24_IPC_H
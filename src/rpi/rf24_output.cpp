@@ -0,0 +1,158 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "rf24_output.h"
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+OutputQueue*
+OutputQueue_Create(unsigned capacity) {
+    if (capacity < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    OutputQueue* queue = static_cast<OutputQueue*>(calloc(1, sizeof(OutputQueue)));
+    if (queue) {
+        queue->Records = static_cast<OutputRecord*>(malloc(capacity * sizeof(OutputRecord)));
+        if (!queue->Records) {
+            free(queue);
+            return NULL;
+        }
+        queue->Capacity = capacity;
+    }
+
+    return queue;
+}
+
+void
+OutputQueue_Destroy(OutputQueue* queue) {
+    if (queue) {
+        free(queue->Records);
+        free(queue);
+    }
+}
+
+int
+OutputQueue_Send(OutputQueue* queue, int fd, const uint8_t* data, size_t size) {
+    size_t written = 0;
+    if (!queue->Count) {
+        ssize_t w;
+        while ((w = write(fd, data, size)) < 0 && errno == EINTR);
+        if (w < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            w = 0;
+        }
+
+        written = static_cast<size_t>(w);
+        if (written == size) {
+            return 1;
+        }
+    }
+
+    if (queue->Count == queue->Capacity) {
+        return 0;
+    }
+
+    OutputRecord& record = queue->Records[(queue->Head + queue->Count) % queue->Capacity];
+    record.Size = static_cast<uint16_t>(size);
+    memcpy(record.Data, data, size);
+    if (!queue->Count) {
+        queue->Offset = static_cast<unsigned>(written);
+    }
+    ++queue->Count;
+
+    return 1;
+}
+
+void
+OutputQueue_DropOldest(OutputQueue* queue) {
+    if (!queue->Count) {
+        return;
+    }
+
+    // a started record must go out whole, it takes the place of the next
+    const unsigned next = (queue->Head + 1) % queue->Capacity;
+    if (queue->Offset) {
+        if (queue->Count == 1) {
+            return;
+        }
+        queue->Records[next] = queue->Records[queue->Head];
+    }
+    queue->Head = next;
+    --queue->Count;
+    ++queue->Dropped;
+}
+
+int
+OutputQueue_Flush(OutputQueue* queue, int fd) {
+    while (queue->Count) {
+        iovec iov[OUTPUT_MAX_IOV];
+        size_t total = 0;
+        int count = 0;
+        for (; count < OUTPUT_MAX_IOV && count < (int)queue->Count; ++count) {
+            OutputRecord& record = queue->Records[(queue->Head + count) % queue->Capacity];
+            const unsigned offset = count ? 0 : queue->Offset;
+            iov[count].iov_base = record.Data + offset;
+            iov[count].iov_len = record.Size - offset;
+            total += iov[count].iov_len;
+        }
+
+        ssize_t w = writev(fd, iov, count);
+        if (w < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                return 0;
+            default:
+                return -1;
+            }
+        }
+
+        for (size_t left = static_cast<size_t>(w); left; ) {
+            const size_t pending = queue->Records[queue->Head].Size - queue->Offset;
+            if (left >= pending) {
+                left -= pending;
+                queue->Offset = 0;
+                queue->Head = (queue->Head + 1) % queue->Capacity;
+                --queue->Count;
+            } else {
+                queue->Offset += left;
+                left = 0;
+            }
+        }
+
+        if (static_cast<size_t>(w) < total) {
+            return 0; // socket buffer full, wait for EPOLLOUT
+        }
+    }
+
+    return 1;
+}
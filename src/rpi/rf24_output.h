@@ -0,0 +1,78 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RF24_OUTPUT_H
+#define RF24_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rf24_ipc.h"
+
+/* Records pending for a slow client of a non-blocking socket.
+ *
+ * Each record sits contiguous in its own slot so a (partial) write
+ * never mixes framing of two records. Records are written in order,
+ * up to OUTPUT_MAX_IOV at a time.
+ */
+
+#define OUTPUT_RECORD_SIZE RF24_IPC_MAX_FRAME // >= 2 + 255 of the legacy format
+#define OUTPUT_MAX_IOV 16
+
+struct OutputRecord {
+    uint16_t Size;
+    uint8_t Data[OUTPUT_RECORD_SIZE];
+};
+
+struct OutputQueue {
+    OutputRecord* Records;
+    unsigned Capacity;
+    unsigned Head;
+    unsigned Count;
+    unsigned Offset; // bytes of the head record already written
+    unsigned Dropped;
+    bool Release; // destroy once drained, the client removed itself mid record
+};
+
+/* Returns a queue of capacity records, at least 2, or NULL. */
+OutputQueue* OutputQueue_Create(unsigned capacity);
+
+void OutputQueue_Destroy(OutputQueue* queue);
+
+/* Writes data to fd if nothing is queued and queues what fd didn't take.
+ * size must not exceed OUTPUT_RECORD_SIZE.
+ * Returns 1 if data was written or queued, 0 if the queue is full and
+ * nothing was done, -1 on a write error (errno).
+ */
+int OutputQueue_Send(OutputQueue* queue, int fd, const uint8_t* data, size_t size);
+
+/* Drops the oldest record not yet started to make room. */
+void OutputQueue_DropOldest(OutputQueue* queue);
+
+/* Writes queued records until fd would block.
+ * Returns 1 once the queue is empty, 0 if fd is full, -1 on a write
+ * error (errno).
+ */
+int OutputQueue_Flush(OutputQueue* queue, int fd);
+
+#endif // RF24_OUTPUT_H
@@ -0,0 +1,835 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "rf24_store.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linuxapi/linuxapi.h>
+
+
+struct StoreFileHeader {
+    uint32_t Magic;
+    uint8_t Version;
+    uint8_t Reserved;
+    uint16_t BlockSize;
+    char Name[STORE_NAME_SIZE];
+};
+
+struct StoreRollupHeader {
+    uint32_t Magic;
+    uint8_t Version;
+    uint8_t Level;
+    uint16_t RowSize;
+    uint32_t LastTime; // latest reading added
+};
+
+struct BitStream {
+    uint8_t* Data;
+    uint32_t Bits;
+    uint32_t Capacity;
+    bool Overflow;
+};
+
+struct Decoder {
+    BitStream Stream;
+    StoreReading Previous;
+    int32_t PreviousDelta;
+};
+
+static
+inline
+StoreBlockHeader*
+Block(const StoreSeries& series, uint32_t index) {
+    return (StoreBlockHeader*)(series.Map + STORE_HEADER_SIZE + (size_t)index * STORE_BLOCK_SIZE);
+}
+
+static
+inline
+uint8_t*
+Body(StoreBlockHeader* block) {
+    return (uint8_t*)(block + 1);
+}
+
+static
+inline
+uint32_t
+ZigZag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static
+inline
+int32_t
+UnZigZag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static
+void
+PutBits(BitStream& stream, uint32_t value, uint8_t count) {
+    while (count--) {
+        if (stream.Bits >= stream.Capacity) {
+            stream.Overflow = true;
+            return;
+        }
+
+        uint8_t* byte = &stream.Data[stream.Bits >> 3];
+        const uint8_t mask = 0x80 >> (stream.Bits & 7);
+        if ((value >> count) & 1) {
+            *byte |= mask;
+        } else {
+            *byte &= ~mask;
+        }
+        ++stream.Bits;
+    }
+}
+
+static
+uint32_t
+GetBits(BitStream& stream, uint8_t count) {
+    uint32_t value = 0;
+    while (count--) {
+        value <<= 1;
+        if (stream.Bits < stream.Capacity) {
+            value |= (stream.Data[stream.Bits >> 3] >> (7 - (stream.Bits & 7))) & 1;
+            ++stream.Bits;
+        }
+    }
+    return value;
+}
+
+/* Leading ones select the width, a zero ends the prefix unless all
+ * widths are used up.
+ */
+static
+uint8_t
+GetPrefix(BitStream& stream, uint8_t max) {
+    uint8_t ones = 0;
+    while (ones < max && GetBits(stream, 1)) {
+        ++ones;
+    }
+    return ones;
+}
+
+/* 0, 10 + 7, 110 + 9, 1110 + 12, 1111 + 32 */
+static
+void
+PutTime(BitStream& stream, int32_t deltaOfDelta) {
+    const uint32_t zz = ZigZag(deltaOfDelta);
+    if (!zz) {
+        PutBits(stream, 0, 1);
+    } else if (zz < (UINT32_C(1) << 7)) {
+        PutBits(stream, 0x2, 2);
+        PutBits(stream, zz, 7);
+    } else if (zz < (UINT32_C(1) << 9)) {
+        PutBits(stream, 0x6, 3);
+        PutBits(stream, zz, 9);
+    } else if (zz < (UINT32_C(1) << 12)) {
+        PutBits(stream, 0xe, 4);
+        PutBits(stream, zz, 12);
+    } else {
+        PutBits(stream, 0xf, 4);
+        PutBits(stream, zz, 32);
+    }
+}
+
+static
+int32_t
+GetTime(BitStream& stream) {
+    static const uint8_t s_Widths[] = { 0, 7, 9, 12, 32 };
+    return UnZigZag(GetBits(stream, s_Widths[GetPrefix(stream, 4)]));
+}
+
+/* 0, 10 + 4, 110 + 8, 111 + 17 */
+static
+void
+PutValue(BitStream& stream, int32_t delta) {
+    const uint32_t zz = ZigZag(delta);
+    if (!zz) {
+        PutBits(stream, 0, 1);
+    } else if (zz < (UINT32_C(1) << 4)) {
+        PutBits(stream, 0x2, 2);
+        PutBits(stream, zz, 4);
+    } else if (zz < (UINT32_C(1) << 8)) {
+        PutBits(stream, 0x6, 3);
+        PutBits(stream, zz, 8);
+    } else {
+        PutBits(stream, 0x7, 3);
+        PutBits(stream, zz, 17);
+    }
+}
+
+static
+int32_t
+GetValue(BitStream& stream) {
+    static const uint8_t s_Widths[] = { 0, 4, 8, 17 };
+    return UnZigZag(GetBits(stream, s_Widths[GetPrefix(stream, 3)]));
+}
+
+/* 0 for a repeat, else 1 + 8 */
+static
+void
+PutAddress(BitStream& stream, uint8_t previous, uint8_t address) {
+    if (previous == address) {
+        PutBits(stream, 0, 1);
+    } else {
+        PutBits(stream, 1, 1);
+        PutBits(stream, address, 8);
+    }
+}
+
+static
+uint8_t
+GetAddress(BitStream& stream, uint8_t previous) {
+    return GetBits(stream, 1) ? (uint8_t)GetBits(stream, 8) : previous;
+}
+
+static
+void
+Encode(BitStream& stream, const StoreReading& previous, int32_t previousDelta, const StoreReading& reading) {
+    const int32_t delta = (int32_t)(reading.Time - previous.Time);
+    PutTime(stream, delta - previousDelta);
+    PutValue(stream, reading.Temperature - previous.Temperature);
+    PutValue(stream, reading.Humidity - previous.Humidity);
+    PutValue(stream, reading.MilliVolts - previous.MilliVolts);
+    PutValue(stream, reading.RawHumidity - previous.RawHumidity);
+    PutAddress(stream, previous.Sender, reading.Sender);
+    PutAddress(stream, previous.Via, reading.Via);
+}
+
+static
+void
+ResetState(StoreReading& previous, int32_t& previousDelta, uint32_t time) {
+    memset(&previous, 0, sizeof(previous));
+    previous.Time = time;
+    previousDelta = 0;
+}
+
+static
+void
+Decoder_Init(Decoder& decoder, StoreBlockHeader* block) {
+    decoder.Stream.Data = Body(block);
+    decoder.Stream.Bits = 0;
+    decoder.Stream.Capacity = block->Bits;
+    decoder.Stream.Overflow = false;
+    ResetState(decoder.Previous, decoder.PreviousDelta, block->FirstTime);
+}
+
+static
+void
+Decoder_Next(Decoder& decoder, StoreReading& reading) {
+    BitStream& stream = decoder.Stream;
+    const StoreReading& previous = decoder.Previous;
+    decoder.PreviousDelta += GetTime(stream);
+    reading.Time = previous.Time + (uint32_t)decoder.PreviousDelta;
+    reading.Temperature = (int16_t)(previous.Temperature + GetValue(stream));
+    reading.Humidity = (int16_t)(previous.Humidity + GetValue(stream));
+    reading.MilliVolts = (uint16_t)(previous.MilliVolts + GetValue(stream));
+    reading.RawHumidity = (uint16_t)(previous.RawHumidity + GetValue(stream));
+    reading.Sender = GetAddress(stream, previous.Sender);
+    reading.Via = GetAddress(stream, previous.Via);
+    decoder.Previous = reading;
+}
+
+static
+void
+StatValues(const StoreReading& reading, int32_t* values) {
+    values[STORE_TEMPERATURE] = reading.Temperature;
+    values[STORE_HUMIDITY] = reading.Humidity;
+    values[STORE_MILLIVOLTS] = reading.MilliVolts;
+}
+
+static
+int
+Map(StoreSeries& series, size_t size) {
+    if (series.Map) {
+        munmap(series.Map, series.MapSize);
+        series.Map = NULL;
+    }
+
+    const int prot = series.Writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* map = mmap(NULL, size, prot, MAP_SHARED, series.Fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    series.Map = (uint8_t*)map;
+    series.MapSize = size;
+    series.Blocks = (uint32_t)((size - STORE_HEADER_SIZE) / STORE_BLOCK_SIZE);
+    return 0;
+}
+
+static
+int
+Grow(StoreSeries& series) {
+    const size_t size = series.MapSize + (size_t)STORE_GROW_BLOCKS * STORE_BLOCK_SIZE;
+    if (ftruncate(series.Fd, (off_t)size) < 0) {
+        return -1;
+    }
+
+    return Map(series, size);
+}
+
+static
+void
+CleanName(char* clean, const char* name) {
+    size_t i = 0;
+    for (; name[i] && i < STORE_NAME_SIZE - 1; ++i) {
+        const char c = name[i];
+        const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+        clean[i] = ok ? c : '_';
+    }
+    if (!i) {
+        clean[i++] = '_';
+    }
+    clean[i] = 0;
+}
+
+int
+Store_SeriesPath(char* path, size_t size, const char* dir, const char* name) {
+    char clean[STORE_NAME_SIZE];
+    CleanName(clean, name);
+
+    const int bytes = snprintf(path, size, "%s/%s" STORE_FILE_EXTENSION, dir, clean);
+    return bytes < 0 || (size_t)bytes >= size ? -1 : 0;
+}
+
+int
+StoreSeries_Open(StoreSeries& series, const char* path, const char* name, bool writable) {
+    struct stat st;
+    int error = 0;
+
+    memset(&series, 0, sizeof(series));
+    series.Writable = writable;
+    series.Fd = safe_open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (series.Fd < 0) {
+        return -1;
+    }
+
+    if (fstat(series.Fd, &st) < 0) {
+        goto Error;
+    }
+
+    if (st.st_size == 0 && writable) {
+        StoreFileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.Magic = STORE_MAGIC;
+        header.Version = STORE_VERSION;
+        header.BlockSize = STORE_BLOCK_SIZE;
+        strncpy(header.Name, name ? name : "", sizeof(header.Name) - 1);
+
+        if (ftruncate(series.Fd, STORE_HEADER_SIZE + STORE_GROW_BLOCKS * STORE_BLOCK_SIZE) < 0 ||
+            Map(series, STORE_HEADER_SIZE + STORE_GROW_BLOCKS * STORE_BLOCK_SIZE) < 0) {
+            goto Error;
+        }
+        memcpy(series.Map, &header, sizeof(header));
+    } else {
+        if (st.st_size < STORE_HEADER_SIZE + STORE_BLOCK_SIZE ||
+            (st.st_size - STORE_HEADER_SIZE) % STORE_BLOCK_SIZE) {
+            errno = EPROTO;
+            goto Error;
+        }
+
+        if (Map(series, (size_t)st.st_size) < 0) {
+            goto Error;
+        }
+
+        const StoreFileHeader* header = (const StoreFileHeader*)series.Map;
+        if (header->Magic != STORE_MAGIC ||
+            header->Version != STORE_VERSION ||
+            header->BlockSize != STORE_BLOCK_SIZE) {
+            errno = EPROTO;
+            goto Error;
+        }
+    }
+
+    memcpy(series.Name, ((const StoreFileHeader*)series.Map)->Name, sizeof(series.Name));
+    series.Name[sizeof(series.Name) - 1] = 0;
+
+    // blocks are used in order, the last one in use is open for appends
+    series.Current = series.Blocks;
+    while (series.Current && !Block(series, series.Current - 1)->Count) {
+        --series.Current;
+    }
+    if (series.Current) {
+        --series.Current;
+    }
+
+    if (writable) {
+        StoreBlockHeader* block = Block(series, series.Current);
+        Decoder decoder;
+        Decoder_Init(decoder, block);
+        for (uint16_t i = 0; i < block->Count; ++i) {
+            StoreReading reading;
+            Decoder_Next(decoder, reading);
+        }
+        series.Previous = decoder.Previous;
+        series.PreviousDelta = decoder.PreviousDelta;
+    }
+
+    return 0;
+
+Error:
+    error = errno;
+    StoreSeries_Close(series);
+    errno = error;
+    return -1;
+}
+
+void
+StoreSeries_Close(StoreSeries& series) {
+    if (series.Map) {
+        munmap(series.Map, series.MapSize);
+        series.Map = NULL;
+    }
+
+    safe_close_ref(&series.Fd);
+}
+
+int
+StoreSeries_Append(StoreSeries& series, const StoreReading& reading) {
+    if (!series.Writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    StoreReading r = reading;
+    StoreBlockHeader* block = Block(series, series.Current);
+    if (block->Count && r.Time < series.Previous.Time) {
+        r.Time = series.Previous.Time;
+    }
+
+    BitStream stream;
+    stream.Data = Body(block);
+    stream.Bits = block->Bits;
+    stream.Capacity = STORE_BLOCK_BODY_SIZE * 8;
+    stream.Overflow = false;
+
+    if (block->Count) {
+        Encode(stream, series.Previous, series.PreviousDelta, r);
+    }
+
+    if (!block->Count || stream.Overflow || block->Count == UINT16_MAX) {
+        if (block->Count) {
+            if (series.Current + 1 == series.Blocks && Grow(series) < 0) {
+                return -1;
+            }
+            ++series.Current;
+            block = Block(series, series.Current);
+        }
+
+        ResetState(series.Previous, series.PreviousDelta, r.Time);
+        block->FirstTime = r.Time;
+        block->Bits = 0;
+        stream.Data = Body(block);
+        stream.Bits = 0;
+        stream.Overflow = false;
+        Encode(stream, series.Previous, series.PreviousDelta, r);
+    }
+
+    int32_t values[STORE_STAT_COLUMNS];
+    StatValues(r, values);
+    for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+        if (!block->Count || values[i] < block->Min[i]) {
+            block->Min[i] = values[i];
+        }
+        if (!block->Count || values[i] > block->Max[i]) {
+            block->Max[i] = values[i];
+        }
+        block->Sum[i] = block->Count ? block->Sum[i] + values[i] : values[i];
+    }
+
+    series.PreviousDelta = (int32_t)(r.Time - series.Previous.Time);
+    series.Previous = r;
+    block->LastTime = r.Time;
+    block->Bits = (uint16_t)stream.Bits;
+    __sync_synchronize(); // count last for concurrent readers
+    ++block->Count;
+    return 0;
+}
+
+uint32_t
+StoreSeries_LastTime(const StoreSeries& series) {
+    const StoreBlockHeader* block = Block(series, series.Current);
+    return block->Count ? block->LastTime : 0;
+}
+
+int
+StoreSeries_Sync(const StoreSeries& series) {
+    return msync(series.Map, series.MapSize, MS_SYNC);
+}
+
+void
+StoreSeries_Scan(const StoreSeries& series, uint32_t from, uint32_t to, Store_ReadingCallback callback, void* ctx) {
+    for (uint32_t b = 0; b <= series.Current && b < series.Blocks; ++b) {
+        StoreBlockHeader* block = Block(series, b);
+        if (!block->Count || block->LastTime < from || block->FirstTime >= to) {
+            continue;
+        }
+
+        Decoder decoder;
+        Decoder_Init(decoder, block);
+        for (uint16_t i = 0; i < block->Count; ++i) {
+            StoreReading reading;
+            Decoder_Next(decoder, reading);
+            if (reading.Time >= from && reading.Time < to) {
+                callback(ctx, reading);
+            }
+        }
+    }
+}
+
+void
+StoreAggregate_Init(StoreAggregate& aggregate) {
+    memset(&aggregate, 0, sizeof(aggregate));
+}
+
+static
+void
+AddTimeRange(StoreAggregate& aggregate, uint32_t first, uint32_t last) {
+    if (!aggregate.Count || first < aggregate.FirstTime) {
+        aggregate.FirstTime = first;
+    }
+    if (!aggregate.Count || last > aggregate.LastTime) {
+        aggregate.LastTime = last;
+    }
+}
+
+void
+StoreSeries_Aggregate(const StoreSeries& series, uint32_t from, uint32_t to, StoreAggregate& aggregate) {
+    for (uint32_t b = 0; b <= series.Current && b < series.Blocks; ++b) {
+        StoreBlockHeader* block = Block(series, b);
+        if (!block->Count || block->LastTime < from || block->FirstTime >= to) {
+            continue;
+        }
+
+        if (block->FirstTime >= from && block->LastTime < to) {
+            AddTimeRange(aggregate, block->FirstTime, block->LastTime);
+            for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+                if (!aggregate.Count || block->Min[i] < aggregate.Min[i]) {
+                    aggregate.Min[i] = block->Min[i];
+                }
+                if (!aggregate.Count || block->Max[i] > aggregate.Max[i]) {
+                    aggregate.Max[i] = block->Max[i];
+                }
+                aggregate.Sum[i] += block->Sum[i];
+            }
+            aggregate.Count += block->Count;
+            ++aggregate.BlocksSkipped;
+            continue;
+        }
+
+        Decoder decoder;
+        Decoder_Init(decoder, block);
+        for (uint16_t i = 0; i < block->Count; ++i) {
+            StoreReading reading;
+            Decoder_Next(decoder, reading);
+            if (reading.Time < from || reading.Time >= to) {
+                continue;
+            }
+
+            int32_t values[STORE_STAT_COLUMNS];
+            StatValues(reading, values);
+            AddTimeRange(aggregate, reading.Time, reading.Time);
+            for (uint8_t c = 0; c < STORE_STAT_COLUMNS; ++c) {
+                if (!aggregate.Count || values[c] < aggregate.Min[c]) {
+                    aggregate.Min[c] = values[c];
+                }
+                if (!aggregate.Count || values[c] > aggregate.Max[c]) {
+                    aggregate.Max[c] = values[c];
+                }
+                aggregate.Sum[c] += values[c];
+            }
+            ++aggregate.Count;
+        }
+        ++aggregate.BlocksDecoded;
+    }
+}
+
+static
+inline
+StoreRollupRow*
+Row(const StoreRollup& rollup, uint32_t index) {
+    return (StoreRollupRow*)(rollup.Map + STORE_HEADER_SIZE) + index;
+}
+
+static
+int
+MapRollup(StoreRollup& rollup, size_t size) {
+    if (rollup.Map) {
+        munmap(rollup.Map, rollup.MapSize);
+        rollup.Map = NULL;
+    }
+
+    const int prot = rollup.Writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* map = mmap(NULL, size, prot, MAP_SHARED, rollup.Fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    rollup.Map = (uint8_t*)map;
+    rollup.MapSize = size;
+    rollup.Capacity = (uint32_t)((size - STORE_HEADER_SIZE) / sizeof(StoreRollupRow));
+    return 0;
+}
+
+static
+int
+GrowRollup(StoreRollup& rollup, size_t size) {
+    if (ftruncate(rollup.Fd, (off_t)size) < 0) {
+        return -1;
+    }
+
+    return MapRollup(rollup, size);
+}
+
+/* Local time bucket of t. Hours are aligned to the UTC offset so they
+ * stay one hour long across DST changes, days and months follow the
+ * calendar.
+ */
+static
+void
+Bucket(uint8_t level, uint32_t t, uint32_t& start, uint32_t& end) {
+    const time_t now = (time_t)t;
+    struct tm brokenDown;
+    localtime_r(&now, &brokenDown);
+
+    if (level == STORE_ROLLUP_HOUR) {
+        const int64_t local = (int64_t)t + brokenDown.tm_gmtoff;
+        start = t - (uint32_t)(local % 3600);
+        end = start + 3600;
+        return;
+    }
+
+    brokenDown.tm_sec = 0;
+    brokenDown.tm_min = 0;
+    brokenDown.tm_hour = 0;
+    brokenDown.tm_isdst = -1;
+    if (level == STORE_ROLLUP_MONTH) {
+        brokenDown.tm_mday = 1;
+    }
+
+    struct tm next = brokenDown;
+    if (level == STORE_ROLLUP_MONTH) {
+        ++next.tm_mon;
+    } else {
+        ++next.tm_mday;
+    }
+
+    start = (uint32_t)mktime(&brokenDown);
+    end = (uint32_t)mktime(&next);
+    if (start > t) {
+        start = t;
+    }
+    if (end <= t) {
+        end = t + 1;
+    }
+}
+
+int
+Store_RollupPath(char* path, size_t size, const char* dir, const char* name, uint8_t level) {
+    char clean[STORE_NAME_SIZE];
+    const char* levelName = Store_RollupLevelName(level);
+    if (!levelName) {
+        return -1;
+    }
+    CleanName(clean, name);
+
+    const int bytes = snprintf(path, size, "%s/%s.%s" STORE_ROLLUP_EXTENSION, dir, clean, levelName);
+    return bytes < 0 || (size_t)bytes >= size ? -1 : 0;
+}
+
+const char*
+Store_RollupLevelName(uint8_t level) {
+    static const char* const s_Names[STORE_ROLLUP_LEVELS] = { "hour", "day", "month" };
+    return level < STORE_ROLLUP_LEVELS ? s_Names[level] : NULL;
+}
+
+int
+StoreRollup_Open(StoreRollup& rollup, const char* path, uint8_t level, bool writable) {
+    const size_t initialSize = STORE_HEADER_SIZE + STORE_ROLLUP_GROW_ROWS * sizeof(StoreRollupRow);
+    struct stat st;
+    int error = 0;
+
+    memset(&rollup, 0, sizeof(rollup));
+    rollup.Level = level;
+    rollup.Writable = writable;
+    rollup.Fd = safe_open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (rollup.Fd < 0) {
+        return -1;
+    }
+
+    if (fstat(rollup.Fd, &st) < 0) {
+        goto Error;
+    }
+
+    if (st.st_size == 0 && writable) {
+        StoreRollupHeader header;
+        memset(&header, 0, sizeof(header));
+        header.Magic = STORE_ROLLUP_MAGIC;
+        header.Version = STORE_ROLLUP_VERSION;
+        header.Level = level;
+        header.RowSize = sizeof(StoreRollupRow);
+
+        if (GrowRollup(rollup, initialSize) < 0) {
+            goto Error;
+        }
+        memcpy(rollup.Map, &header, sizeof(header));
+    } else {
+        if (st.st_size < (off_t)STORE_HEADER_SIZE ||
+            (st.st_size - STORE_HEADER_SIZE) % sizeof(StoreRollupRow)) {
+            errno = EPROTO;
+            goto Error;
+        }
+
+        if (MapRollup(rollup, (size_t)st.st_size) < 0) {
+            goto Error;
+        }
+
+        const StoreRollupHeader* header = (const StoreRollupHeader*)rollup.Map;
+        if (header->Magic != STORE_ROLLUP_MAGIC ||
+            header->Version != STORE_ROLLUP_VERSION ||
+            header->Level != level ||
+            header->RowSize != sizeof(StoreRollupRow)) {
+            errno = EPROTO;
+            goto Error;
+        }
+    }
+
+    // rows are used in order, unused ones have no readings
+    rollup.Rows = rollup.Capacity;
+    while (rollup.Rows && !Row(rollup, rollup.Rows - 1)->Count) {
+        --rollup.Rows;
+    }
+
+    return 0;
+
+Error:
+    error = errno;
+    StoreRollup_Close(rollup);
+    errno = error;
+    return -1;
+}
+
+void
+StoreRollup_Close(StoreRollup& rollup) {
+    if (rollup.Map) {
+        munmap(rollup.Map, rollup.MapSize);
+        rollup.Map = NULL;
+    }
+
+    safe_close_ref(&rollup.Fd);
+}
+
+int
+StoreRollup_Add(StoreRollup& rollup, const StoreReading& reading) {
+    if (!rollup.Writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    int32_t values[STORE_STAT_COLUMNS];
+    StatValues(reading, values);
+
+    StoreRollupHeader* header = (StoreRollupHeader*)rollup.Map;
+    if (reading.Time > header->LastTime) {
+        header->LastTime = reading.Time;
+    }
+
+    StoreRollupRow* row = rollup.Rows ? Row(rollup, rollup.Rows - 1) : NULL;
+    if (!row || reading.Time >= row->End) {
+        if (rollup.Rows == rollup.Capacity &&
+            GrowRollup(rollup, rollup.MapSize + STORE_ROLLUP_GROW_ROWS * sizeof(StoreRollupRow)) < 0) {
+            return -1;
+        }
+
+        row = Row(rollup, rollup.Rows);
+        Bucket(rollup.Level, reading.Time, row->Start, row->End);
+        for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+            row->Min[i] = values[i];
+            row->Max[i] = values[i];
+            row->Sum[i] = values[i];
+        }
+        row->FirstMilliVolts = reading.MilliVolts;
+        row->LastMilliVolts = reading.MilliVolts;
+        __sync_synchronize(); // count last for concurrent readers
+        row->Count = 1;
+        ++rollup.Rows;
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < STORE_STAT_COLUMNS; ++i) {
+        if (values[i] < row->Min[i]) {
+            row->Min[i] = values[i];
+        }
+        if (values[i] > row->Max[i]) {
+            row->Max[i] = values[i];
+        }
+        row->Sum[i] += values[i];
+    }
+    row->LastMilliVolts = reading.MilliVolts;
+    __sync_synchronize();
+    ++row->Count;
+    return 0;
+}
+
+uint32_t
+StoreRollup_LastTime(const StoreRollup& rollup) {
+    return ((const StoreRollupHeader*)rollup.Map)->LastTime;
+}
+
+int
+StoreRollup_Sync(const StoreRollup& rollup) {
+    return msync(rollup.Map, rollup.MapSize, MS_SYNC);
+}
+
+void
+StoreRollup_Scan(const StoreRollup& rollup, uint32_t from, uint32_t to, Store_RollupCallback callback, void* ctx) {
+    // rows are sorted, find the first one ending after from
+    uint32_t low = 0, high = rollup.Rows;
+    while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        if (Row(rollup, mid)->End <= from) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (uint32_t r = low; r < rollup.Rows; ++r) {
+        const StoreRollupRow* row = Row(rollup, r);
+        if (row->Start >= to) {
+            break;
+        }
+        if (row->Count) {
+            callback(ctx, *row);
+        }
+    }
+}
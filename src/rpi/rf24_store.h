@@ -0,0 +1,210 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RF24_STORE_H
+#define RF24_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append-only store for sensor readings, one file per sensor.
+ *
+ * A file is a header followed by fixed size blocks. Every block starts
+ * with a StoreBlockHeader which holds the time range, the reading count
+ * and min/max/sum of the value columns. Walking the headers is the block
+ * index: range queries skip blocks by time, aggregates over blocks that
+ * lie entirely within the range never decode the block body.
+ *
+ * The body is a bit stream of readings. Timestamps are stored as delta of
+ * delta, values as zig-zag encoded deltas to the previous reading and
+ * addresses as a repeat bit. The encoder state restarts with every block
+ * so blocks decode independently.
+ *
+ * Files are memory mapped and grown in chunks of STORE_GROW_BLOCKS.
+ * There is a single writer per file, readers may map it concurrently.
+ * Timestamps are kept monotonic per file.
+ *
+ * Next to every series there are rollup files with one row per local
+ * hour, day and month. Rows hold count, min/max/sum of the value columns
+ * and the first and last battery voltage of the bucket. The writer
+ * updates the last row as readings arrive so long range queries read
+ * rows instead of readings.
+ */
+
+#define STORE_MAGIC             0x31535742 /* WBS1 */
+#define STORE_VERSION           1
+#define STORE_FILE_EXTENSION    ".wbs"
+#define STORE_HEADER_SIZE       64
+#define STORE_BLOCK_SIZE        512
+#define STORE_GROW_BLOCKS       64
+#define STORE_NAME_SIZE         32
+
+/* value columns with block statistics */
+#define STORE_TEMPERATURE       0
+#define STORE_HUMIDITY          1
+#define STORE_MILLIVOLTS        2
+#define STORE_STAT_COLUMNS      3
+
+#define STORE_ROLLUP_MAGIC      0x31525742 /* WBR1 */
+#define STORE_ROLLUP_VERSION    1
+#define STORE_ROLLUP_EXTENSION  ".wbr"
+#define STORE_ROLLUP_GROW_ROWS  256
+
+/* rollup levels */
+#define STORE_ROLLUP_HOUR       0
+#define STORE_ROLLUP_DAY        1
+#define STORE_ROLLUP_MONTH      2
+#define STORE_ROLLUP_LEVELS     3
+
+struct StoreReading {
+    uint32_t Time; // seconds since the epoch
+    int16_t Temperature; // °C
+    int16_t Humidity; // %rH
+    uint16_t MilliVolts;
+    uint16_t RawHumidity;
+    uint8_t Sender;
+    uint8_t Via;
+};
+
+struct StoreBlockHeader {
+    uint32_t FirstTime;
+    uint32_t LastTime;
+    uint16_t Count;
+    uint16_t Bits; // used in the body
+    int32_t Min[STORE_STAT_COLUMNS];
+    int32_t Max[STORE_STAT_COLUMNS];
+    int32_t Sum[STORE_STAT_COLUMNS];
+};
+
+#define STORE_BLOCK_BODY_SIZE   (STORE_BLOCK_SIZE - sizeof(StoreBlockHeader))
+
+struct StoreRollupRow {
+    uint32_t Start; // first second of the bucket
+    uint32_t End; // first second of the next bucket
+    uint32_t Count;
+    int32_t Min[STORE_STAT_COLUMNS];
+    int32_t Max[STORE_STAT_COLUMNS];
+    int32_t Sum[STORE_STAT_COLUMNS];
+    uint16_t FirstMilliVolts;
+    uint16_t LastMilliVolts;
+};
+
+struct StoreAggregate {
+    uint32_t Count;
+    uint32_t FirstTime;
+    uint32_t LastTime;
+    int32_t Min[STORE_STAT_COLUMNS];
+    int32_t Max[STORE_STAT_COLUMNS];
+    int64_t Sum[STORE_STAT_COLUMNS];
+    uint32_t BlocksDecoded;
+    uint32_t BlocksSkipped; // answered from the block header
+};
+
+struct StoreSeries {
+    int Fd;
+    uint8_t* Map;
+    size_t MapSize;
+    uint32_t Blocks; // mapped
+    uint32_t Current; // index of the last block in use
+    bool Writable;
+    char Name[STORE_NAME_SIZE];
+    // encoder state of the current block
+    StoreReading Previous;
+    int32_t PreviousDelta;
+};
+
+struct StoreRollup {
+    int Fd;
+    uint8_t* Map;
+    size_t MapSize;
+    uint32_t Capacity; // mapped rows
+    uint32_t Rows; // in use
+    uint8_t Level;
+    bool Writable;
+};
+
+typedef void (*Store_ReadingCallback)(void* ctx, const StoreReading& reading);
+typedef void (*Store_RollupCallback)(void* ctx, const StoreRollupRow& row);
+
+/* Builds the file path for sensor name in directory dir. Names are
+ * reduced to [A-Za-z0-9_-], other characters become '_'.
+ * Returns 0 or -1 if path is too small.
+ */
+int Store_SeriesPath(char* path, size_t size, const char* dir, const char* name);
+
+/* Opens the file at path, creating it if writable. name is only used for
+ * new files. Returns 0 or -1 (errno, EPROTO for a file that isn't a
+ * store).
+ */
+int StoreSeries_Open(StoreSeries& series, const char* path, const char* name, bool writable);
+void StoreSeries_Close(StoreSeries& series);
+
+/* Appends a reading. Returns 0 or -1 (errno). */
+int StoreSeries_Append(StoreSeries& series, const StoreReading& reading);
+
+/* Time of the last reading, 0 if there are none. */
+uint32_t StoreSeries_LastTime(const StoreSeries& series);
+
+/* Writes the mapped file to disk. Returns 0 or -1 (errno). */
+int StoreSeries_Sync(const StoreSeries& series);
+
+/* Calls callback for every reading with from <= Time < to, in order. */
+void StoreSeries_Scan(const StoreSeries& series, uint32_t from, uint32_t to, Store_ReadingCallback callback, void* ctx);
+
+/* Adds the readings with from <= Time < to to aggregate. Clear aggregate
+ * with StoreAggregate_Init first.
+ */
+void StoreSeries_Aggregate(const StoreSeries& series, uint32_t from, uint32_t to, StoreAggregate& aggregate);
+void StoreAggregate_Init(StoreAggregate& aggregate);
+
+/* Builds the rollup file path for level, see Store_SeriesPath.
+ * Returns 0 or -1 if path is too small.
+ */
+int Store_RollupPath(char* path, size_t size, const char* dir, const char* name, uint8_t level);
+
+/* Name of level ("hour", "day", "month") or NULL. */
+const char* Store_RollupLevelName(uint8_t level);
+
+/* Opens the rollup file at path, creating it if writable. A new file
+ * has no rows, fill it from the series with StoreRollup_Add.
+ * Returns 0 or -1 (errno, EPROTO for a file that isn't a rollup of
+ * level).
+ */
+int StoreRollup_Open(StoreRollup& rollup, const char* path, uint8_t level, bool writable);
+void StoreRollup_Close(StoreRollup& rollup);
+
+/* Adds a reading to its bucket. Readings older than the last bucket are
+ * counted in the last bucket. Returns 0 or -1 (errno).
+ */
+int StoreRollup_Add(StoreRollup& rollup, const StoreReading& reading);
+
+/* Time of the latest reading added, 0 if there are none. */
+uint32_t StoreRollup_LastTime(const StoreRollup& rollup);
+
+/* Writes the mapped file to disk. Returns 0 or -1 (errno). */
+int StoreRollup_Sync(const StoreRollup& rollup);
+
+/* Calls callback for every row that overlaps from <= Time < to, in order. */
+void StoreRollup_Scan(const StoreRollup& rollup, uint32_t from, uint32_t to, Store_RollupCallback callback, void* ctx);
+
+#endif // RF24_STORE_H
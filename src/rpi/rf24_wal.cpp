@@ -0,0 +1,279 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "rf24_wal.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linuxapi/linuxapi.h>
+
+
+struct WalFileHeader {
+    uint32_t Magic;
+    uint8_t Version;
+    uint8_t Reserved[3];
+};
+
+struct WalRecordHeader {
+    uint32_t Crc; // over the rest of the header and the payload
+    uint32_t Sequence;
+    uint32_t Time;
+    uint16_t Length;
+    uint16_t Reserved;
+};
+
+static
+uint32_t
+Crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    // reflected 0x04c11db7, a nibble at a time
+    static const uint32_t s_Table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = (crc >> 4) ^ s_Table[(crc ^ data[i]) & 0xf];
+        crc = (crc >> 4) ^ s_Table[(crc ^ (data[i] >> 4)) & 0xf];
+    }
+    return ~crc;
+}
+
+static
+uint32_t
+RecordCrc(const WalRecordHeader& header, const uint8_t* payload) {
+    const uint8_t* rest = (const uint8_t*)&header + sizeof(header.Crc);
+    return Crc32(Crc32(0, rest, sizeof(header) - sizeof(header.Crc)), payload, header.Length);
+}
+
+static
+int
+WriteAll(int fd, const uint8_t* data, size_t size) {
+    while (size) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+/* Calls callback for the records in data and returns the size of the
+ * valid prefix.
+ */
+static
+size_t
+Parse(const uint8_t* data, size_t size, Wal_RecordCallback callback, void* ctx, uint32_t* sequence) {
+    size_t offset = 0;
+    while (size - offset >= sizeof(WalRecordHeader)) {
+        WalRecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.Length > WAL_MAX_PAYLOAD ||
+            size - offset - sizeof(header) < header.Length ||
+            RecordCrc(header, data + offset + sizeof(header)) != header.Crc) {
+            break;
+        }
+
+        if (callback) {
+            WalRecord record;
+            record.Sequence = header.Sequence;
+            record.Time = header.Time;
+            record.Length = header.Length;
+            record.Payload = data + offset + sizeof(header);
+            callback(ctx, record);
+        }
+
+        if (sequence) {
+            *sequence = header.Sequence + 1;
+        }
+        offset += sizeof(header) + header.Length;
+    }
+    return offset;
+}
+
+int
+Wal_Open(Wal& wal, const char* path, Wal_RecordCallback callback, void* ctx) {
+    uint8_t* data = NULL;
+    size_t valid = 0;
+    ssize_t bytes = 0;
+    struct stat st;
+    int error = 0;
+
+    memset(&wal, 0, sizeof(wal));
+    wal.Callback = callback;
+    wal.Ctx = ctx;
+    wal.Fd = safe_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (wal.Fd < 0) {
+        return -1;
+    }
+
+    if (fstat(wal.Fd, &st) < 0) {
+        goto Error;
+    }
+
+    if (st.st_size == 0) {
+        WalFileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.Magic = WAL_MAGIC;
+        header.Version = WAL_VERSION;
+        if (WriteAll(wal.Fd, (const uint8_t*)&header, sizeof(header)) < 0 ||
+            fdatasync(wal.Fd) < 0) {
+            goto Error;
+        }
+        wal.Size = sizeof(header);
+        return 0;
+    }
+
+    if (st.st_size < (off_t)sizeof(WalFileHeader)) {
+        errno = EPROTO;
+        goto Error;
+    }
+
+    data = (uint8_t*)malloc((size_t)st.st_size);
+    if (!data) {
+        goto Error;
+    }
+
+    bytes = pread(wal.Fd, data, (size_t)st.st_size, 0);
+    if (bytes != st.st_size) {
+        if (bytes >= 0) {
+            errno = EIO;
+        }
+        goto Error;
+    }
+
+    WalFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.Magic != WAL_MAGIC || header.Version != WAL_VERSION) {
+        errno = EPROTO;
+        goto Error;
+    }
+
+    valid = sizeof(header) + Parse(data + sizeof(header), (size_t)st.st_size - sizeof(header), callback, ctx, &wal.Sequence);
+    free(data);
+    data = NULL;
+
+    // cut off a record torn by power loss
+    if (valid < (size_t)st.st_size &&
+        (ftruncate(wal.Fd, (off_t)valid) < 0 || fdatasync(wal.Fd) < 0)) {
+        goto Error;
+    }
+
+    if (lseek(wal.Fd, (off_t)valid, SEEK_SET) < 0) {
+        goto Error;
+    }
+
+    wal.Size = (uint32_t)valid;
+    return 0;
+
+Error:
+    error = errno;
+    free(data);
+    safe_close_ref(&wal.Fd);
+    errno = error;
+    return -1;
+}
+
+void
+Wal_Close(Wal& wal) {
+    if (wal.Fd >= 0) {
+        Wal_Commit(wal);
+    }
+
+    safe_close_ref(&wal.Fd);
+}
+
+int
+Wal_Append(Wal& wal, uint32_t time, const uint8_t* payload, uint16_t length) {
+    if (length > WAL_MAX_PAYLOAD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    WalRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.Sequence = wal.Sequence;
+    header.Time = time;
+    header.Length = length;
+    header.Crc = RecordCrc(header, payload);
+
+    if (wal.Used + sizeof(header) + length > sizeof(wal.Buffer) &&
+        Wal_Commit(wal) < 0) {
+        return -1;
+    }
+
+    memcpy(wal.Buffer + wal.Used, &header, sizeof(header));
+    memcpy(wal.Buffer + wal.Used + sizeof(header), payload, length);
+    wal.Used += sizeof(header) + length;
+    ++wal.Pending;
+    ++wal.Sequence;
+    return 0;
+}
+
+int
+Wal_Commit(Wal& wal) {
+    if (!wal.Pending) {
+        return 0;
+    }
+
+    if (WriteAll(wal.Fd, wal.Buffer, wal.Used) < 0 ||
+        fdatasync(wal.Fd) < 0) {
+        // rewrite the whole group next time
+        const int error = errno;
+        if (ftruncate(wal.Fd, wal.Size) == 0) {
+            lseek(wal.Fd, wal.Size, SEEK_SET);
+        }
+        errno = error;
+        return -1;
+    }
+
+    wal.Size += wal.Used;
+    wal.BytesWritten += wal.Used;
+    ++wal.Commits;
+
+    Parse(wal.Buffer, wal.Used, wal.Callback, wal.Ctx, NULL);
+    wal.Pending = 0;
+    wal.Used = 0;
+    return 0;
+}
+
+int
+Wal_Reset(Wal& wal) {
+    if (ftruncate(wal.Fd, sizeof(WalFileHeader)) < 0 ||
+        lseek(wal.Fd, sizeof(WalFileHeader), SEEK_SET) < 0 ||
+        fdatasync(wal.Fd) < 0) {
+        return -1;
+    }
+
+    wal.Size = sizeof(WalFileHeader);
+    return 0;
+}
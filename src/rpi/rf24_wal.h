@@ -0,0 +1,96 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2016, 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RF24_WAL_H
+#define RF24_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Write ahead log for received payloads.
+ *
+ * Records are appended to a memory buffer and written with a single
+ * write and fdatasync per group commit. Only committed records are handed
+ * downstream, so nothing is emitted that would be lost on power failure.
+ *
+ * A file is a WalFileHeader followed by records. Every record is a
+ * WalRecordHeader, which carries a CRC-32 over the rest of the header and
+ * the payload, followed by the payload. Opening a log replays the valid
+ * records and cuts off a torn tail. Once downstream has made the records
+ * durable, Wal_Reset empties the log (checkpoint).
+ */
+
+#define WAL_MAGIC               0x314c5742 /* WBL1 */
+#define WAL_VERSION             1
+#define WAL_MAX_PAYLOAD         256
+#define WAL_BUFFER_SIZE         8192
+#define WAL_CHECKPOINT_SIZE     (64 * 1024)
+
+struct WalRecord {
+    uint32_t Sequence;
+    uint32_t Time; // seconds since the epoch
+    uint16_t Length;
+    const uint8_t* Payload;
+};
+
+typedef void (*Wal_RecordCallback)(void* ctx, const WalRecord& record);
+
+struct Wal {
+    int Fd;
+    Wal_RecordCallback Callback; // downstream
+    void* Ctx;
+    uint32_t Sequence; // of the next record
+    uint32_t Size; // of the file
+    uint32_t Pending; // records in Buffer
+    uint32_t Used; // bytes in Buffer
+    uint8_t Buffer[WAL_BUFFER_SIZE];
+    // counters
+    uint64_t BytesWritten;
+    uint32_t Commits;
+};
+
+/* Opens the log at path, creating it if needed, and calls callback for
+ * every record found, in order. Later commits call it, too.
+ * Returns 0 or -1 (errno, EPROTO for a file that isn't a log).
+ */
+int Wal_Open(Wal& wal, const char* path, Wal_RecordCallback callback, void* ctx);
+
+/* Commits pending records and closes the log. */
+void Wal_Close(Wal& wal);
+
+/* Buffers a record, committing first if the buffer is full.
+ * Returns 0 or -1 (errno, EINVAL if length exceeds WAL_MAX_PAYLOAD).
+ */
+int Wal_Append(Wal& wal, uint32_t time, const uint8_t* payload, uint16_t length);
+
+/* Writes and syncs pending records, then calls the callback for each of
+ * them. Returns 0 or -1 (errno). Records stay pending on failure.
+ */
+int Wal_Commit(Wal& wal);
+
+/* Empties the log. Call once the committed records are durable downstream.
+ * Returns 0 or -1 (errno).
+ */
+int Wal_Reset(Wal& wal);
+
+#endif // RF24_WAL_H
@@ -0,0 +1,65 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Route lookups with BATMAN_TABLE (next hop cache) and BATMAN_LIST
+ * (originator list, neighbor selection per lookup), see CMakeLists.txt.
+ */
+
+#include <stdlib.h>
+
+#include "check.h"
+#include "batman_helpers.h"
+
+#ifndef ORIGINATORS
+#   define ORIGINATORS 32
+#endif
+#define NEIGHBORS 4
+#define LOOKUPS 4000000
+
+int
+main() {
+    StartBatman();
+
+    for (uint8_t o = 0; o < ORIGINATORS; ++o) {
+        for (uint8_t n = 0; n < NEIGHBORS; ++n) {
+            for (uint16_t s = 0; s <= n; ++s) { // later neighbors rank higher
+                AddRoute(100 + o, 10 + n, s);
+            }
+        }
+    }
+
+    uint32_t sum = 0;
+    const uint64_t start = NowNs();
+    for (uint32_t i = 0; i < LOOKUPS; ++i) {
+        sum += Batman_Route(100 + i % ORIGINATORS);
+    }
+    const uint64_t ns = NowNs() - start;
+
+    CHECK(Batman_Route(100) == 10 + NEIGHBORS - 1);
+    printf("%u originators, %u neighbors each: %.1f ns per route lookup (%u)\n",
+           ORIGINATORS, NEIGHBORS, (double)ns / LOOKUPS, sum);
+
+    Batman_Uninit();
+    Time_Uninit();
+    return s_Failures;
+}
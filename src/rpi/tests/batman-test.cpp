@@ -0,0 +1,91 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include "batman_helpers.h"
+
+#define PURGE_TIMEOUT (10ul*16*NETWORK_PERIOD) // BATMAN_PURGE_TIMEOUT
+
+static
+void
+TestRoutes() {
+    AddRoute(3, 2, 100);
+    CHECK(Batman_Route(3) == 2);
+    CHECK(Batman_Route(4) == NETWORK_BROADCAST_ADDRESS);
+
+    // 3 stays known through a node that isn't a link, 2 goes silent and
+    // Batman_Update (the sweep) doesn't run
+    uint16_t sequenceNumber = 101;
+    uint32_t elapsed = 0;
+    while (elapsed < PURGE_TIMEOUT - NETWORK_PERIOD) {
+        Advance(NETWORK_PERIOD);
+        elapsed += NETWORK_PERIOD;
+        ReceiveOgm(4, 3, sequenceNumber++, 0);
+    }
+    CHECK(Batman_Route(3) == 2);
+
+    Advance(2 * NETWORK_PERIOD);
+    ReceiveOgm(4, 3, sequenceNumber++, 0);
+    CHECK(Batman_Route(3) == NETWORK_BROADCAST_ADDRESS);
+
+    // a new link is picked up again
+    AddRoute(3, 5, sequenceNumber++);
+    CHECK(Batman_Route(3) == 5);
+
+    // the whole originator times out without a sweep
+    Advance(PURGE_TIMEOUT + 1);
+    CHECK(Batman_Route(3) == NETWORK_BROADCAST_ADDRESS);
+}
+
+#ifdef POOL_STATIC
+static
+void
+TestEviction() {
+    // a full originator pool makes room by evicting the stalest entry
+    Batman_Uninit();
+    Batman_Init();
+    AddRoute(3, 2, 100);
+    for (uint8_t originator = 10; originator < 10 + BATMAN_POOL_ORIGINATORS; ++originator) {
+        Advance(NETWORK_PERIOD);
+        ReceiveOgm(2, MY_ADDRESS, s_LastOwnOgm, 1);
+        ReceiveOgm(2, originator, 100, 0);
+        CHECK(Batman_Route(originator) == 2);
+    }
+    CHECK(Batman_Route(3) == NETWORK_BROADCAST_ADDRESS);
+    CHECK(Batman_Route(10 + BATMAN_POOL_ORIGINATORS - 2) == 2);
+}
+#endif
+
+int
+main() {
+    StartBatman();
+
+    TestRoutes();
+#ifdef POOL_STATIC
+    TestEviction();
+#endif
+
+    Batman_Uninit();
+    Time_Uninit();
+    return s_Failures;
+}
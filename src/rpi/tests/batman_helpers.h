@@ -0,0 +1,114 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Helpers to drive Batman.c with OGMs from made up nodes. */
+
+#ifndef BATMAN_HELPERS_H
+#define BATMAN_HELPERS_H
+
+#include <string.h>
+
+#include "../../Network.h"
+#include "../../Batman.h"
+#include "../../Time.h"
+
+#define MY_ADDRESS 1
+
+// same layout as Batman_OGM_Payload
+struct Ogm {
+    uint8_t Sender;
+    uint8_t Originator;
+    uint8_t IsDirectLink;
+    uint8_t UniDirectional;
+    uint16_t SequenceNumber;
+};
+
+static uint16_t s_LastOwnOgm;
+
+static
+inline
+void
+CaptureSend(NetworkPacket* packet) {
+    Ogm ogm;
+    memcpy(&ogm, packet->Payload, sizeof(ogm));
+    if (ogm.Originator == MY_ADDRESS) {
+        s_LastOwnOgm = ogm.SequenceNumber;
+    }
+}
+
+static
+inline
+void
+ReceiveOgm(uint8_t sender, uint8_t originator, uint16_t sequenceNumber, uint8_t directLink) {
+    NetworkPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.TTL = 8;
+    Ogm ogm;
+    ogm.Sender = sender;
+    ogm.Originator = originator;
+    ogm.IsDirectLink = directLink;
+    ogm.UniDirectional = 0;
+    ogm.SequenceNumber = sequenceNumber;
+    memcpy(packet.Payload, &ogm, sizeof(ogm));
+    Batman_Process(&packet);
+}
+
+static
+inline
+void
+Advance(uint32_t milliseconds) {
+    while (milliseconds) {
+        const uint16_t step = milliseconds > 60000 ? 60000 : (uint16_t)milliseconds;
+        Time_Update(step);
+        milliseconds -= step;
+    }
+}
+
+/* Starts Batman and moves its OGM sequence past the bidirectional link
+ * window so only neighbors that echo our OGM count as links.
+ */
+static
+inline
+void
+StartBatman() {
+    Network_SetAddress(MY_ADDRESS);
+    Network_SetTtl(8);
+    Network_SetSendCallback(CaptureSend);
+    Time_Init();
+    Batman_Init();
+    for (uint8_t i = 0; i < 16; ++i) {
+        Advance(NETWORK_PERIOD);
+        Batman_Update();
+    }
+}
+
+/* Makes neighbor a bidirectional link and lets it announce originator. */
+static
+inline
+void
+AddRoute(uint8_t originator, uint8_t neighbor, uint16_t sequenceNumber) {
+    ReceiveOgm(neighbor, MY_ADDRESS, s_LastOwnOgm, 1);
+    ReceiveOgm(neighbor, originator, sequenceNumber, 0);
+}
+
+#endif // BATMAN_HELPERS_H
@@ -0,0 +1,88 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+
+#include <linuxapi/linuxapi.h>
+
+#include <unistd.h>
+
+#define WORKERS EPOLL_LOOP_MAX_WORKERS
+#define DURATION UINT64_C(3000000000) // ns
+#define MAX_HANDLE 20000
+
+static volatile int s_Dispatched;
+
+static
+void
+OnReadable(void*, epoll_event*) {
+    __atomic_add_fetch(&s_Dispatched, 1, __ATOMIC_RELAXED);
+}
+
+// Workers dispatch a pipe that never drains while the main thread, which
+// isn't a worker, keeps growing and freeing the callback table, then
+// stops the workers mid dispatch. Run under address sanitizer this guards
+// against workers touching a table after it was freed. The race is
+// narrow, a single run doesn't always hit it.
+int
+main() {
+    const uint64_t start = NowNs();
+    while (NowNs() - start < DURATION) {
+        int pipes[WORKERS][2];
+
+        CHECK(epoll_loop_create_workers(WORKERS) >= 0);
+
+        for (int i = 0; i < WORKERS; ++i) {
+            CHECK(pipe(pipes[i]) == 0);
+            CHECK(write(pipes[i][1], "x", 1) == 1);
+
+            epoll_callback_data data;
+            data.ctx = NULL;
+            data.callback = OnReadable;
+            CHECK(epoll_loop_set_callback(pipes[i][0], data) == 0);
+
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = pipes[i][0];
+            CHECK(epoll_ctl(epoll_loop_get_worker_fd(i), EPOLL_CTL_ADD, pipes[i][0], &ev) == 0);
+        }
+
+        epoll_callback_data none;
+        none.ctx = NULL;
+        none.callback = NULL;
+        for (int handle = 64; handle < MAX_HANDLE; handle += handle / 2) {
+            CHECK(epoll_loop_set_callback(handle, none) == 0);
+        }
+
+        epoll_loop_destroy();
+
+        for (int i = 0; i < WORKERS; ++i) {
+            close(pipes[i][0]);
+            close(pipes[i][1]);
+        }
+    }
+
+    CHECK(s_Dispatched > 0);
+
+    return s_Failures;
+}
@@ -0,0 +1,198 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Splitting the rf24-network binary protocol byte stream into frames. */
+
+#include <string.h>
+#include <vector>
+
+#include "check.h"
+#include "../rf24_ipc.h"
+
+struct Frame {
+    IpcHeader Header;
+    std::vector<uint8_t> Payload;
+};
+
+static std::vector<Frame> s_Frames;
+
+static
+void
+Collect(void*, const IpcHeader& header, const uint8_t* payload) {
+    Frame frame;
+    frame.Header = header;
+    frame.Payload.assign(payload, payload + header.Length);
+    s_Frames.push_back(frame);
+}
+
+// Appends a frame whose payload bytes count up from first
+static
+void
+Append(std::vector<uint8_t>& stream, uint8_t type, uint16_t id, uint16_t length, uint8_t first) {
+    uint8_t payload[RF24_IPC_MAX_PAYLOAD];
+    uint8_t frame[RF24_IPC_MAX_FRAME];
+    for (uint16_t i = 0; i < length; ++i) {
+        payload[i] = static_cast<uint8_t>(first + i);
+    }
+
+    const size_t bytes = IpcEncode(frame, type, id, payload, length);
+    stream.insert(stream.end(), frame, frame + bytes);
+}
+
+static
+bool
+IsFrame(const Frame& frame, uint8_t type, uint16_t id, uint16_t length, uint8_t first) {
+    if (frame.Header.Type != type || frame.Header.Id != id ||
+        frame.Header.Length != length || frame.Payload.size() != length) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < length; ++i) {
+        if (frame.Payload[i] != static_cast<uint8_t>(first + i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Feeds stream in reads of at most chunk bytes, keeping what isn't
+// consumed like rf24-network does. Returns the bytes left over or -1.
+static
+ssize_t
+Feed(const std::vector<uint8_t>& stream, size_t chunk) {
+    std::vector<uint8_t> input;
+    for (size_t i = 0; i < stream.size(); i += chunk) {
+        const size_t end = i + chunk < stream.size() ? i + chunk : stream.size();
+        input.insert(input.end(), stream.begin() + i, stream.begin() + end);
+
+        const ssize_t consumed = IpcParseFrames(&input[0], input.size(), Collect, NULL);
+        if (consumed < 0) {
+            return -1;
+        }
+
+        CHECK(input.size() - consumed < RF24_IPC_MAX_FRAME);
+        input.erase(input.begin(), input.begin() + consumed);
+    }
+
+    return static_cast<ssize_t>(input.size());
+}
+
+static
+void
+TestSingleFrames() {
+    std::vector<uint8_t> stream;
+    Append(stream, RF24_IPC_HELLO, 1, 0, 0);
+    Append(stream, RF24_IPC_ROUTE, 2, RF24_IPC_MAX_PAYLOAD, 0);
+
+    s_Frames.clear();
+    CHECK(Feed(stream, RF24_IPC_HEADER_SIZE) == 0);
+    CHECK(s_Frames.size() == 2);
+    if (s_Frames.size() == 2) {
+        CHECK(IsFrame(s_Frames[0], RF24_IPC_HELLO, 1, 0, 0));
+        CHECK(IsFrame(s_Frames[1], RF24_IPC_ROUTE, 2, RF24_IPC_MAX_PAYLOAD, 0));
+    }
+}
+
+static
+void
+TestSplitReads() {
+    std::vector<uint8_t> stream;
+    for (uint16_t i = 0; i < 8; ++i) {
+        Append(stream, RF24_IPC_ROUTE, i, static_cast<uint16_t>(i * 32), static_cast<uint8_t>(i));
+    }
+
+    // every split point, headers and payloads cut anywhere
+    const size_t chunks[] = { 1, 3, 7, 9, 64, 300 };
+    for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+        s_Frames.clear();
+        CHECK(Feed(stream, chunks[c]) == 0);
+        CHECK(s_Frames.size() == 8);
+        for (size_t i = 0; i < s_Frames.size() && i < 8; ++i) {
+            CHECK(IsFrame(s_Frames[i], RF24_IPC_ROUTE, static_cast<uint16_t>(i), static_cast<uint16_t>(i * 32), static_cast<uint8_t>(i)));
+        }
+    }
+
+    // a partial frame is kept, not delivered
+    stream.pop_back();
+    s_Frames.clear();
+    CHECK(Feed(stream, 512) == RF24_IPC_HEADER_SIZE + 7 * 32 - 1);
+    CHECK(s_Frames.size() == 7);
+}
+
+static
+void
+TestManyFramesPerRead() {
+    std::vector<uint8_t> stream;
+    for (uint16_t i = 0; i < 100; ++i) {
+        Append(stream, RF24_IPC_TIME, i, 0, 0);
+    }
+    Append(stream, RF24_IPC_SUBSCRIBE, 100, 3, 0x10);
+
+    s_Frames.clear();
+    CHECK(IpcParseFrames(&stream[0], stream.size(), Collect, NULL) == static_cast<ssize_t>(stream.size()));
+    CHECK(s_Frames.size() == 101);
+    for (size_t i = 0; i < s_Frames.size() && i < 100; ++i) {
+        CHECK(IsFrame(s_Frames[i], RF24_IPC_TIME, static_cast<uint16_t>(i), 0, 0));
+    }
+    if (s_Frames.size() == 101) {
+        CHECK(IsFrame(s_Frames[100], RF24_IPC_SUBSCRIBE, 100, 3, 0x10));
+    }
+}
+
+static
+void
+TestInvalid() {
+    std::vector<uint8_t> stream;
+    Append(stream, RF24_IPC_TIME, 1, 0, 0);
+    Append(stream, RF24_IPC_ROUTE, 2, 1, 0);
+
+    // length one past the limit, rejected on the header alone
+    std::vector<uint8_t> oversize(stream);
+    oversize[RF24_IPC_HEADER_SIZE + 6] = static_cast<uint8_t>(RF24_IPC_MAX_PAYLOAD + 1);
+    oversize[RF24_IPC_HEADER_SIZE + 7] = static_cast<uint8_t>((RF24_IPC_MAX_PAYLOAD + 1) >> 8);
+    s_Frames.clear();
+    CHECK(IpcParseFrames(&oversize[0], RF24_IPC_HEADER_SIZE * 2, Collect, NULL) < 0);
+    CHECK(Feed(oversize, 1) < 0);
+
+    std::vector<uint8_t> magic(stream);
+    magic[RF24_IPC_HEADER_SIZE] = 'T';
+    CHECK(IpcParseFrames(&magic[0], magic.size(), Collect, NULL) < 0);
+
+    std::vector<uint8_t> version(stream);
+    version[RF24_IPC_HEADER_SIZE + 1] = RF24_IPC_VERSION + 1;
+    CHECK(IpcParseFrames(&version[0], version.size(), Collect, NULL) < 0);
+
+    // a partial header isn't judged yet
+    CHECK(IpcParseFrames(&magic[RF24_IPC_HEADER_SIZE], RF24_IPC_HEADER_SIZE - 1, Collect, NULL) == 0);
+}
+
+int
+main() {
+    TestSingleFrames();
+    TestSplitReads();
+    TestManyFramesPerRead();
+    TestInvalid();
+
+    return s_Failures;
+}
@@ -0,0 +1,261 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Output queue of a slow client on a loopback TCP connection whose
+ * send buffer is kept full. Unlike AF_UNIX sockets TCP takes part of a
+ * record when there is little room left.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <vector>
+
+#include "check.h"
+#include "../rf24_output.h"
+
+#define RECORD_SIZE 200
+#define CAPACITY 4
+
+static int s_Pair[2]; // [0] client end, [1] rf24-network end
+
+static
+void
+OpenPair() {
+    sockaddr_in sa;
+    socklen_t length = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(listener >= 0);
+    CHECK(bind(listener, (sockaddr*)&sa, sizeof(sa)) == 0);
+    CHECK(listen(listener, 1) == 0);
+    CHECK(getsockname(listener, (sockaddr*)&sa, &length) == 0);
+
+    s_Pair[1] = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(s_Pair[1] >= 0);
+    int size = 4096;
+    CHECK(setsockopt(s_Pair[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == 0);
+    CHECK(connect(s_Pair[1], (sockaddr*)&sa, sizeof(sa)) == 0);
+    s_Pair[0] = accept(listener, NULL, NULL);
+    CHECK(s_Pair[0] >= 0);
+    close(listener);
+
+    CHECK(setsockopt(s_Pair[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == 0);
+    CHECK(fcntl(s_Pair[0], F_SETFL, O_NONBLOCK) == 0);
+    CHECK(fcntl(s_Pair[1], F_SETFL, O_NONBLOCK) == 0);
+}
+
+// Reads what arrives at the client end until it goes quiet
+static
+void
+Read(std::vector<uint8_t>& stream) {
+    pollfd pfd;
+    pfd.fd = s_Pair[0];
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, 100) == 1) {
+        uint8_t buffer[1024];
+        ssize_t r = read(s_Pair[0], buffer, sizeof(buffer));
+        if (r <= 0) {
+            break;
+        }
+        stream.insert(stream.end(), buffer, buffer + r);
+    }
+}
+
+static
+void
+ClosePair() {
+    close(s_Pair[0]);
+    close(s_Pair[1]);
+}
+
+// Records carry their sequence number in every byte
+static
+int
+Send(OutputQueue* queue, unsigned sequence) {
+    uint8_t record[RECORD_SIZE];
+    memset(record, static_cast<uint8_t>(sequence), sizeof(record));
+    return OutputQueue_Send(queue, s_Pair[1], record, sizeof(record));
+}
+
+// Flushes the queue until it is empty, returns what the client got
+static
+std::vector<uint8_t>
+Drain(OutputQueue* queue) {
+    std::vector<uint8_t> stream;
+    for (int drained = 0; !drained; ) {
+        drained = OutputQueue_Flush(queue, s_Pair[1]);
+        CHECK(drained >= 0);
+        if (drained < 0) {
+            break;
+        }
+        Read(stream);
+    }
+
+    return stream;
+}
+
+// Returns the sequence numbers of the whole records in stream, or an
+// empty list if a record is torn
+static
+std::vector<unsigned>
+Records(const std::vector<uint8_t>& stream) {
+    std::vector<unsigned> sequences;
+    if (stream.size() % RECORD_SIZE) {
+        return sequences;
+    }
+
+    for (size_t i = 0; i < stream.size(); i += RECORD_SIZE) {
+        for (size_t j = 1; j < RECORD_SIZE; ++j) {
+            if (stream[i + j] != stream[i]) {
+                sequences.clear();
+                return sequences;
+            }
+        }
+        sequences.push_back(stream[i]);
+    }
+
+    return sequences;
+}
+
+static
+void
+TestInOrder() {
+    OpenPair();
+    OutputQueue* queue = OutputQueue_Create(CAPACITY);
+    CHECK(queue);
+
+    // the socket takes what it can, then the queue fills
+    unsigned sequence = 0;
+    while (!queue->Count) {
+        CHECK(Send(queue, sequence++) == 1);
+    }
+    while (queue->Count < CAPACITY) {
+        CHECK(Send(queue, sequence++) == 1);
+    }
+
+    const std::vector<unsigned> records = Records(Drain(queue));
+    CHECK(records.size() == sequence);
+    for (unsigned i = 0; i < records.size(); ++i) {
+        CHECK(records[i] == static_cast<uint8_t>(i));
+    }
+    CHECK(!queue->Count && !queue->Dropped);
+
+    OutputQueue_Destroy(queue);
+    ClosePair();
+}
+
+static
+void
+TestOverflow() {
+    OpenPair();
+    OutputQueue* queue = OutputQueue_Create(CAPACITY);
+    CHECK(queue);
+
+    // stop on a record the socket took only part of
+    std::vector<uint8_t> stream;
+    unsigned sequence = 0;
+    while (!queue->Count || !queue->Offset) {
+        if (queue->Count) {
+            // whole records went in, make room and try again
+            std::vector<uint8_t> drained = Drain(queue);
+            stream.insert(stream.end(), drained.begin(), drained.end());
+        }
+        CHECK(Send(queue, sequence++) == 1);
+        if (sequence == 100000) {
+            CHECK(!"the socket never took part of a record");
+            OutputQueue_Destroy(queue);
+            ClosePair();
+            return;
+        }
+    }
+    const unsigned started = sequence - 1;
+
+    while (queue->Count < CAPACITY) {
+        CHECK(Send(queue, sequence++) == 1);
+    }
+
+    // full, nothing is written or queued
+    const unsigned head = queue->Head;
+    CHECK(Send(queue, sequence) == 0);
+    CHECK(queue->Count == CAPACITY && queue->Head == head);
+
+    // the started record stays, the next one goes
+    OutputQueue_DropOldest(queue);
+    CHECK(queue->Dropped == 1);
+    CHECK(queue->Offset);
+    CHECK(Send(queue, sequence++) == 1);
+    CHECK(queue->Count == CAPACITY);
+
+    std::vector<uint8_t> drained = Drain(queue);
+    stream.insert(stream.end(), drained.begin(), drained.end());
+    CHECK(!queue->Count);
+
+    // no record is torn, only the one after the started record is missing
+    const std::vector<unsigned> records = Records(stream);
+    CHECK(records.size() == sequence - 1);
+    for (unsigned i = 0; i < records.size(); ++i) {
+        const unsigned expected = i <= started ? i : i + 1;
+        CHECK(records[i] == static_cast<uint8_t>(expected));
+    }
+
+    OutputQueue_Destroy(queue);
+    ClosePair();
+}
+
+static
+void
+TestErrors() {
+    CHECK(!OutputQueue_Create(1));
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, s_Pair) == 0);
+    OutputQueue* queue = OutputQueue_Create(CAPACITY);
+    CHECK(queue);
+
+    close(s_Pair[0]);
+    CHECK(Send(queue, 0) < 0);
+    CHECK(errno == EPIPE);
+
+    OutputQueue_Destroy(queue);
+    close(s_Pair[1]);
+}
+
+int
+main() {
+    signal(SIGPIPE, SIG_IGN);
+
+    TestInOrder();
+    TestOverflow();
+    TestErrors();
+
+    return s_Failures;
+}
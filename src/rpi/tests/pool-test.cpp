@@ -0,0 +1,140 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <vector>
+
+#include "check.h"
+#include "../../Pool.h"
+
+#define BLOCKS 4
+
+struct Item {
+    uint32_t Value;
+    uint8_t Data[10];
+};
+
+POOL_DEFINE(s_Pool, sizeof(Item), BLOCKS);
+
+static
+void
+TestCapacity() {
+    POOL_INIT(s_Pool, "test", sizeof(Item), BLOCKS);
+    CHECK(s_Pool.BlockSize >= sizeof(Item));
+    CHECK(s_Pool.BlockSize % sizeof(void*) == 0);
+
+    // alloc to capacity, distinct blocks
+    std::vector<Item*> items;
+    for (int i = 0; i < BLOCKS; ++i) {
+        Item* item = (Item*)Pool_Alloc(&s_Pool);
+        CHECK(item);
+        for (size_t j = 0; j < items.size(); ++j) {
+            CHECK(item != items[j]);
+        }
+        items.push_back(item);
+    }
+    CHECK(s_Pool.Used == BLOCKS);
+    CHECK(s_Pool.Capacity == BLOCKS);
+    CHECK(s_Pool.HighWater == BLOCKS);
+    CHECK(s_Pool.Failures == 0);
+
+    // a freed block is handed out again
+    Pool_Free(&s_Pool, items[1]);
+    CHECK(s_Pool.Used == BLOCKS - 1);
+    CHECK(Pool_Alloc(&s_Pool) == items[1]);
+    Pool_Free(&s_Pool, NULL);
+    CHECK(s_Pool.Used == BLOCKS);
+
+#ifdef POOL_STATIC
+    // a full pool fails and counts it
+    CHECK(!Pool_Reserve(&s_Pool, 1));
+    CHECK(!Pool_Alloc(&s_Pool));
+    CHECK(s_Pool.Failures == 1);
+    CHECK(s_Pool.Capacity == BLOCKS);
+#else
+    // a full pool grows by another slab
+    CHECK(Pool_Reserve(&s_Pool, 1));
+    CHECK(s_Pool.Capacity == 2 * BLOCKS);
+    for (int i = 0; i < BLOCKS + 1; ++i) {
+        Item* item = (Item*)Pool_Alloc(&s_Pool);
+        CHECK(item);
+        items.push_back(item);
+    }
+    CHECK(s_Pool.Capacity == 3 * BLOCKS);
+    CHECK(s_Pool.Used == 2 * BLOCKS + 1);
+    CHECK(s_Pool.Failures == 0);
+    CHECK(Pool_Footprint(&s_Pool) >= 3 * BLOCKS * sizeof(Item));
+    CHECK(Pool_First() == &s_Pool);
+#endif
+
+    // high water stays when blocks come back
+    const uint16_t highWater = s_Pool.HighWater;
+    for (size_t i = 0; i < items.size(); ++i) {
+        Pool_Free(&s_Pool, items[i]);
+    }
+    CHECK(s_Pool.Used == 0);
+    CHECK(s_Pool.HighWater == highWater);
+    CHECK(Pool_Reserve(&s_Pool, s_Pool.Capacity));
+
+    // init again starts over, releasing what the pool held
+    POOL_INIT(s_Pool, "test", sizeof(Item), BLOCKS);
+    CHECK(s_Pool.Used == 0);
+    CHECK(s_Pool.HighWater == 0);
+    CHECK(s_Pool.Failures == 0);
+#ifdef POOL_STATIC
+    CHECK(s_Pool.Capacity == BLOCKS);
+#else
+    CHECK(s_Pool.Capacity == 0);
+    CHECK(Pool_First() == &s_Pool && !s_Pool.Next);
+#endif
+
+    Pool_Uninit(&s_Pool);
+}
+
+#ifndef POOL_STATIC
+static
+void
+TestLimit() {
+    // capacity is counted in 16 bits, a pool stops growing before it wraps
+    POOL_INIT(s_Pool, "limit", 1, 0x8000);
+    for (int i = 0; i < 0x8000; ++i) {
+        if (!Pool_Alloc(&s_Pool)) {
+            CHECK(!"allocation failed");
+            break;
+        }
+    }
+    CHECK(!Pool_Alloc(&s_Pool));
+    CHECK(s_Pool.Failures == 1);
+    CHECK(s_Pool.Capacity == 0x8000);
+    Pool_Uninit(&s_Pool);
+}
+#endif
+
+int
+main() {
+    TestCapacity();
+#ifndef POOL_STATIC
+    TestLimit();
+#endif
+
+    return s_Failures;
+}
@@ -0,0 +1,124 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Reading_Parse over payloads as the weatherbug firmware sends them, text
+ * and binary, and sscanf on the text form for reference.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "../../Reading.h"
+
+#define PAYLOADS 1024
+#define ROUNDS 2000
+
+struct Payload {
+    uint8_t Size;
+    uint8_t Data[32];
+};
+
+static Payload s_Text[PAYLOADS];
+static Payload s_Binary[PAYLOADS];
+
+static
+void
+MakePayloads() {
+    static const char* const names[] = { "kitchen", "bath", "bedroom", "garden", "cellar" };
+    srand(1);
+    for (int i = 0; i < PAYLOADS; ++i) {
+        Reading reading;
+        memset(&reading, 0, sizeof(reading));
+        reading.Name = names[i % 5];
+        reading.NameLength = (uint8_t)strlen(reading.Name);
+        reading.Temperature = (int8_t)(rand() % 60 - 20);
+        reading.Humidity = (int8_t)(rand() % 100);
+        reading.MilliVolts = (uint16_t)(2000 + rand() % 1400);
+        reading.RawHumidity = (uint16_t)rand();
+        reading.Via = (uint8_t)rand();
+        reading.Interval = (uint16_t)i;
+
+        s_Text[i].Size = (uint8_t)snprintf((char*)s_Text[i].Data, sizeof(s_Text[i].Data), "WB%s;%d;%d;%u;%u;%02x",
+            reading.Name, reading.Temperature, reading.Humidity, reading.MilliVolts, reading.RawHumidity, reading.Via);
+        s_Binary[i].Size = Reading_Encode(s_Binary[i].Data, sizeof(s_Binary[i].Data), &reading);
+    }
+}
+
+static
+void
+Bench(const char* name, const Payload* payloads) {
+    uint32_t sum = 0;
+    unsigned parsed = 0;
+    const uint64_t start = NowNs();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < PAYLOADS; ++i) {
+            Reading reading;
+            if (Reading_Parse(payloads[i].Data, payloads[i].Size, &reading) == 0) {
+                sum += reading.MilliVolts;
+                ++parsed;
+            }
+        }
+    }
+    const uint64_t ns = NowNs() - start;
+
+    CHECK(parsed == PAYLOADS * ROUNDS);
+    printf("%-8s %5.1f ns per payload (%u)\n", name, (double)ns / (PAYLOADS * ROUNDS), sum);
+}
+
+static
+void
+BenchSscanf() {
+    uint32_t sum = 0;
+    unsigned parsed = 0;
+    const uint64_t start = NowNs();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < PAYLOADS; ++i) {
+            char text[33];
+            memcpy(text, s_Text[i].Data, s_Text[i].Size);
+            text[s_Text[i].Size] = 0;
+            char name[33];
+            int temperature, humidity;
+            unsigned milliVolts, rawHumidity, via;
+            if (sscanf(text, "WB%32[^;];%d;%d;%u;%u;%x", name, &temperature, &humidity, &milliVolts, &rawHumidity, &via) == 6) {
+                sum += milliVolts;
+                ++parsed;
+            }
+        }
+    }
+    const uint64_t ns = NowNs() - start;
+
+    CHECK(parsed == PAYLOADS * ROUNDS);
+    printf("%-8s %5.1f ns per payload (%u)\n", "sscanf", (double)ns / (PAYLOADS * ROUNDS), sum);
+}
+
+int
+main() {
+    MakePayloads();
+
+    Bench("text", s_Text);
+    Bench("binary", s_Binary);
+    BenchSscanf();
+
+    return s_Failures;
+}
@@ -0,0 +1,162 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include "../../Reading.h"
+#include "../../ReadingWindow.h"
+
+#include <string.h>
+
+static
+int8_t
+ParseText(const char* text, Reading* reading) {
+    return Reading_Parse(reinterpret_cast<const uint8_t*>(text), (uint8_t)strlen(text), reading);
+}
+
+static
+void
+TestBinary() {
+    Reading in;
+    memset(&in, 0, sizeof(in));
+    in.Name = "kitchen";
+    in.NameLength = 7;
+    in.Temperature = -12;
+    in.Humidity = 55;
+    in.MilliVolts = 3012;
+    in.RawHumidity = 0x1234;
+    in.Via = 0xab;
+    in.Interval = 0xfffe;
+
+    uint8_t buffer[32];
+    const uint8_t bytes = Reading_Encode(buffer, sizeof(buffer), &in);
+    CHECK(bytes == READING_BINARY_SIZE + 7);
+    CHECK(buffer[0] == READING_BINARY_MARKER);
+    CHECK(!Reading_Encode(buffer, bytes - 1, &in));
+
+    Reading out;
+    CHECK(Reading_Parse(buffer, bytes, &out) == 0);
+    CHECK(out.Temperature == -12);
+    CHECK(out.Humidity == 55);
+    CHECK(out.MilliVolts == 3012);
+    CHECK(out.RawHumidity == 0x1234);
+    CHECK(out.Via == 0xab);
+    CHECK(out.Interval == 0xfffe);
+    CHECK(out.Flags == READING_FLAG_INTERVAL);
+    CHECK(out.NameLength == 7 && !memcmp(out.Name, "kitchen", 7));
+
+    CHECK(Reading_Parse(buffer, READING_BINARY_SIZE - 1, &out) < 0);
+}
+
+static
+void
+TestText() {
+    Reading reading;
+    CHECK(ParseText("WBbath;-5;93;2950;40000;0f", &reading) == 0);
+    CHECK(reading.NameLength == 4 && !memcmp(reading.Name, "bath", 4));
+    CHECK(reading.Temperature == -5);
+    CHECK(reading.Humidity == 93);
+    CHECK(reading.MilliVolts == 2950);
+    CHECK(reading.RawHumidity == 40000);
+    CHECK(reading.Via == 0x0f);
+    CHECK(reading.Flags == 0);
+
+    // a single hex digit and a terminator
+    const char terminated[] = "WBx;1;2;3;4;A";
+    CHECK(Reading_Parse(reinterpret_cast<const uint8_t*>(terminated), sizeof(terminated), &reading) == 0);
+    CHECK(reading.Via == 0x0a);
+
+    const char* invalid[] = {
+        "",
+        "WB",
+        "XBbath;1;2;3;4;0f",
+        "WBbath;1;2;3;4",           // missing via
+        "WBbath;1;2;3;4;",
+        "WBbath;1;2;3;4;0g",
+        "WBbath;1;2;3;4;0f0",       // trailing garbage
+        "WBbath;1;2;3;4;0f;",
+        "WBbath;128;2;3;4;0f",      // temperature out of range
+        "WBbath;1;2;70000;4;0f",    // mV out of range
+        "WBbath;1;2;-3;4;0f",
+        "WBbath;;2;3;4;0f",
+        "WBbath;1,2;3;4;0f",
+        "WBbath;1;2;3;4;5;0f",
+        "WBabcdefghijklmnopqrstuvwxyz0123456789;1;2;3;4;0f", // name too long
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        if (ParseText(invalid[i], &reading) == 0) {
+            fprintf(stderr, "accepted %s\n", invalid[i]);
+            CHECK(!"invalid reading accepted");
+        }
+    }
+}
+
+static
+void
+TestWindow() {
+    ReadingWindow window;
+    memset(&window, 0, sizeof(window));
+
+    // duplicates within the window, in and out of order
+    CHECK(!ReadingWindow_Add(&window, 100));
+    CHECK(ReadingWindow_Add(&window, 100));
+    CHECK(!ReadingWindow_Add(&window, 102));
+    CHECK(!ReadingWindow_Add(&window, 101));
+    CHECK(ReadingWindow_Add(&window, 101));
+    CHECK(ReadingWindow_Add(&window, 102));
+    CHECK(ReadingWindow_Add(&window, 100));
+
+    // the oldest interval the window still knows, and one beyond
+    CHECK(!ReadingWindow_Add(&window, 102 + READING_WINDOW_SIZE - 1));
+    CHECK(ReadingWindow_Add(&window, 102));
+    CHECK(!ReadingWindow_Add(&window, 102 + READING_WINDOW_SIZE));
+    CHECK(!ReadingWindow_Add(&window, 102)); // restarted, not a duplicate
+
+    // a new epoch starts over, even close to the old intervals
+    memset(&window, 0, sizeof(window));
+    CHECK(!ReadingWindow_Add(&window, 5));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 3));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 5));
+    CHECK(ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 3));
+    // two power losses, the middle epoch never seen
+    CHECK(!ReadingWindow_Add(&window, 3));
+    CHECK(!ReadingWindow_Add(&window, 5));
+    CHECK(ReadingWindow_Add(&window, 3));
+
+    // the count wraps within an epoch
+    memset(&window, 0, sizeof(window));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x7ffe));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x0001));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x7fff));
+    CHECK(ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x7ffe));
+    CHECK(ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x0001));
+    CHECK(!ReadingWindow_Add(&window, READING_INTERVAL_EPOCH | 0x0000));
+}
+
+int
+main() {
+    TestBinary();
+    TestText();
+    TestWindow();
+
+    return s_Failures;
+}
@@ -0,0 +1,501 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Column store coding, block rollover, reopening and aggregates on files
+ * in /tmp. Includes rf24_store.cpp to reach the bit coder and the block
+ * headers.
+ */
+
+#include <stdlib.h>
+#include <vector>
+
+#include "check.h"
+#include "../rf24_store.cpp"
+
+static char s_Path[64];
+static char s_OtherPath[64];
+
+// Central European Time, DST from the last Sunday of March 02:00 to the
+// last Sunday of October 03:00, without relying on tzdata
+#define TZ_BERLIN   "CET-1CEST,M3.5.0,M10.5.0/3"
+
+// seconds since the epoch (UTC) around the 2026 changes
+#define MAR27_2300  UINT32_C(1774652400) // Mar 28 00:00 CET
+#define MAR28_2300  UINT32_C(1774738800) // Mar 29 00:00 CET
+#define MAR29_0100  UINT32_C(1774746000) // Mar 29 03:00 CEST, clocks go forward
+#define MAR29_2200  UINT32_C(1774821600) // Mar 30 00:00 CEST
+#define FEB28_2300  UINT32_C(1772319600) // Mar 1 00:00 CET
+#define MAR31_2200  UINT32_C(1774994400) // Apr 1 00:00 CEST
+#define APR30_2200  UINT32_C(1777586400) // May 1 00:00 CEST
+#define OCT24_2200  UINT32_C(1792879200) // Oct 25 00:00 CEST
+#define OCT25_2300  UINT32_C(1792969200) // Oct 26 00:00 CET
+
+static
+void
+Collect(void* ctx, const StoreReading& reading) {
+    static_cast<std::vector<StoreReading>*>(ctx)->push_back(reading);
+}
+
+static
+bool
+Equal(const StoreReading& a, const StoreReading& b) {
+    return a.Time == b.Time &&
+        a.Temperature == b.Temperature &&
+        a.Humidity == b.Humidity &&
+        a.MilliVolts == b.MilliVolts &&
+        a.RawHumidity == b.RawHumidity &&
+        a.Sender == b.Sender &&
+        a.Via == b.Via;
+}
+
+static
+StoreReading
+MakeReading(uint32_t time, int i) {
+    StoreReading reading;
+    memset(&reading, 0, sizeof(reading));
+    reading.Time = time;
+    reading.Temperature = (int16_t)(20 + i % 7 - 3);
+    reading.Humidity = (int16_t)(50 + i % 11);
+    reading.MilliVolts = (uint16_t)(3000 - i % 5);
+    reading.RawHumidity = (uint16_t)(500 + i % 13);
+    reading.Sender = 9;
+    reading.Via = (uint8_t)(i % 3 ? 9 : 4);
+    return reading;
+}
+
+static
+std::vector<StoreReading>
+ScanAll(const StoreSeries& series) {
+    std::vector<StoreReading> readings;
+    StoreSeries_Scan(series, 0, UINT32_MAX, Collect, &readings);
+    return readings;
+}
+
+static
+void
+TestCoding() {
+    // each prefix width at both ends, then the escapes
+    static const int32_t s_Times[] = { 0, 1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048, 2048, -2049, INT32_MAX, INT32_MIN };
+    static const uint8_t s_TimeBits[] = { 1, 9, 9, 9, 9, 12, 12, 12, 12, 16, 16, 16, 16, 36, 36, 36, 36 };
+    static const int32_t s_Values[] = { 0, 1, -1, 7, -8, 8, -9, 127, -128, 128, -129, 65535, -65535 };
+    static const uint8_t s_ValueBits[] = { 1, 6, 6, 6, 6, 11, 11, 11, 11, 20, 20, 20, 20 };
+
+    uint8_t data[256];
+    BitStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.Data = data;
+    stream.Capacity = sizeof(data) * 8;
+
+    uint32_t bits = 0;
+    for (size_t i = 0; i < sizeof(s_Times) / sizeof(s_Times[0]); ++i) {
+        PutTime(stream, s_Times[i]);
+        bits += s_TimeBits[i];
+        CHECK(stream.Bits == bits);
+    }
+    for (size_t i = 0; i < sizeof(s_Values) / sizeof(s_Values[0]); ++i) {
+        PutValue(stream, s_Values[i]);
+        bits += s_ValueBits[i];
+        CHECK(stream.Bits == bits);
+    }
+    CHECK(!stream.Overflow);
+
+    stream.Capacity = stream.Bits;
+    stream.Bits = 0;
+    for (size_t i = 0; i < sizeof(s_Times) / sizeof(s_Times[0]); ++i) {
+        CHECK(GetTime(stream) == s_Times[i]);
+    }
+    for (size_t i = 0; i < sizeof(s_Values) / sizeof(s_Values[0]); ++i) {
+        CHECK(GetValue(stream) == s_Values[i]);
+    }
+    CHECK(stream.Bits == stream.Capacity);
+
+    // the same through a series: a day long gap and full range battery swings
+    StoreSeries series;
+    unlink(s_Path);
+    CHECK(StoreSeries_Open(series, s_Path, "coding", true) == 0);
+    std::vector<StoreReading> written;
+    uint32_t time = 1000000;
+    for (int i = 0; i < 40; ++i) {
+        time += i == 20 ? 86400 : 60 + i % 3;
+        StoreReading reading = MakeReading(time, i);
+        if (i % 4 == 1) {
+            reading.MilliVolts = i % 8 == 1 ? 0 : UINT16_MAX;
+            reading.Temperature = (int16_t)(i % 8 == 1 ? INT16_MIN : INT16_MAX);
+        }
+        CHECK(StoreSeries_Append(series, reading) == 0);
+        written.push_back(reading);
+    }
+    const std::vector<StoreReading> read = ScanAll(series);
+    CHECK(read.size() == written.size());
+    for (size_t i = 0; i < read.size() && i < written.size(); ++i) {
+        CHECK(Equal(read[i], written[i]));
+    }
+    StoreSeries_Close(series);
+}
+
+static
+void
+TestRollover() {
+    StoreSeries series;
+    unlink(s_Path);
+    CHECK(StoreSeries_Open(series, s_Path, "rollover", true) == 0);
+
+    // identical readings take 7 bits each until the body overflows
+    std::vector<StoreReading> written;
+    uint32_t time = 1000000;
+    while (series.Current == 0 && written.size() < 1000) {
+        time += 60;
+        const StoreReading reading = MakeReading(time, 0);
+        CHECK(StoreSeries_Append(series, reading) == 0);
+        written.push_back(reading);
+    }
+    CHECK(series.Current == 1);
+    const StoreBlockHeader* first = Block(series, 0);
+    CHECK(first->Count + 1u == written.size());
+    CHECK(first->Bits > STORE_BLOCK_BODY_SIZE * 8 - 7); // no room for another
+    CHECK(first->LastTime + 60 == Block(series, 1)->FirstTime);
+    CHECK(Block(series, 1)->Count == 1);
+
+    // the next block starts from scratch and decodes on its own
+    std::vector<StoreReading> read = ScanAll(series);
+    CHECK(read.size() == written.size());
+    for (size_t i = 0; i < read.size() && i < written.size(); ++i) {
+        CHECK(Equal(read[i], written[i]));
+    }
+
+    // a block also ends once its count is about to wrap
+    Block(series, series.Current)->Count = UINT16_MAX;
+    CHECK(StoreSeries_Append(series, MakeReading(time + 60, 0)) == 0);
+    CHECK(series.Current == 2);
+    CHECK(Block(series, 1)->Count == UINT16_MAX);
+    CHECK(Block(series, 2)->Count == 1);
+
+    // and the file grows when blocks run out
+    const uint32_t blocks = series.Blocks;
+    for (uint32_t b = series.Current; b + 1 < blocks; ++b) {
+        Block(series, series.Current)->Count = UINT16_MAX;
+        CHECK(StoreSeries_Append(series, MakeReading(time + 60, 0)) == 0);
+    }
+    CHECK(series.Current + 1 == blocks);
+    Block(series, series.Current)->Count = UINT16_MAX;
+    CHECK(StoreSeries_Append(series, MakeReading(time + 60, 0)) == 0);
+    CHECK(series.Blocks == blocks + STORE_GROW_BLOCKS);
+    CHECK(series.Current == blocks);
+
+    StoreSeries_Close(series);
+}
+
+static
+void
+TestReopen() {
+    // appending after a reopen encodes exactly as without one
+    StoreSeries series, other;
+    unlink(s_Path);
+    unlink(s_OtherPath);
+    CHECK(StoreSeries_Open(series, s_Path, "reopen", true) == 0);
+    CHECK(StoreSeries_Open(other, s_OtherPath, "reopen", true) == 0);
+
+    std::vector<StoreReading> written;
+    uint32_t time = 1000000;
+    for (int i = 0; i < 50; ++i) {
+        time += 60 + i % 4;
+        written.push_back(MakeReading(time, i));
+    }
+    for (size_t i = 0; i < written.size(); ++i) {
+        CHECK(StoreSeries_Append(other, written[i]) == 0);
+        if (i == 20) {
+            StoreSeries_Close(series);
+            CHECK(StoreSeries_Open(series, s_Path, NULL, true) == 0);
+            CHECK(StoreSeries_LastTime(series) == written[i - 1].Time);
+            CHECK(!strcmp(series.Name, "reopen"));
+        }
+        CHECK(StoreSeries_Append(series, written[i]) == 0);
+    }
+
+    CHECK(series.Current == 0 && other.Current == 0);
+    CHECK(!memcmp(Block(series, 0), Block(other, 0), STORE_BLOCK_SIZE));
+    StoreSeries_Close(other);
+    StoreSeries_Close(series);
+
+    // and a reader sees it all
+    CHECK(StoreSeries_Open(series, s_Path, NULL, false) == 0);
+    const std::vector<StoreReading> read = ScanAll(series);
+    CHECK(read.size() == written.size());
+    for (size_t i = 0; i < read.size() && i < written.size(); ++i) {
+        CHECK(Equal(read[i], written[i]));
+    }
+    StoreSeries_Close(series);
+    unlink(s_OtherPath);
+}
+
+static
+void
+Aggregate(const std::vector<StoreReading>& readings, uint32_t from, uint32_t to, StoreAggregate& aggregate) {
+    StoreAggregate_Init(aggregate);
+    for (size_t i = 0; i < readings.size(); ++i) {
+        const StoreReading& reading = readings[i];
+        if (reading.Time < from || reading.Time >= to) {
+            continue;
+        }
+        int32_t values[STORE_STAT_COLUMNS];
+        StatValues(reading, values);
+        AddTimeRange(aggregate, reading.Time, reading.Time);
+        for (uint8_t c = 0; c < STORE_STAT_COLUMNS; ++c) {
+            if (!aggregate.Count || values[c] < aggregate.Min[c]) {
+                aggregate.Min[c] = values[c];
+            }
+            if (!aggregate.Count || values[c] > aggregate.Max[c]) {
+                aggregate.Max[c] = values[c];
+            }
+            aggregate.Sum[c] += values[c];
+        }
+        ++aggregate.Count;
+    }
+}
+
+static
+bool
+Equal(const StoreAggregate& a, const StoreAggregate& b) {
+    if (a.Count != b.Count || a.FirstTime != b.FirstTime || a.LastTime != b.LastTime) {
+        return false;
+    }
+    for (uint8_t c = 0; c < STORE_STAT_COLUMNS; ++c) {
+        if (a.Count && (a.Min[c] != b.Min[c] || a.Max[c] != b.Max[c] || a.Sum[c] != b.Sum[c])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+void
+TestAggregate() {
+    // header sums of whole blocks match decoding every reading
+    StoreSeries series;
+    unlink(s_Path);
+    CHECK(StoreSeries_Open(series, s_Path, "aggregate", true) == 0);
+    std::vector<StoreReading> written;
+    uint32_t time = 1000000;
+    for (int i = 0; i < 2000; ++i) {
+        time += 60 + i % 7;
+        written.push_back(MakeReading(time, i * 7919));
+        CHECK(StoreSeries_Append(series, written.back()) == 0);
+    }
+    CHECK(series.Current >= 3);
+
+    const uint32_t first = written.front().Time;
+    const uint32_t last = written.back().Time;
+    const uint32_t blockStart = Block(series, 1)->FirstTime;
+    const uint32_t blockEnd = Block(series, 2)->LastTime + 1;
+    const uint32_t ranges[][2] = {
+        { 0, UINT32_MAX },
+        { first, last + 1 },
+        { first + 1, last },
+        { blockStart, blockEnd },
+        { blockStart + 1, blockEnd - 1 },
+        { blockStart, blockStart + 1 },
+        { last + 1, UINT32_MAX },
+    };
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r) {
+        StoreAggregate fast, full;
+        StoreAggregate_Init(fast);
+        StoreSeries_Aggregate(series, ranges[r][0], ranges[r][1], fast);
+        Aggregate(written, ranges[r][0], ranges[r][1], full);
+        if (!Equal(fast, full)) {
+            fprintf(stderr, "range %zu\n", r);
+            CHECK(Equal(fast, full));
+        }
+    }
+
+    StoreAggregate aggregate;
+    StoreAggregate_Init(aggregate);
+    StoreSeries_Aggregate(series, 0, UINT32_MAX, aggregate);
+    CHECK(aggregate.BlocksSkipped == series.Current + 1);
+    CHECK(aggregate.BlocksDecoded == 0);
+
+    StoreAggregate_Init(aggregate);
+    StoreSeries_Aggregate(series, blockStart + 1, blockEnd - 1, aggregate);
+    CHECK(aggregate.BlocksDecoded == 2);
+
+    StoreSeries_Close(series);
+}
+
+static
+void
+TestMonotonic() {
+    // a reading from the past is stored at the time of the last one
+    StoreSeries series;
+    unlink(s_Path);
+    CHECK(StoreSeries_Open(series, s_Path, "monotonic", true) == 0);
+    CHECK(StoreSeries_LastTime(series) == 0);
+    CHECK(StoreSeries_Append(series, MakeReading(1000, 0)) == 0);
+    CHECK(StoreSeries_Append(series, MakeReading(900, 1)) == 0);
+    CHECK(StoreSeries_Append(series, MakeReading(1060, 2)) == 0);
+    CHECK(StoreSeries_LastTime(series) == 1060);
+
+    const std::vector<StoreReading> read = ScanAll(series);
+    CHECK(read.size() == 3);
+    if (read.size() == 3) {
+        CHECK(read[0].Time == 1000);
+        CHECK(read[1].Time == 1000);
+        CHECK(read[1].Temperature == MakeReading(900, 1).Temperature);
+        CHECK(read[2].Time == 1060);
+    }
+    StoreSeries_Close(series);
+}
+
+static
+void
+SetTimeZone(const char* tz) {
+    setenv("TZ", tz, 1);
+    tzset();
+}
+
+static
+void
+CheckBucket(uint8_t level, uint32_t t, uint32_t start, uint32_t end) {
+    uint32_t s = 0, e = 0;
+    Bucket(level, t, s, e);
+    if (s != start || e != end) {
+        fprintf(stderr, "%s bucket of %u is [%u, %u), expected [%u, %u)\n", Store_RollupLevelName(level), t, s, e, start, end);
+        CHECK(s == start && e == end);
+    }
+}
+
+static
+void
+TestBuckets() {
+    SetTimeZone(TZ_BERLIN);
+
+    // hours stay an hour long when the clocks go forward
+    CheckBucket(STORE_ROLLUP_HOUR, MAR29_0100 - 1, MAR29_0100 - 3600, MAR29_0100);
+    CheckBucket(STORE_ROLLUP_HOUR, MAR29_0100, MAR29_0100, MAR29_0100 + 3600);
+
+    // the day of the change has 23 hours in spring, 25 in autumn
+    CheckBucket(STORE_ROLLUP_DAY, MAR28_2300, MAR28_2300, MAR29_2200);
+    CheckBucket(STORE_ROLLUP_DAY, MAR29_0100, MAR28_2300, MAR29_2200);
+    CheckBucket(STORE_ROLLUP_DAY, MAR29_2200 - 1, MAR28_2300, MAR29_2200);
+    CheckBucket(STORE_ROLLUP_DAY, MAR28_2300 - 1, MAR27_2300, MAR28_2300);
+    CheckBucket(STORE_ROLLUP_DAY, OCT24_2200 + 12 * 3600, OCT24_2200, OCT25_2300);
+    CHECK(MAR29_2200 - MAR28_2300 == 23 * 3600);
+    CHECK(OCT25_2300 - OCT24_2200 == 25 * 3600);
+
+    // months follow the calendar in local time
+    CheckBucket(STORE_ROLLUP_MONTH, MAR29_0100, FEB28_2300, MAR31_2200);
+    CheckBucket(STORE_ROLLUP_MONTH, MAR31_2200 - 1, FEB28_2300, MAR31_2200);
+    CheckBucket(STORE_ROLLUP_MONTH, MAR31_2200, MAR31_2200, APR30_2200);
+
+    // with a half hour offset hours start at half past in UTC
+    SetTimeZone("IST-5:30");
+    CheckBucket(STORE_ROLLUP_HOUR, MAR29_0100, MAR29_0100 - 1800, MAR29_0100 + 1800);
+    CheckBucket(STORE_ROLLUP_DAY, MAR29_0100, MAR28_2300 - 4 * 3600 - 1800, MAR28_2300 - 4 * 3600 - 1800 + 24 * 3600);
+
+    SetTimeZone(TZ_BERLIN);
+}
+
+static
+void
+TestRollups() {
+    // a reading every hour from Mar 28 00:00 to Mar 31 00:00 local time
+    SetTimeZone(TZ_BERLIN);
+    StoreRollup rollups[STORE_ROLLUP_LEVELS];
+    for (uint8_t level = 0; level < STORE_ROLLUP_LEVELS; ++level) {
+        unlink(s_Path);
+        CHECK(StoreRollup_Open(rollups[level], s_Path, level, true) == 0);
+        unlink(s_Path); // mapped, the file isn't needed any more
+        CHECK(StoreRollup_LastTime(rollups[level]) == 0);
+    }
+
+    const uint32_t hours = 24 + 23 + 24;
+    for (uint32_t i = 0; i < hours; ++i) {
+        const StoreReading reading = MakeReading(MAR27_2300 + i * 3600 + 600, i);
+        for (uint8_t level = 0; level < STORE_ROLLUP_LEVELS; ++level) {
+            CHECK(StoreRollup_Add(rollups[level], reading) == 0);
+        }
+    }
+
+    // and one just before and after the end of the month
+    const StoreReading march = MakeReading(MAR31_2200 - 1, 0);
+    const StoreReading april = MakeReading(MAR31_2200, 1);
+    CHECK(StoreRollup_Add(rollups[STORE_ROLLUP_MONTH], march) == 0);
+    CHECK(StoreRollup_Add(rollups[STORE_ROLLUP_MONTH], april) == 0);
+
+    const StoreRollup& hour = rollups[STORE_ROLLUP_HOUR];
+    CHECK(hour.Rows == hours);
+    for (uint32_t r = 0; r < hour.Rows; ++r) {
+        const StoreRollupRow* row = Row(hour, r);
+        CHECK(row->Start == MAR27_2300 + r * 3600);
+        CHECK(row->End == row->Start + 3600);
+        CHECK(row->Count == 1);
+    }
+
+    const StoreRollup& day = rollups[STORE_ROLLUP_DAY];
+    CHECK(day.Rows == 3);
+    if (day.Rows == 3) {
+        CHECK(Row(day, 0)->Start == MAR27_2300 && Row(day, 0)->End == MAR28_2300);
+        CHECK(Row(day, 1)->Start == MAR28_2300 && Row(day, 1)->End == MAR29_2200);
+        CHECK(Row(day, 2)->Start == MAR29_2200 && Row(day, 2)->End == MAR29_2200 + 24 * 3600);
+        CHECK(Row(day, 0)->Count == 24);
+        CHECK(Row(day, 1)->Count == 23);
+        CHECK(Row(day, 2)->Count == 24);
+    }
+
+    const StoreRollup& month = rollups[STORE_ROLLUP_MONTH];
+    CHECK(month.Rows == 2);
+    if (month.Rows == 2) {
+        CHECK(Row(month, 0)->Start == FEB28_2300 && Row(month, 0)->End == MAR31_2200);
+        CHECK(Row(month, 0)->Count == hours + 1);
+        CHECK(Row(month, 0)->LastMilliVolts == march.MilliVolts);
+        CHECK(Row(month, 1)->Start == MAR31_2200 && Row(month, 1)->End == APR30_2200);
+        CHECK(Row(month, 1)->Count == 1);
+        CHECK(Row(month, 1)->FirstMilliVolts == april.MilliVolts);
+    }
+    CHECK(StoreRollup_LastTime(month) == MAR31_2200);
+    CHECK(StoreRollup_LastTime(day) == MAR27_2300 + (hours - 1) * 3600 + 600);
+
+    // a late reading counts in the last bucket and leaves the last time
+    CHECK(StoreRollup_Add(rollups[STORE_ROLLUP_MONTH], march) == 0);
+    CHECK(month.Rows == 2 && Row(month, 1)->Count == 2);
+    CHECK(StoreRollup_LastTime(month) == MAR31_2200);
+
+    for (uint8_t level = 0; level < STORE_ROLLUP_LEVELS; ++level) {
+        StoreRollup_Close(rollups[level]);
+    }
+}
+
+int
+main() {
+    snprintf(s_Path, sizeof(s_Path), "/tmp/store-test-%d.wbs", (int)getpid());
+    snprintf(s_OtherPath, sizeof(s_OtherPath), "/tmp/store-test-%d-other.wbs", (int)getpid());
+
+    TestCoding();
+    TestRollover();
+    TestReopen();
+    TestAggregate();
+    TestMonotonic();
+    TestBuckets();
+    TestRollups();
+
+    unlink(s_Path);
+    return s_Failures;
+}
@@ -0,0 +1,159 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Checksum cost of forwarding a frame: the bitwise CRC used on AVR, the
+ * host table and the table with the incremental Via patch. TCP.c is
+ * included to reach its static helpers.
+ *
+ * Ack frames per delivered frame for many senders, tcp-bench-ack1 acks
+ * every frame, see CMakeLists.txt.
+ */
+
+#include <stdlib.h>
+
+#include "check.h"
+#include "tcp_helpers.h"
+#include "../../TCP.c"
+
+#define FRAMES 1024
+#define ROUNDS 2000
+#define SENDERS 32
+#define BURST 8 // frames a sender sends back to back
+
+static
+uint8_t
+BitwiseCrc(TCP_Payload* tcp) {
+    const uint8_t loaded = tcp->Crc;
+    tcp->Crc = 0;
+    const uint8_t* ptr = (const uint8_t*)tcp;
+    uint8_t crc = 0xff;
+    for (uint8_t i = 0; i < sizeof(*tcp); ++i) {
+        crc ^= ptr[i];
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x80 ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    tcp->Crc = loaded;
+    return crc;
+}
+
+static TCP_Payload s_Frames[FRAMES];
+static uint8_t s_Vias[FRAMES];
+
+// three data frames of any size to one ack
+static
+void
+MakeFrames() {
+    srand(1);
+    for (int i = 0; i < FRAMES; ++i) {
+        TCP_Payload* tcp = &s_Frames[i];
+        memset(tcp, 0, sizeof(*tcp));
+        tcp->Seq = (uint8_t)i;
+        tcp->Sender = (uint8_t)(rand() % 32);
+        tcp->Destination = (uint8_t)(rand() % 32);
+        tcp->Via = (uint8_t)(rand() % 32);
+        tcp->Ack = i % 4 == 3;
+        tcp->Size = tcp->Ack ? 1 : 1 + rand() % TCP_PAYLOAD_SIZE;
+        for (uint8_t j = 0; j < tcp->Size; ++j) {
+            tcp->Data[j] = (uint8_t)rand();
+        }
+        StoreChecksum(tcp);
+        s_Vias[i] = (uint8_t)(rand() % 32);
+    }
+}
+
+static
+void
+Report(const char* name, uint64_t ns, unsigned valid) {
+    printf("%-28s %5.1f ns per forwarded frame (%u)\n", name, (double)ns / (FRAMES * ROUNDS), valid);
+}
+
+static
+void
+BenchAcks() {
+    const uint32_t acks = TCP_GetCounters()->Acks;
+    const uint32_t delivered = TCP_GetCounters()->Delivered;
+    for (int r = 0; r < ROUNDS / 10; ++r) {
+        for (uint8_t s = 0; s < SENDERS; ++s) {
+            for (int i = 0; i < BURST; ++i) {
+                Receive(Data(100 + s, (uint8_t)(r * BURST + i), 0));
+                Run(1);
+            }
+        }
+    }
+    Run(TCP_ACK_DELAY);
+
+    CHECK(TCP_GetCounters()->Delivered - delivered == ROUNDS / 10 * SENDERS * BURST);
+    printf("%u senders, bursts of %u: %.2f acks per delivered frame\n", SENDERS, BURST,
+           (double)(TCP_GetCounters()->Acks - acks) / (TCP_GetCounters()->Delivered - delivered));
+}
+
+int
+main() {
+    StartBatman();
+    Network_SetSendCallback(CaptureTcp);
+    TCP_Init();
+    MakeFrames();
+
+    unsigned valid = 0;
+    uint64_t start = NowNs();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < FRAMES; ++i) {
+            TCP_Payload* tcp = &s_Frames[i];
+            valid += BitwiseCrc(tcp) == tcp->Crc;
+            tcp->Via ^= s_Vias[i];
+            tcp->Crc = BitwiseCrc(tcp);
+        }
+    }
+    Report("bitwise, restamp", NowNs() - start, valid);
+
+    valid = 0;
+    start = NowNs();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < FRAMES; ++i) {
+            TCP_Payload* tcp = &s_Frames[i];
+            valid += IsChecksumValid(tcp);
+            tcp->Via ^= s_Vias[i];
+            StoreChecksum(tcp);
+        }
+    }
+    Report("table, restamp", NowNs() - start, valid);
+
+    valid = 0;
+    start = NowNs();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < FRAMES; ++i) {
+            TCP_Payload* tcp = &s_Frames[i];
+            valid += IsChecksumValid(tcp);
+            SetVia(tcp, tcp->Via ^ s_Vias[i]);
+        }
+    }
+    Report("table, Via patch", NowNs() - start, valid);
+    CHECK(valid == FRAMES * ROUNDS);
+
+    BenchAcks();
+
+    TCP_Uninit();
+    Batman_Uninit();
+    return s_Failures;
+}
@@ -0,0 +1,409 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string>
+
+#include "check.h"
+#include "tcp_helpers.h"
+
+static std::vector<std::string> s_Messages;
+
+static
+void
+MessageReceived(uint8_t, const uint8_t* payload, uint8_t size) {
+    s_Messages.push_back(std::string((const char*)payload, size));
+}
+
+// the message frames sent to destination, in order
+static
+std::vector<Frame>
+MessageFrames(uint8_t destination) {
+    std::vector<Frame> frames;
+    for (size_t i = 0; i < s_Sent.size(); ++i) {
+        if (s_Sent[i].Tcp.Destination == destination && s_Sent[i].Tcp.Message) {
+            frames.push_back(s_Sent[i].Tcp);
+        }
+    }
+    return frames;
+}
+
+// a frame as if it had been sent by sender to us
+static
+Frame
+Echo(Frame frame, uint8_t sender, uint8_t seq) {
+    frame.Seq = seq;
+    frame.Sender = sender;
+    frame.Via = MY_ADDRESS;
+    frame.Destination = MY_ADDRESS;
+    frame.Crc = Crc8(frame);
+    return frame;
+}
+
+static
+std::string
+Text(size_t size) {
+    std::string text;
+    for (size_t i = 0; i < size; ++i) {
+        text += (char)('a' + i % 26);
+    }
+    return text;
+}
+
+static
+void
+Reset() {
+    TCP_Purge();
+    s_Sent.clear();
+    s_Received.clear();
+}
+
+static
+void
+TestChecksum() {
+    // the table CRC accepts frames checksummed bit by bit
+    Receive(Data(5, 0, 0x1234));
+    CHECK(s_Received.size() == 1);
+
+    Frame corrupt = Data(5, 1, 0x1234);
+    corrupt.Crc ^= 1;
+    Receive(corrupt);
+    CHECK(s_Received.size() == 1);
+
+    // patching Via when forwarding gives the same CRC as recomputing it
+    AddRoute(3, 2, 100);
+    Frame forward = Data(5, 0, 0xbeef);
+    forward.Destination = 3;
+    forward.Crc = Crc8(forward);
+    s_Sent.clear();
+    Receive(forward);
+    CHECK(s_Sent.size() == 1);
+    if (s_Sent.size() == 1) {
+        CHECK(s_Sent[0].Tcp.Via == 2);
+        CHECK(s_Sent[0].Tcp.Crc == Crc8(s_Sent[0].Tcp));
+    }
+
+    Reset();
+}
+
+static
+void
+TestRtoBackoff() {
+    // unanswered frames back off 256, 512, ... up to 4096 ms
+    AddRoute(9, 2, 100);
+    Send(9, 1);
+    Run(256 + 512 + 1024 + 2048 + 4096 + 4096 + 1);
+    const uint32_t expected[] = { 256, 512, 1024, 2048, 4096, 4096 };
+    CHECK(s_Sent.size() == 1 + sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 1; i < s_Sent.size() && i <= sizeof(expected) / sizeof(expected[0]); ++i) {
+        CHECK(s_Sent[i].Time - s_Sent[i - 1].Time == expected[i - 1]);
+        CHECK(s_Sent[i].Tcp.Seq == 0);
+        CHECK(s_Sent[i].Tcp.Via == 2);
+    }
+
+    // Karn: the ack of a retransmitted frame gives no sample
+    const uint32_t samples = TCP_GetCounters()->RttSamples;
+    Receive(Ack(9, 0, 0));
+    CHECK(TCP_GetCounters()->RttSamples == samples);
+    CHECK(TCP_GetRto(9) == 256);
+
+    // srtt 40, rttvar 20 after the first sample
+    Send(8, 1);
+    Run(40);
+    Receive(Ack(8, 0, 0));
+    CHECK(TCP_GetCounters()->RttSamples == samples + 1);
+    CHECK(TCP_GetRto(8) == 40 + 4 * 20);
+
+    Reset();
+}
+
+static
+void
+TestTimingWheel() {
+    // deadlines beyond the wheel span wait for their turn
+    Send(9, 1);
+    Run(100);
+    CHECK(TCP_MillisecondsTillNextUpdate() == 156);
+    Run(155);
+    CHECK(s_Sent.size() == 1);
+    Run(1);
+    CHECK(s_Sent.size() == 2);
+    Run(511);
+    CHECK(s_Sent.size() == 2);
+    Run(1);
+    CHECK(s_Sent.size() == 3);
+
+    // a long pause retransmits once, not once per wheel turn
+    Advance(10000);
+    TCP_Update();
+    CHECK(s_Sent.size() == 4);
+
+    Reset();
+}
+
+static
+void
+TestSack() {
+    // receiver: a hole at 1, 2 and 3 are reported in the bitmap
+    Receive(Data(6, 0, 0));
+    Receive(Data(6, 2, 2));
+    Receive(Data(6, 3, 3));
+    CHECK(!s_Sent.empty());
+    if (!s_Sent.empty()) {
+        const Frame& ack = s_Sent.back().Tcp;
+        CHECK(ack.Ack && ack.Sack);
+        CHECK(ack.Seq == 0);
+        CHECK(ack.Data[0] == 0x06);
+    }
+    Receive(Data(6, 1, 1));
+    CHECK(s_Received.size() == 4);
+    for (size_t i = 0; i < s_Received.size(); ++i) {
+        CHECK(s_Received[i] == i);
+    }
+
+    // sender: only the frame in the hole is retransmitted
+    for (uint16_t i = 0; i < 4; ++i) {
+        Send(7, i);
+    }
+    const uint32_t acknowledged = TCP_GetCounters()->Acknowledged;
+    Receive(Ack(7, 0, 0x06));
+    CHECK(TCP_GetCounters()->Acknowledged == acknowledged + 3);
+    s_Sent.clear();
+    Run(256);
+    size_t retransmitted = 0;
+    for (size_t i = 0; i < s_Sent.size(); ++i) {
+        if (s_Sent[i].Tcp.Destination == 7) {
+            CHECK(s_Sent[i].Tcp.Seq == 1);
+            ++retransmitted;
+        }
+    }
+    CHECK(retransmitted >= 1);
+
+    Reset();
+}
+
+static
+void
+TestSendWindow() {
+    // a full send window refuses frames until an ack makes room
+    for (uint16_t i = 0; i < 8; ++i) {
+        CHECK(Send(15, i));
+    }
+    const size_t sent = s_Sent.size();
+    CHECK(!Send(15, 8));
+    CHECK(s_Sent.size() == sent);
+    Receive(Ack(15, 0, 0));
+    CHECK(Send(15, 8));
+    CHECK(s_Sent.size() == sent + 1);
+
+    Reset();
+}
+
+static
+void
+TestReorderWraparound() {
+    // pairs swapped and every frame sent twice, sequence numbers wrap twice
+    const uint16_t count = 600;
+    Receive(Data(10, 0, 0));
+    for (uint16_t i = 1; i < count; i += 2) {
+        const uint16_t order[2] = { (uint16_t)(i + 1 < count ? i + 1 : i), i };
+        for (int j = 0; j < 2; ++j) {
+            Receive(Data(10, (uint8_t)order[j], order[j]));
+            Receive(Data(10, (uint8_t)order[j], order[j]));
+            if (order[0] == order[1]) {
+                break;
+            }
+        }
+    }
+
+    CHECK(s_Received.size() == count);
+    for (size_t i = 0; i < s_Received.size(); ++i) {
+        if (s_Received[i] != i) {
+            CHECK(s_Received[i] == i);
+            break;
+        }
+    }
+    CHECK(TCP_GetCounters()->Duplicates >= count - 1);
+
+    Reset();
+}
+
+static
+void
+TestDelayedAcks() {
+    // in order frames are acked once per TCP_ACK_FRAMES
+    const uint32_t acks = TCP_GetCounters()->Acks;
+    for (uint8_t i = 0; i < 4; ++i) {
+        Receive(Data(11, i, i));
+    }
+    CHECK(TCP_GetCounters()->Acks == acks + 1);
+    CHECK(!s_Sent.empty() && s_Sent.back().Tcp.Seq == 3);
+
+    // or once the delay is over
+    Receive(Data(11, 4, 4));
+    CHECK(TCP_GetCounters()->Acks == acks + 1);
+    CHECK(TCP_MillisecondsTillNextUpdate() == 8);
+    Run(8);
+    CHECK(TCP_GetCounters()->Acks == acks + 2);
+    CHECK(s_Sent.back().Tcp.Seq == 4);
+
+    Reset();
+}
+
+static
+void
+TestCoalescing() {
+    // small messages queued before an update share a frame
+    const std::string parts[3] = { "ab", "cde", "f" };
+    for (int i = 0; i < 3; ++i) {
+        CHECK(TCP_SendMessage(8, (const uint8_t*)parts[i].data(), parts[i].size()));
+    }
+    CHECK(MessageFrames(8).empty());
+    Run(1);
+    const std::vector<Frame> frames = MessageFrames(8);
+    CHECK(frames.size() == 1);
+    if (frames.size() == 1) {
+        CHECK(frames[0].Size == 3 + 2 + 3 + 1);
+        Receive(Echo(frames[0], 8, 0));
+    }
+    CHECK(s_Messages.size() == 3);
+    for (size_t i = 0; i < s_Messages.size() && i < 3; ++i) {
+        CHECK(s_Messages[i] == parts[i]);
+    }
+
+    s_Messages.clear();
+    Reset();
+}
+
+static
+void
+TestFragmenting(size_t size) {
+    // a long message is split into records of TCP_PAYLOAD_SIZE-1 bytes
+    const std::string text = Text(size);
+    CHECK(TCP_SendMessage(9, (const uint8_t*)text.data(), text.size()));
+    Run(1);
+    const std::vector<Frame> frames = MessageFrames(9);
+    CHECK(frames.size() == (size + TCP_PAYLOAD_SIZE - 2) / (TCP_PAYLOAD_SIZE - 1));
+    for (size_t i = 0; i < frames.size(); ++i) {
+        const uint8_t header = frames[i].Data[0];
+        CHECK(!(header & 0x20) == (i != 0));
+        CHECK(!(header & 0x40) == (i != frames.size() - 1));
+        CHECK((header & 0x1f) == frames[i].Size - 1);
+    }
+
+    // and put together again on receive
+    for (size_t i = 0; i < frames.size(); ++i) {
+        Receive(Echo(frames[i], 9, (uint8_t)i));
+    }
+    CHECK(s_Messages.size() == 1 && s_Messages[0] == text);
+
+    s_Messages.clear();
+    Reset();
+}
+
+static
+void
+TestLostFragment() {
+    const std::string text = Text(TCP_MESSAGE_SIZE);
+    CHECK(TCP_SendMessage(12, (const uint8_t*)text.data(), text.size()));
+    Run(1);
+    const std::vector<Frame> frames = MessageFrames(12);
+    CHECK(frames.size() >= 3);
+    if (frames.size() < 3) {
+        Reset();
+        return;
+    }
+
+    // the receiver holds what follows a lost fragment until it comes again
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (i != 1) {
+            Receive(Echo(frames[i], 13, (uint8_t)i));
+        }
+    }
+    CHECK(s_Messages.empty());
+    Receive(Echo(frames[1], 13, 1));
+    CHECK(s_Messages.size() == 1 && s_Messages[0] == text);
+
+    // the sender retransmits only the lost fragment
+    s_Sent.clear();
+    // 0 acked, 1 is the hole, the rest arrived
+    Receive(Ack(12, 0, (uint8_t)(~(0xff << (frames.size() - 1)) & 0xfe)));
+    Run(512);
+    const std::vector<Frame> again = MessageFrames(12);
+    CHECK(!again.empty());
+    for (size_t i = 0; i < again.size(); ++i) {
+        CHECK(again[i].Seq == 1);
+        CHECK(!memcmp(again[i].Data, frames[1].Data, frames[1].Size));
+    }
+
+    s_Messages.clear();
+    Reset();
+}
+
+static
+void
+TestAllOrNothing() {
+    // a message that doesn't fit the send window is not sent at all
+    for (uint16_t i = 0; i < 6; ++i) {
+        CHECK(Send(14, i));
+    }
+    const std::string text = Text(3 * (TCP_PAYLOAD_SIZE - 1));
+    CHECK(!TCP_SendMessage(14, (const uint8_t*)text.data(), text.size()));
+    Run(1);
+    CHECK(MessageFrames(14).empty());
+
+    // one that does goes out whole
+    CHECK(TCP_SendMessage(14, (const uint8_t*)text.data(), 2 * (TCP_PAYLOAD_SIZE - 1)));
+    Run(1);
+    CHECK(MessageFrames(14).size() == 2);
+    CHECK(!TCP_SendMessage(14, (const uint8_t*)text.data(), 1));
+
+    Reset();
+}
+
+int
+main() {
+    StartBatman();
+    Network_SetSendCallback(CaptureTcp);
+    TCP_Init();
+    TCP_SetDataReceivedCallback(Received);
+
+    TestChecksum();
+    TestRtoBackoff();
+    TestTimingWheel();
+    TestSack();
+    TestSendWindow();
+    TestReorderWraparound();
+    TestDelayedAcks();
+
+    TCP_SetDataReceivedCallback(MessageReceived);
+    TestCoalescing();
+    TestFragmenting(64);
+    TestFragmenting(TCP_MESSAGE_SIZE);
+    TestLostFragment();
+    TestAllOrNothing();
+
+    TCP_Uninit();
+    Batman_Uninit();
+
+    return s_Failures;
+}
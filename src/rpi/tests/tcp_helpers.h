@@ -0,0 +1,159 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Helpers to drive TCP.c with frames from made up peers. */
+
+#ifndef TCP_HELPERS_H
+#define TCP_HELPERS_H
+
+#include <vector>
+
+#include "batman_helpers.h"
+#include "../../TCP.h"
+
+// same layout as TCP_Payload
+struct Frame {
+    uint8_t Seq;
+    uint8_t Sender;
+    uint8_t Via;
+    uint8_t Destination;
+    uint8_t Ack     : 1;
+    uint8_t Size    : 5;
+    uint8_t Sack    : 1;
+    uint8_t Message : 1;
+    uint8_t Crc;
+    uint8_t Data[TCP_PAYLOAD_SIZE];
+};
+
+struct Sent {
+    uint32_t Time;
+    Frame Tcp;
+};
+
+static std::vector<Sent> s_Sent;
+static std::vector<uint16_t> s_Received; // first two payload bytes
+
+// bitwise CRC-8 as in avr-libc, the reference for the host table
+static
+inline
+uint8_t
+Crc8(const Frame& frame) {
+    Frame copy = frame;
+    copy.Crc = 0;
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(&copy);
+    uint8_t crc = 0xff;
+    for (size_t i = 0; i < sizeof(copy); ++i) {
+        crc ^= ptr[i];
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x80 ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static
+inline
+void
+CaptureTcp(NetworkPacket* packet) {
+    if (packet->Type == TCP_PACKET_TYPE) {
+        Sent sent;
+        sent.Time = Time_Now();
+        memcpy(&sent.Tcp, packet->Payload, sizeof(sent.Tcp));
+        s_Sent.push_back(sent);
+    }
+}
+
+static
+inline
+void
+Received(uint8_t, const uint8_t* payload, uint8_t size) {
+    s_Received.push_back(size >= 2 ? (uint16_t)(payload[0] | (payload[1] << 8)) : 0xffff);
+}
+
+static
+inline
+void
+Receive(const Frame& frame) {
+    NetworkPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.Type = TCP_PACKET_TYPE;
+    packet.TTL = 8;
+    memcpy(packet.Payload, &frame, sizeof(frame));
+    TCP_Process(&packet);
+}
+
+static
+inline
+Frame
+Data(uint8_t sender, uint8_t seq, uint16_t value) {
+    Frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.Seq = seq;
+    frame.Sender = sender;
+    frame.Via = MY_ADDRESS;
+    frame.Destination = MY_ADDRESS;
+    frame.Size = 2;
+    frame.Data[0] = (uint8_t)value;
+    frame.Data[1] = (uint8_t)(value >> 8);
+    frame.Crc = Crc8(frame);
+    return frame;
+}
+
+static
+inline
+Frame
+Ack(uint8_t sender, uint8_t seq, uint8_t sack) {
+    Frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.Seq = seq;
+    frame.Sender = sender;
+    frame.Via = MY_ADDRESS;
+    frame.Destination = MY_ADDRESS;
+    frame.Ack = 1;
+    frame.Sack = 1;
+    frame.Size = 1;
+    frame.Data[0] = sack;
+    frame.Crc = Crc8(frame);
+    return frame;
+}
+
+static
+inline
+int8_t
+Send(uint8_t destination, uint16_t value) {
+    uint8_t data[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+    return TCP_Send(destination, data, sizeof(data));
+}
+
+// steps the clock in 1 ms ticks so retransmits are seen when they are due
+static
+inline
+void
+Run(uint32_t milliseconds) {
+    while (milliseconds--) {
+        Time_Update(1);
+        TCP_Update();
+    }
+}
+
+#endif // TCP_HELPERS_H
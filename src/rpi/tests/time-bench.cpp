@@ -0,0 +1,94 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Time_Process throughput against the number of peers, time-bench-list
+ * keeps all peers in one bucket, see CMakeLists.txt. Time.c is included
+ * to build the requests.
+ */
+
+#include "check.h"
+#include "../../Time.c"
+
+#define MY_ADDRESS 1
+#define PACKETS 4000000
+
+static
+void
+IgnoreSend(NetworkPacket*) {
+}
+
+static
+void
+Request(NetworkPacket* packet, uint8_t sender) {
+    memset(packet, 0, sizeof(*packet));
+    packet->Type = TIME_PACKET_TYPE;
+    packet->TTL = 8;
+    Time_Payload* t = (Time_Payload*)packet->Payload;
+    t->Sender = sender;
+    t->Originator = sender;
+    t->Stratum = 3;
+    t->Sources[0] = NOT_SYNCED_MARKER;
+}
+
+static
+void
+Bench(unsigned peers) {
+    Time_Init();
+    Time_SetStratum(1);
+
+    NetworkPacket packet;
+    for (unsigned a = 0; a < peers; ++a) {
+        Request(&packet, (uint8_t)(2 + a));
+        Time_Process(&packet);
+    }
+
+    const uint64_t start = NowNs();
+    for (uint32_t i = 0; i < PACKETS; ++i) {
+        Request(&packet, (uint8_t)(2 + i % peers));
+        Time_Process(&packet);
+    }
+    const uint64_t ns = NowNs() - start;
+
+    unsigned count = 0;
+    for (Peer* p = FirstPeer(); p; p = NextPeer(p)) {
+        ++count;
+    }
+    CHECK(count == peers);
+    printf("%3u peers, %3u buckets: %.1f ns per request\n", peers, TIME_PEER_BUCKETS, (double)ns / PACKETS);
+
+    Time_Uninit();
+}
+
+int
+main() {
+    Network_SetAddress(MY_ADDRESS);
+    Network_SetTtl(8);
+    Network_SetSendCallback(IgnoreSend);
+
+    Bench(4);
+    Bench(32);
+    Bench(128);
+    Bench(250);
+
+    return s_Failures;
+}
@@ -0,0 +1,245 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Time.c synced to a made up master with a perfect clock while the local
+ * clock runs fast. Time.c is included to reach its internals.
+ */
+
+#include "check.h"
+#include "../../Time.c"
+
+#define MY_ADDRESS 1
+#define MASTER 2
+
+static uint64_t s_TrueTime;  // [ms]
+static uint64_t s_LocalTime; // [ms] as counted by the local clock
+static int32_t s_Ppm;        // local clock error
+
+static
+void
+IgnoreSend(NetworkPacket*) {
+}
+
+// advances true time, Time.c sees the local clock
+static
+void
+Elapse(uint32_t milliseconds) {
+    s_TrueTime += milliseconds;
+    const uint64_t local = s_TrueTime * (1000000 + s_Ppm) / 1000000;
+    uint64_t step = local - s_LocalTime;
+    s_LocalTime = local;
+    while (step) {
+        const uint16_t chunk = step > 60000 ? 60000 : (uint16_t)step;
+        Time_Update(chunk);
+        step -= chunk;
+    }
+}
+
+static
+void
+Receive(uint8_t sender, uint8_t originator, uint8_t stratum, uint8_t window, uint32_t timeToInterval) {
+    NetworkPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.Type = TIME_PACKET_TYPE;
+    packet.TTL = 8;
+    Time_Payload* t = (Time_Payload*)packet.Payload;
+    t->Sender = sender;
+    t->Originator = originator;
+    t->SequenceNumber = s_SequenceNumber;
+    t->Stratum = stratum;
+    t->Window = window;
+    t->TimeToInterval = timeToInterval;
+    t->LocalTime = s_Mono; // no delay on air
+    t->Sources[0] = sender;
+    t->Sources[1] = NOT_SYNCED_MARKER;
+    Time_Process(&packet);
+}
+
+// the master's intervals start at multiples of NETWORK_PERIOD plus shift
+static
+uint32_t
+MasterTimeToInterval(uint32_t shift) {
+    return NETWORK_PERIOD - (uint32_t)((s_TrueTime + NETWORK_PERIOD - shift) % NETWORK_PERIOD);
+}
+
+// returns the phase error corrected by the sync [ms]
+static
+int32_t
+Sync(uint8_t window, uint32_t shift) {
+    Time_NotifyStartListening(0);
+    Receive(MASTER, MY_ADDRESS, 0, window, MasterTimeToInterval(shift));
+    Elapse(1);
+    Receive(MASTER, MY_ADDRESS, 0, window, MasterTimeToInterval(shift));
+    const uint32_t predicted = s_TimeToNextInterval;
+    Time_NotifyStopListening();
+    int32_t error = (int32_t)(s_TimeToNextInterval - predicted);
+    return error < 0 ? -error : error;
+}
+
+static
+void
+Start() {
+    Time_Init();
+    s_TrueTime = 0;
+    s_LocalTime = 0;
+    s_Ppm = 0;
+}
+
+static
+void
+TestDrift(int32_t ppm) {
+    Start();
+    s_Ppm = ppm; // 200 ppm are 245 ms per period
+
+    int32_t error = 0;
+    for (int i = 0; i < 40; ++i) {
+        error = Sync(0, 0);
+        Elapse(NETWORK_PERIOD);
+    }
+
+    CHECK(Time_IsSynced());
+    CHECK(Time_GetDriftPpm() >= ppm - 10 && Time_GetDriftPpm() <= ppm + 10);
+    CHECK(error <= 5);
+
+    Time_Uninit();
+}
+
+static
+void
+TestWindow() {
+    Start();
+    s_Ppm = 100;
+    CHECK(Guard() == TIME_GUARD_MAX);
+
+    // the guard band shrinks as the sync error settles
+    for (int i = 0; i < 40; ++i) {
+        Sync(100, 0);
+        Elapse(NETWORK_PERIOD);
+    }
+    CHECK(Guard() <= TIME_GUARD_MIN + TIME_GUARD_PER_STRATUM + 16);
+    CHECK(Time_GetWindowDuration() == UINT32_C(100) * TIME_WINDOW_UNIT + Guard());
+
+    // the next interval listens that long
+    uint32_t start = 0;
+    uint32_t stop = 0;
+    while (!stop) {
+        const uint8_t wasIn = s_Flags & _BV(TIME_INTERVAL);
+        Elapse(1);
+        const uint8_t in = s_Flags & _BV(TIME_INTERVAL);
+        if (!wasIn && in) {
+            start = Time_Now();
+        } else if (wasIn && !in && start) {
+            stop = Time_Now();
+        }
+    }
+    CHECK(stop - start >= Time_GetWindowDuration() && stop - start <= Time_GetWindowDuration() + 1);
+
+    // a master that jumped is a resync, the error is unknown again
+    Sync(100, 10000);
+    CHECK(Guard() == TIME_GUARD_MAX);
+
+    Time_Uninit();
+}
+
+static
+unsigned
+CountPeers() {
+    unsigned count = 0;
+    for (Peer* p = FirstPeer(); p; p = NextPeer(p)) {
+        ++count;
+    }
+    return count;
+}
+
+static
+void
+TestPeers() {
+    Start();
+    Time_SetStratum(1);
+
+    // every requester gets a peer, visited once and found in its bucket
+    for (unsigned a = 2; a < 202; ++a) {
+        Receive(a, a, 3, 0, 0);
+    }
+    CHECK(CountPeers() == 200);
+    uint8_t seen[256] = { 0 };
+    for (Peer* p = FirstPeer(); p; p = NextPeer(p)) {
+        CHECK(!seen[p->Address]);
+        seen[p->Address] = 1;
+        CHECK(FindPeer(p->Address) == p);
+    }
+
+    // a peer that timed out before the sweep starts over on contact
+    Elapse(TIME_PURGE_TIMEOUT - 1000);
+    CHECK(CountPeers() == 200);
+    s_LastPruneTime = s_Mono;
+    Elapse(2000);
+    CHECK(CountPeers() == 200);
+    Receive(2, 2, 5, 0, 0);
+    CHECK(FindPeer(2) && FindPeer(2)->Stratum == 5);
+    Receive(3, 3, 5, 0, 0);
+    CHECK(FindPeer(3) && FindPeer(3)->Stratum == 5);
+
+    // the next sweep drops the silent ones
+    Elapse(TIME_PRUNE_INTERVAL);
+    CHECK(CountPeers() == 2);
+
+    Time_Uninit();
+}
+
+static
+void
+TestInterval() {
+    Start();
+    Time_ResetInterval();
+    for (int i = 0; i < 3; ++i) {
+        Sync(0, 0);
+        Elapse(NETWORK_PERIOD);
+    }
+    const uint16_t interval = Time_GetInterval();
+    CHECK(interval >= 3 && interval <= 4);
+
+    // the count outlives a warm restart, power loss starts it over
+    Time_Uninit();
+    Time_Init();
+    CHECK(Time_GetInterval() == interval);
+    Time_ResetInterval();
+    CHECK(Time_GetInterval() == 0);
+
+    Time_Uninit();
+}
+
+int
+main() {
+    Network_SetAddress(MY_ADDRESS);
+    Network_SetTtl(8);
+    Network_SetSendCallback(IgnoreSend);
+
+    TestDrift(200);
+    TestDrift(-300);
+    TestWindow();
+    TestPeers();
+    TestInterval();
+
+    return s_Failures;
+}
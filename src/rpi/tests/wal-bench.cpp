@@ -0,0 +1,153 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Write amplification of the write ahead log against logging a line per
+ * reading with write and fdatasync. A sync rewrites every page touched
+ * since the last one, so pages flushed per reading is what wears an SD
+ * card. Pass a directory to run on something other than /tmp.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "../rf24_wal.h"
+
+#define READINGS 4096
+#define PAGE_SIZE 4096
+
+struct Stats {
+    uint64_t Bytes;
+    uint64_t Syncs;
+    uint64_t Pages;
+};
+
+static char s_Lines[READINGS][48];
+static uint64_t s_LineBytes;
+
+static
+void
+MakeLines() {
+    static const char* const names[] = { "kitchen", "bath", "bedroom", "garden", "cellar" };
+    for (int i = 0; i < READINGS; ++i) {
+        snprintf(s_Lines[i], sizeof(s_Lines[i]), "%u WB%s;%d;%d;%u;%u;%02x\n",
+            1500000000 + i, names[i % 5], i % 40, i % 100, 3000 + i % 300, i * 7 % 65536, i % 256);
+        s_LineBytes += strlen(s_Lines[i]);
+    }
+}
+
+// pages holding the bytes from offset from to offset to
+static
+uint64_t
+Pages(uint64_t from, uint64_t to) {
+    return to > from ? (to - 1) / PAGE_SIZE - from / PAGE_SIZE + 1 : 0;
+}
+
+static
+void
+Report(const char* name, const Stats& stats, uint64_t ns) {
+    printf("%-18s %6.1f bytes %5.3f syncs %5.3f pages per reading, amplification %5.1f, %7.1f us per reading\n",
+           name,
+           (double)stats.Bytes / READINGS,
+           (double)stats.Syncs / READINGS,
+           (double)stats.Pages / READINGS,
+           (double)stats.Pages * PAGE_SIZE / s_LineBytes,
+           (double)ns / 1000 / READINGS);
+}
+
+static
+void
+BenchLines(const char* path) {
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    unlink(path);
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+
+    const uint64_t start = NowNs();
+    for (int i = 0; i < READINGS; ++i) {
+        const size_t size = strlen(s_Lines[i]);
+        CHECK(write(fd, s_Lines[i], size) == (ssize_t)size);
+        CHECK(fdatasync(fd) == 0);
+        stats.Pages += Pages(stats.Bytes, stats.Bytes + size);
+        stats.Bytes += size;
+        ++stats.Syncs;
+    }
+    const uint64_t ns = NowNs() - start;
+
+    close(fd);
+    unlink(path);
+    Report("line by line", stats, ns);
+}
+
+// commits every group readings, as a sync interval would
+static
+void
+BenchWal(const char* path, int group) {
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    unlink(path);
+    Wal wal;
+    CHECK(Wal_Open(wal, path, NULL, NULL) == 0);
+
+    const uint64_t start = NowNs();
+    uint64_t synced = wal.Size;
+    for (int i = 0; i < READINGS; ++i) {
+        char* line = strchr(s_Lines[i], ' ') + 1;
+        CHECK(Wal_Append(wal, 1500000000 + i, (const uint8_t*)line, (uint16_t)strlen(line)) == 0);
+        if ((i + 1) % group == 0 || i + 1 == READINGS) {
+            CHECK(Wal_Commit(wal) == 0);
+        }
+        if (wal.Size != synced) { // also on a full buffer
+            stats.Pages += Pages(synced, wal.Size);
+            synced = wal.Size;
+        }
+    }
+    const uint64_t ns = NowNs() - start;
+
+    stats.Bytes = wal.BytesWritten;
+    stats.Syncs = wal.Commits;
+    Wal_Close(wal);
+    unlink(path);
+
+    char name[32];
+    snprintf(name, sizeof(name), "wal, %d per sync", group);
+    Report(name, stats, ns);
+}
+
+int
+main(int argc, char** argv) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/wal-bench-%d", argc > 1 ? argv[1] : "/tmp", (int)getpid());
+
+    MakeLines();
+    printf("%d readings, %.1f bytes per line\n", READINGS, (double)s_LineBytes / READINGS);
+
+    BenchLines(path);
+    BenchWal(path, 1);
+    BenchWal(path, 16);
+    BenchWal(path, 256);
+
+    return s_Failures;
+}
@@ -0,0 +1,253 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2017 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Write ahead log replay, torn tail recovery and checkpoints on a file
+ * in /tmp.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+
+#include "check.h"
+#include "../rf24_wal.h"
+
+struct Seen {
+    uint32_t Sequence;
+    uint32_t Time;
+    std::string Payload;
+};
+
+static std::vector<Seen> s_Seen;
+static char s_Path[64];
+
+static
+void
+Collect(void*, const WalRecord& record) {
+    Seen seen;
+    seen.Sequence = record.Sequence;
+    seen.Time = record.Time;
+    seen.Payload.assign((const char*)record.Payload, record.Length);
+    s_Seen.push_back(seen);
+}
+
+static
+int
+Append(Wal& wal, uint32_t time, const char* payload) {
+    return Wal_Append(wal, time, (const uint8_t*)payload, (uint16_t)strlen(payload));
+}
+
+static
+off_t
+FileSize() {
+    struct stat st;
+    return stat(s_Path, &st) == 0 ? st.st_size : -1;
+}
+
+// records 0..count-1 with payloads "reading i" in order
+static
+bool
+SeenInOrder(unsigned count) {
+    if (s_Seen.size() != count) {
+        return false;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "reading %u", i);
+        if (s_Seen[i].Sequence != i || s_Seen[i].Time != 1000 + i || s_Seen[i].Payload != payload) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static
+void
+AppendReadings(Wal& wal, unsigned first, unsigned count) {
+    for (unsigned i = first; i < first + count; ++i) {
+        char payload[32];
+        snprintf(payload, sizeof(payload), "reading %u", i);
+        CHECK(Append(wal, 1000 + i, payload) == 0);
+    }
+}
+
+static
+void
+TestReplay() {
+    Wal wal;
+    unlink(s_Path);
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+
+    // nothing is handed downstream before the commit
+    AppendReadings(wal, 0, 3);
+    CHECK(s_Seen.empty());
+    CHECK(Wal_Commit(wal) == 0);
+    CHECK(SeenInOrder(3));
+    CHECK(wal.Commits == 1);
+    CHECK(FileSize() == wal.Size);
+    Wal_Close(wal);
+
+    // the committed records come back in order, the sequence continues
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(3));
+    CHECK(wal.Sequence == 3);
+    AppendReadings(wal, 3, 2);
+    Wal_Close(wal); // commits
+
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(5));
+    Wal_Close(wal);
+}
+
+static
+void
+TestTornTail() {
+    Wal wal;
+    unlink(s_Path);
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    AppendReadings(wal, 0, 4);
+    Wal_Close(wal);
+    const off_t full = FileSize();
+
+    // power fails half way through the last record
+    CHECK(truncate(s_Path, full - 3) == 0);
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(3));
+    CHECK(wal.Sequence == 3);
+    CHECK(FileSize() < full - 3);
+    CHECK(FileSize() == wal.Size);
+
+    // appending resumes right after the valid prefix
+    AppendReadings(wal, 3, 1);
+    Wal_Close(wal);
+    CHECK(FileSize() == full);
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(4));
+    Wal_Close(wal);
+
+    // a flipped bit in a record drops it and everything after it
+    int fd = open(s_Path, O_RDWR);
+    CHECK(fd >= 0);
+    const uint8_t garbage = 0x5a;
+    CHECK(pwrite(fd, &garbage, 1, full - 2) == 1);
+    close(fd);
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(3));
+    Wal_Close(wal);
+}
+
+static
+void
+TestErrors() {
+    Wal wal;
+
+    // a file that isn't a log is left alone
+    int fd = open(s_Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    CHECK(write(fd, "temp=21.5 humidity=40\n", 22) == 22);
+    close(fd);
+    errno = 0;
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == -1);
+    CHECK(errno == EPROTO);
+    CHECK(FileSize() == 22);
+
+    unlink(s_Path);
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    uint8_t big[WAL_MAX_PAYLOAD + 1];
+    memset(big, 'x', sizeof(big));
+    errno = 0;
+    CHECK(Wal_Append(wal, 0, big, sizeof(big)) == -1);
+    CHECK(errno == EINVAL);
+    CHECK(wal.Pending == 0);
+    CHECK(Wal_Append(wal, 0, big, WAL_MAX_PAYLOAD) == 0);
+    Wal_Close(wal);
+}
+
+static
+void
+TestCheckpoint() {
+    Wal wal;
+    unlink(s_Path);
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    const uint32_t empty = wal.Size;
+    AppendReadings(wal, 0, 3);
+    CHECK(Wal_Commit(wal) == 0);
+    CHECK(Wal_Reset(wal) == 0);
+    CHECK(wal.Size == empty);
+    CHECK(FileSize() == empty);
+    Wal_Close(wal);
+
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(s_Seen.empty());
+    Wal_Close(wal);
+}
+
+static
+void
+TestGroupCommit() {
+    Wal wal;
+    unlink(s_Path);
+    CHECK(Wal_Open(wal, s_Path, NULL, NULL) == 0);
+    const uint32_t empty = wal.Size;
+
+    // a full buffer commits on its own, one write per group
+    unsigned count = 0;
+    while (wal.Commits == 0) {
+        AppendReadings(wal, count++, 1);
+    }
+    CHECK(count > 100);
+    CHECK(wal.Pending == 1);
+    CHECK(FileSize() == wal.Size);
+    CHECK(wal.BytesWritten == wal.Size - empty);
+    Wal_Close(wal);
+    CHECK(wal.Commits == 2);
+
+    s_Seen.clear();
+    CHECK(Wal_Open(wal, s_Path, Collect, NULL) == 0);
+    CHECK(SeenInOrder(count));
+    Wal_Close(wal);
+}
+
+int
+main() {
+    snprintf(s_Path, sizeof(s_Path), "/tmp/wal-test-%d.wal", (int)getpid());
+
+    TestReplay();
+    TestTornTail();
+    TestErrors();
+    TestCheckpoint();
+    TestGroupCommit();
+
+    unlink(s_Path);
+    return s_Failures;
+}